@@ -9,6 +9,7 @@ struct you_entry {
     uint64_t vaddr;
     uint64_t paddr;
     size_t num_pages;
+    uint32_t flags; // ELF p_flags of a segment
 };
 
 struct you {
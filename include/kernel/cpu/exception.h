@@ -1,6 +1,12 @@
 #pragma once
 #include <stdint.h>
 
+// Page fault error code bits
+#define PAGE_FAULT_PRESENT (1 << 0) // Protection violation, not a missing page
+#define PAGE_FAULT_WRITE   (1 << 1)
+#define PAGE_FAULT_USER    (1 << 2)
+#define PAGE_FAULT_FETCH   (1 << 4)
+
 struct [[gnu::packed]] exception_frame {
     uint64_t rip;
     uint64_t cs;
@@ -35,3 +41,7 @@ struct [[gnu::packed]] exception_frame {
 [[gnu::interrupt]] void exception_handler_vmm_communication(struct exception_frame* frame, uint64_t code);
 [[gnu::interrupt]] void exception_handler_security_exception(struct exception_frame* frame, uint64_t code);
 // clang-format on
+
+// Called with the faulting address before panicking, the faulting access is
+// retried if it returns true.
+void page_fault_set_handler(bool (*handler)(void* vaddr, uint64_t code));
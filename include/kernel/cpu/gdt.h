@@ -7,4 +7,9 @@
 #define GDT_USER_DATA_OFFSET   0x20
 #define GDT_TSS_OFFSET         0x28
 
+#define TSS_IST_DOUBLE_FAULT 1 // Index of the double fault stack, from 1
+
 void gdt_init(void);
+
+// Sets the stack the CPU switches to on an interrupt or exception in ring 3.
+void tss_set_rsp0(void* rsp0);
@@ -3,3 +3,4 @@
 
 void idt_init(void);
 void idt_set_descriptor(uint8_t vector, void* isr, uint8_t flags);
+void idt_set_ist(uint8_t vector, uint8_t ist); // 0 keeps the current stack
@@ -3,13 +3,25 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define KERNEL_BASE  0xffffffff80000000
-#define PHYSMAP_BASE 0xffff888000000000
+#define KERNEL_HALF_BASE 0xffff800000000000
+#define KERNEL_BASE      0xffffffff80000000
+#define PHYSMAP_BASE     0xffff888000000000
+#define VMALLOC_BASE     0xffffc90000000000
+#define VMALLOC_END      0xffffe90000000000
+
+// User half addresses nothing maps before the first process, for tests that
+// need user mappings. Each test takes a slot of its own.
+#define USER_TEST_BASE      0x0000500000000000
+#define USER_TEST_SLOT_SIZE 0x0000010000000000 // 1 TiB
+#define USER_TEST_SLOT(n)   ((char*)USER_TEST_BASE + (n) * USER_TEST_SLOT_SIZE)
 
 #define PAGE_SIZE      4096
 #define PAGE_SIZE_BITS 12
 #define PADDR_BITS     40
 
+#define LARGE_PAGE_SIZE (PAGE_SIZE * PT_ENTRIES)       // 2 MiB, by a PD entry
+#define HUGE_PAGE_SIZE  (LARGE_PAGE_SIZE * PD_ENTRIES) // 1 GiB, by a PDPT entry
+
 #define PAGE_MASK             (~((uintptr_t)0xFFF))
 #define PAGE_ALIGN_DOWN(addr) ((void*)((uintptr_t)(addr) & PAGE_MASK))
 #define PAGE_ALIGN_UP(addr)   ((void*)(((uintptr_t)(addr) + 0xFFF) & PAGE_MASK))
@@ -28,13 +40,28 @@ struct [[gnu::packed]] pt_entry {
     uint64_t page_cache_disabled : 1;
     uint64_t accessed : 1;
     uint64_t available_1 : 1;
-    uint64_t zero_1 : 1;
-    uint64_t available_2 : 4;
+    uint64_t page_size : 1; // Maps a large page, PAT in a PT entry
+    uint64_t global : 1;    // Kept in the TLB across CR3 loads, kernel half
+    uint64_t available_2 : 3;
     uint64_t address : 40;
     uint64_t available_3 : 11;
     uint64_t execute_disable : 1;
 };
 
+/*
+    Memory types, selected by an entry's PWT, PCD and PAT bits through the
+    PAT, which paging_enable_features programs so the first four types have
+    their power-on encodings and WC is the fifth.
+*/
+enum memory_type {
+    MEMORY_TYPE_WB, // Write-back, for RAM
+    MEMORY_TYPE_WT, // Write-through
+    MEMORY_TYPE_UC, // Uncacheable, for device registers
+    MEMORY_TYPE_WC, // Write-combining, for framebuffers
+};
+
+struct mmu_gather;
+
 union [[gnu::packed]] vaddr {
     uint64_t raw;
     struct {
@@ -47,13 +74,16 @@ union [[gnu::packed]] vaddr {
     };
 };
 
-extern struct pt_entry* pml4_vaddr;
+extern struct pt_entry* pml4_vaddr; // Of the loaded address space
 
 void paging_init(void);
+void paging_enable_features(void);
+void* alloc_page_table(void);
+void free_page_table(void* table);
+void alloc_kernel_pdpts(void);
 
 void map_page(void* paddr, void* vaddr, bool read_write, bool user_supervisor,
-              bool page_write_through, bool page_cache_disabled,
-              bool execute_disable);
+              enum memory_type type, bool execute_disable);
 void map_page_kernel_code(void* paddr, void* vaddr);
 void map_page_kernel_data(void* paddr, void* vaddr);
 void map_page_kernel_rodata(void* paddr, void* vaddr);
@@ -63,8 +93,7 @@ void map_page_user_rodata(void* paddr, void* vaddr);
 void map_page_dma(void* paddr, void* vaddr);
 
 void map_pages(void* paddr, void* vaddr, bool read_write, bool user_supervisor,
-               bool page_write_through, bool page_cache_disabled,
-               bool execute_disable, size_t num_pages);
+               enum memory_type type, bool execute_disable, size_t num_pages);
 void map_pages_kernel_code(void* paddr, void* vaddr, size_t num_pages);
 void map_pages_kernel_data(void* paddr, void* vaddr, size_t num_pages);
 void map_pages_kernel_rodata(void* paddr, void* vaddr, size_t num_pages);
@@ -73,8 +102,53 @@ void map_pages_user_data(void* paddr, void* vaddr, size_t num_pages);
 void map_pages_user_rodata(void* paddr, void* vaddr, size_t num_pages);
 void map_pages_dma(void* paddr, void* vaddr, size_t num_pages);
 
-void unmap_page(void* vaddr);
+// Maps a LARGE_PAGE_SIZE or HUGE_PAGE_SIZE page, both addresses aligned to it.
+void map_large_page(void* paddr, void* vaddr, size_t page_size,
+                    bool read_write, bool user_supervisor,
+                    enum memory_type type, bool execute_disable);
+bool huge_pages_supported(void);
+
+/*
+    Maps size bytes at paddr to vaddr walking each table once, with 2 MiB and
+    1 GiB pages where large_pages is set and both addresses are aligned and
+    the range covers the page. Large pages are for kernel mappings only,
+    map_pages uses them for those and never for user mappings.
+*/
+void map_range(void* paddr, void* vaddr, size_t size, bool read_write,
+               bool user_supervisor, enum memory_type type,
+               bool execute_disable, bool large_pages);
+
+/*
+    Unmaps what is mapped in the range and frees the page tables left empty.
+    The gather variant leaves flushing the TLB and freeing the tables to
+    mmu_gather_finish, so several ranges can share one flush.
+*/
+void unmap_range(void* vaddr, size_t size);
+void unmap_range_gather(void* vaddr, size_t size, struct mmu_gather* tlb);
+
+/*
+    Frees the user half of a PML4 that is not loaded, dropping a reference on
+    every frame mapped there. See address_space.h.
+*/
+void free_user_half(struct pt_entry* pml4);
+
+// Copy-on-write sharing of a user half, see address_space_fork.
+size_t copy_user_half_cow(struct pt_entry* dst, struct pt_entry* src);
+bool break_cow(void* vaddr);
+
+/*
+    Mapping or unmapping a single page inside a large page first splits the
+    large page into a table of smaller ones with the same attributes.
+*/
+void* unmap_page(void* vaddr); // Returns the physical address it mapped to
 void unmap_pages(void* vaddr, size_t num_pages);
 
+// Walks the page tables, returns NULL if vaddr is not mapped.
+void* lookup_paddr(void* vaddr);
+
 void* paddr_to_vaddr(void* paddr);
 void* vaddr_to_paddr(void* vaddr);
+
+#ifdef TEST
+void paging_test(void);
+#endif
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CR4_PGE   (1 << 7)
+#define CR4_PCIDE (1 << 17)
+
+#define CR3_NOFLUSH (1ull << 63) // Keep the new PCID's TLB entries
+#define PCID_MAX    4095
+
+// Flushing more pages than this one at a time costs more than a full flush.
+#define TLB_FLUSH_THRESHOLD 32
+#define MMU_GATHER_TABLES   16
+
+/*
+    Collects what an unmap invalidates so it is flushed once at the end,
+    page by page over the range or, above TLB_FLUSH_THRESHOLD pages, all at
+    once. Page tables the unmap emptied are only freed after the flush, the
+    walker may still hold them in its paging-structure caches until then.
+*/
+struct mmu_gather {
+    uintptr_t start;  // First byte to invalidate
+    uintptr_t last;   // Last one, inclusive so the range can end at 2^64
+    size_t stride;    // Smallest page size unmapped, 0 when nothing was
+    bool kernel_half; // Global entries or shared tables are involved
+    void* tables[MMU_GATHER_TABLES];
+    size_t num_tables;
+};
+
+void mmu_gather_init(struct mmu_gather* tlb);
+void mmu_gather_add(struct mmu_gather* tlb, uintptr_t vaddr, size_t page_size);
+void mmu_gather_add_table(struct mmu_gather* tlb, uintptr_t vaddr,
+                          void* table);
+void mmu_gather_flush(struct mmu_gather* tlb);
+void mmu_gather_finish(struct mmu_gather* tlb); // Flushes and frees tables
+
+void tlb_flush_page(void* vaddr);
+void tlb_flush(void);     // Non-global entries of the current PCID
+void tlb_flush_all(void); // Every entry of every PCID, global ones too
+
+bool pcid_enabled(void);
+
+/*
+    Switches to the page tables at pml4_paddr tagged with pcid. Unless flush
+    is set the TLB entries left from the last time pcid was loaded are kept,
+    so a PCID must only be reused for the same page tables. Without PCID
+    support pcid is ignored and the switch always flushes.
+*/
+void tlb_load_cr3(void* pml4_paddr, uint16_t pcid, bool flush);
+
+#ifdef TEST
+void tlb_test(void);
+#endif
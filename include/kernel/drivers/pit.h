@@ -1,8 +1,15 @@
 #pragma once
 
+#include <stdint.h>
+
 #define PIT_COMMAND 0x43
 #define PIT_DATA    0x40
 
+#define PIT_FREQUENCY 1193180 // Input clock in Hz
+#define PIT_HZ        100     // Channel 0 interrupts per second
+
 void pit_init(void);
+uint64_t pit_tsc_frequency(void);
 
 [[gnu::interrupt]] void timer_interrupt_handler(void* frame);
+void timer_add_callback(void (*callback)(void));
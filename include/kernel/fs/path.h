@@ -11,7 +11,11 @@ struct path {
     struct list components;
 };
 
+void path_cache_init(void);
+
 enum fs_result path_init(const char* path_str, struct path** path_out);
+struct path* path_alloc(void); // Empty path, freed by path_deinit
+void path_push(struct path* path, const char* name, size_t name_len);
 void path_deinit(struct path* path);
 void path_print(const struct path* path);
 
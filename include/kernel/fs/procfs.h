@@ -0,0 +1,11 @@
+#pragma once
+
+#include <kernel/fs/fs.h>
+
+void procfs_init(void);
+enum fs_result procfs_stat(struct fs* procfs, const struct path* path,
+                           struct fs_stat* st);
+enum fs_result procfs_read(struct fs* procfs, const struct path* path,
+                           void* buf, size_t count, size_t offset);
+enum fs_result procfs_write(struct fs* procfs, const struct path* path,
+                            const void* buf, size_t count, size_t offset);
@@ -10,6 +10,7 @@ struct vfs_state {
     struct tree mounts;
 };
 
+void vfs_cache_init(void);
 void vfs_init(struct fs** vfs_out);
 void vfs_deinit(struct fs* vfs);
 enum fs_result vfs_mount(struct fs* vfs, const struct path* mount_path,
@@ -13,3 +13,7 @@ void console_init(void);
 void console_putchar(char ch);
 void console_backspace(void);
 void console_clear(void);
+
+#ifdef TEST
+void console_test(void);
+#endif
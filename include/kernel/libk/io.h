@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 #include <kernel/boot/header.h>
 
@@ -20,12 +21,43 @@ uint32_t inl(uint16_t port);
 uint64_t rdmsr(uint32_t msr);
 void wrmsr(uint32_t msr, uint64_t value);
 
+/*
+    CPUID
+*/
+struct cpuid {
+    uint32_t eax;
+    uint32_t ebx;
+    uint32_t ecx;
+    uint32_t edx;
+};
+
+struct cpuid cpuid(uint32_t leaf, uint32_t subleaf);
+
+/*
+    Timestamp Counter
+*/
+uint64_t rdtsc(void);
+
 /*
     Printing
 */
 void kputchar(char ch);
 void kprintf(const char* fmt, ...);
 
+/*
+    Formatted output into a fixed size buffer, which is kept NUL terminated.
+    len counts everything printed, including what did not fit. A NULL buf
+    prints to the console, so the same code can fill a buffer or dump to
+    serial.
+*/
+struct kbuf {
+    char* data;
+    size_t size;
+    size_t len;
+};
+
+void kbprintf(struct kbuf* buf, const char* fmt, ...);
+
 /*
     Die
 */
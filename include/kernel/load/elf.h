@@ -15,6 +15,10 @@
 
 #define PT_LOAD 1
 
+#define PF_X (1 << 0) // Segment is executable
+#define PF_W (1 << 1) // Segment is writable
+#define PF_R (1 << 2) // Segment is readable
+
 struct elf_header64 {
     uint8_t magic[4];
     uint8_t class;
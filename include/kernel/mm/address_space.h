@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <kernel/cpu/paging.h>
+#include <kernel/libk/ds/list.h>
+
+/*
+    A set of page tables a process runs in. Its PML4 copies the kernel half
+    entries of the kernel's PML4, which point at PDPTs allocated up front, so
+    every address space shares the kernel's mappings by reference and
+    creating one costs a page and 256 entries.
+
+    The user half belongs to the address space: each mapping there holds a
+    reference on its frame, and the frames and page tables are freed
+    together when the last reference to the address space is dropped.
+    Most of it is mapped on first touch from the vm_areas, see vm_area.h.
+    A frame may be mapped read-only by several address spaces after a fork,
+    each mapping holding a reference, until a write copies it.
+*/
+struct address_space {
+    struct pt_entry* pml4;
+    uint32_t refcount;
+    uint16_t pcid;   // 0 is the kernel's, and shared when PCIDs run out
+    bool tlb_stale;  // Its PCID may tag stale entries, flushed on the switch
+
+    struct list vm_areas;
+    size_t num_resident_pages; // Populated by page faults
+};
+
+extern struct address_space kernel_address_space;
+
+void address_space_init(void);
+
+struct address_space* address_space_create(void);
+struct address_space* address_space_fork(struct address_space* as);
+void address_space_get(struct address_space* as);
+void address_space_put(struct address_space* as);
+
+// Loads as, so the paging functions act on it, keeping its TLB entries.
+void address_space_switch(struct address_space* as);
+struct address_space* current_address_space(void);
+
+#ifdef TEST
+void address_space_test(void);
+#endif
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <kernel/libk/io.h>
+
+/*
+    Per call site allocation profiling, built in with `make ALLOC_PROFILE=1`.
+    Every kmalloc, kfree, alloc_pages and free_pages is attributed to the
+    return address of its caller, which addr2line turns back into a source
+    line. Live allocations are looked up by address on free, so a site's live
+    count and bytes show what it is holding and the average lifetime of what
+    it freed. Without ALLOC_PROFILE the hooks compile to nothing and their
+    arguments are not evaluated.
+*/
+#define ALLOC_PROFILE_SITES   1024  // Call sites tracked, power of two
+#define ALLOC_PROFILE_OBJECTS 16384 // Live allocations tracked, power of two
+#define ALLOC_PROFILE_TOP     16    // Sites in a report
+
+enum alloc_profile_kind {
+    ALLOC_PROFILE_KMALLOC,
+    ALLOC_PROFILE_PAGES,
+};
+
+struct alloc_site {
+    void* caller; // NULL for an unused slot
+    enum alloc_profile_kind kind;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t total_bytes;
+    uint64_t live_count;
+    uint64_t live_bytes;
+    uint64_t lifetime_cycles; // Summed over frees
+};
+
+#ifdef ALLOC_PROFILE
+
+void alloc_profile_alloc(enum alloc_profile_kind kind, void* ptr, size_t size,
+                         void* caller);
+void alloc_profile_free(enum alloc_profile_kind kind, void* ptr);
+void alloc_profile_dump(size_t num_sites, struct kbuf* out);
+
+#else
+
+#define alloc_profile_alloc(kind, ptr, size, caller) ((void)0)
+#define alloc_profile_free(kind, ptr)                ((void)0)
+#define alloc_profile_dump(num_sites, out)           ((void)0)
+
+#endif
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Fixed size chunks of physically contiguous memory for device descriptors,
+    such as queues and PRP lists. Chunks are aligned to align and never cross
+    a multiple of boundary, so a device that walks one never has to follow it
+    into the next page. The pool is filled up front and freed chunks are
+    recycled, so allocating from it only reaches the page allocator once every
+    preallocated chunk is in use.
+*/
+struct dma_pool {
+    const char* name;
+    size_t size;     // Chunk size, rounded up to align
+    size_t align;    // Power of two, at most PAGE_SIZE
+    size_t boundary; // Power of two no smaller than size, or 0 for none
+    size_t block_num_pages;
+
+    void* free_list;     // Linked through the first word of each chunk
+    struct page* blocks; // Backing blocks, linked through page->next
+    size_t num_chunks;
+    size_t num_free;
+    size_t num_grows;
+};
+
+void dma_pool_init(struct dma_pool* pool, const char* name, size_t size,
+                   size_t align, size_t boundary, size_t num_prealloc);
+void dma_pool_deinit(struct dma_pool* pool);
+
+// Returns the chunk's virtual address and stores its physical address.
+void* dma_pool_alloc(struct dma_pool* pool, uintptr_t* paddr);
+void* dma_pool_zalloc(struct dma_pool* pool, uintptr_t* paddr);
+void dma_pool_free(struct dma_pool* pool, void* vaddr);
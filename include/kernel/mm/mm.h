@@ -2,21 +2,99 @@
 
 #include <stddef.h>
 
+struct page;
+struct kbuf;
+
 void mm_init(void);
+void mm_reclaim_boot_memory(void);
+void mm_dump_stats(struct kbuf* out); // NULL dumps to the console
+
+/*
+    Allocation flags. Without ALLOC_MAY_FAIL running out of memory panics, so
+    callers never see NULL. ALLOC_MAY_RECLAIM lets the allocator empty the
+    page caches and run the shrinkers before giving up, it must not be used
+    where a shrinker could deadlock, such as from inside a shrinker.
+*/
+#define ALLOC_MAY_FAIL    (1 << 0) // Return NULL instead of panicking
+#define ALLOC_MAY_RECLAIM (1 << 1) // Reclaim cached memory before failing
+#define ALLOC_ZERO        (1 << 2) // Zero the memory
+#define ALLOC_EXACT       (1 << 3) // Do not round up to a power of two
+#define ALLOC_KERNEL      ALLOC_MAY_RECLAIM
 
-void* alloc_pages(size_t num_pages);
-void* alloc_pagez(size_t num_pages);
+/*
+    The wrappers below are always inlined, so that the allocator sees the
+    address of the real call site, which the allocation profiler records.
+*/
+void* alloc_pages_flags(size_t num_pages, unsigned int flags);
 void free_pages(void* page, size_t num_pages);
 
+[[gnu::always_inline]] static inline void*
+alloc_pages(size_t num_pages)
+{
+    return alloc_pages_flags(num_pages, ALLOC_KERNEL);
+}
+
+[[gnu::always_inline]] static inline void*
+alloc_pagez(size_t num_pages)
+{
+    return alloc_pages_flags(num_pages, ALLOC_KERNEL | ALLOC_ZERO);
+}
+
+// Like alloc_pages, without rounding num_pages up to a power of two.
+[[gnu::always_inline]] static inline void*
+alloc_pages_exact(size_t num_pages)
+{
+    return alloc_pages_flags(num_pages, ALLOC_KERNEL | ALLOC_EXACT);
+}
+
+[[gnu::always_inline]] static inline void*
+alloc_pagez_exact(size_t num_pages)
+{
+    return alloc_pages_flags(num_pages,
+                             ALLOC_KERNEL | ALLOC_ZERO | ALLOC_EXACT);
+}
+
+/*
+    Every allocation starts with one reference, held by the caller. The block
+    is freed at the order recorded in its head page when the last reference is
+    dropped, so put_page is the same as free_pages with the original size.
+*/
+struct page* virt_to_page(void* ptr);
+void* page_to_virt(struct page* page);
+void get_page(void* page);
+void put_page(void* page);
+
 void* alloc_pages_dma(size_t num_pages);
 void free_pages_dma(void* page, size_t num_pages);
 
-void* kmalloc(size_t size);
-void* kzmalloc(size_t size);
+// Allocations beyond the largest size class come from vmalloc.h, they are
+// page aligned but only virtually contiguous.
+void* kmalloc_flags(size_t size, unsigned int flags);
 void kfree(void* ptr);
 
+[[gnu::always_inline]] static inline void*
+kmalloc(size_t size)
+{
+    return kmalloc_flags(size, ALLOC_KERNEL);
+}
+
+[[gnu::always_inline]] static inline void*
+kzmalloc(size_t size)
+{
+    return kmalloc_flags(size, ALLOC_KERNEL | ALLOC_ZERO);
+}
+
+// Allocates count objects of the same size into ptrs, returning count, or 0
+// (with nothing allocated) on failure when flags allow it.
+size_t kmalloc_bulk_flags(size_t size, unsigned int flags, size_t count,
+                          void** ptrs);
+void kfree_bulk(size_t count, void** ptrs);
+
+[[gnu::always_inline]] static inline size_t
+kmalloc_bulk(size_t size, size_t count, void** ptrs)
+{
+    return kmalloc_bulk_flags(size, ALLOC_KERNEL, count, ptrs);
+}
+
 void* alloc_kernel_stack(void); // Returns a pointer to the top of the stack
 void free_kernel_stack(void* stack_top);
-
-void* alloc_user_stack(void* stack_top_user_vaddr);
-void free_user_stack(void* stack_top_kernel_vaddr);
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <kernel/mm/pfa.h>
+#include <kernel/libk/io.h>
+
+#define PCP_HIGH  96 // Drain once a cache holds more pages than this
+#define PCP_BATCH 32 // Pages moved between a cache and the buddy pools at once
+
+struct pcp_stats {
+    uint64_t alloc_hits;
+    uint64_t alloc_misses;
+    uint64_t frees;
+    uint64_t refills;
+    uint64_t refill_pages;
+    uint64_t drains;
+    uint64_t drain_pages;
+};
+
+/*
+    Per-CPU cache of order 0 pages in front of the buddy pools. Frees push onto
+    the hot end and allocations pop from it, so recently freed pages are reused
+    while they are still in the CPU cache. Refills from the buddy pools go onto
+    the cold end and drains take from it.
+*/
+struct pcp_cache {
+    struct page* hot;
+    struct page* cold;
+    size_t count;
+    size_t high;
+    size_t batch;
+    struct pcp_stats stats;
+};
+
+void pcp_init(struct pcp_cache* pcp);
+
+// Returns NULL when the cache is empty and cannot be refilled.
+void* pcp_alloc_page(struct pcp_cache* pcp, struct pfa_state* state);
+void pcp_free_page(struct pcp_cache* pcp, struct pfa_state* state,
+                   struct page* page);
+size_t pcp_drain(struct pcp_cache* pcp, struct pfa_state* state);
+
+void pcp_dump_stats(const struct pcp_cache* pcp, struct kbuf* out);
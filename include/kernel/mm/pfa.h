@@ -1,21 +1,115 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
+#include <kernel/libk/io.h>
 
-#define MAX_ORDER 10
+#define MAX_ORDER       10
+#define PFA_REGIONS_MAX 64
+
+#define PAGE_FLAG_FREE   (1 << 0) // Head of a block on a free list
+#define PAGE_FLAG_PCP    (1 << 1) // On a per-CPU page cache
+#define PAGE_FLAG_ZEROED (1 << 2) // On the pre-zeroed page pool
+
+#define PAGE_FLAG_SLAB      (1 << 3) // Backs a slab, owner is the slab header
+#define PAGE_FLAG_PAGECACHE (1 << 4) // Caches file data, owner is the inode
+#define PAGE_FLAG_PAGETABLE (1 << 5) // Holds a page table
+#define PAGE_FLAG_DIRTY     (1 << 6) // Modified since last written back
+#define PAGE_FLAG_EXACT     (1 << 7) // Exact-size block, see num_pages
+#define PAGE_FLAG_VMALLOC   (1 << 8) // Backs vmalloc memory, see vmalloc.h
+
+// Set while a page is owned by the allocator rather than a caller.
+#define PAGE_FLAGS_UNALLOCATED                                                 \
+    (PAGE_FLAG_FREE | PAGE_FLAG_PCP | PAGE_FLAG_ZEROED)
+
+/*
+    Per-frame descriptor. Free blocks are linked through the descriptor of
+    their head page, so a buddy can be checked and unlinked in O(1).
+
+    For an allocated block only the head page descriptor is meaningful: it
+    records the order the block was allocated at, so it can be freed without
+    the caller passing its size back, and a reference count. Exact-size blocks
+    also record their length in pages, since their tail went back to the free
+    lists.
+*/
+struct page {
+    struct page* next;
+    union {
+        struct page* prev; // While on a free list
+        size_t num_pages;  // While allocated with PAGE_FLAG_EXACT
+    };
+    void* owner; // Back-pointer to whatever the page is in use by
+    uint32_t refcount;
+    uint16_t flags;
+    uint8_t order;
+};
+
+_Static_assert(sizeof(struct page) <= 32, "struct page must fit in 32 bytes");
+
+static inline void
+page_set_allocated(struct page* page, size_t order)
+{
+    page->owner = NULL;
+    page->refcount = 1;
+    page->flags = 0;
+    page->order = order;
+}
 
 struct free_area {
-    void* free_list;
+    struct page* free_list;
     size_t nr_free;
 };
 
-struct pfa_state {
+/*
+    A physically contiguous range of memory with its own buddy pool.
+*/
+struct pfa_region {
     struct free_area free_areas[MAX_ORDER + 1];
+    struct page* pages; // Indexed by page index from start
     void* start;
     size_t num_pages;
 };
 
-void pfa_init(struct pfa_state* state, void* start, size_t num_pages);
+struct pfa_state {
+    struct pfa_region regions[PFA_REGIONS_MAX];
+    size_t num_regions;
+};
+
+struct pfa_stats {
+    size_t num_pages;
+    size_t free_pages;
+    size_t nr_free[MAX_ORDER + 1]; // Free blocks per order, over all regions
+    int largest_order;             // -1 when nothing is free
+};
+
+void pfa_init(struct pfa_state* state);
+size_t pfa_add_region(struct pfa_state* state, void* start, size_t num_pages);
 
+// The try variants return NULL when out of memory, the others panic.
 void* pfa_alloc_pages(struct pfa_state* state, size_t num_pages);
+void* pfa_try_alloc_pages(struct pfa_state* state, size_t num_pages);
 void pfa_free_pages(struct pfa_state* state, void* ptr, size_t num_pages);
+
+// Allocates exactly num_pages, returning the rest of the block to the pool.
+void* pfa_alloc_pages_exact(struct pfa_state* state, size_t num_pages);
+void* pfa_try_alloc_pages_exact(struct pfa_state* state, size_t num_pages);
+void pfa_free_pages_exact(struct pfa_state* state, void* ptr,
+                          size_t num_pages);
+
+// Order 0 pages are passed around as lists linked through page->next.
+size_t pfa_alloc_pages_bulk(struct pfa_state* state, size_t count,
+                            struct page** list);
+void pfa_free_pages_bulk(struct pfa_state* state, struct page* list);
+
+void pfa_get_stats(const struct pfa_state* state, struct pfa_stats* stats);
+size_t pfa_frag_index(const struct pfa_stats* stats, size_t order);
+void pfa_dump_stats(const struct pfa_state* state, struct kbuf* out);
+[[noreturn]] void pfa_out_of_memory(const struct pfa_state* state,
+                                    size_t num_pages);
+
+struct page* pfa_virt_to_page(struct pfa_state* state, void* ptr);
+void* pfa_page_to_virt(struct pfa_state* state, struct page* page);
+
+#ifdef TEST
+void pfa_test(void);
+#endif
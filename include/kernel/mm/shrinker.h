@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <kernel/libk/ds/list.h>
+#include <kernel/libk/io.h>
+
+/*
+    A cache that can give memory back under pressure. scan is asked to free
+    about num_pages pages worth of objects and returns how many pages it
+    actually freed, 0 meaning the cache has nothing left to give. It runs in
+    the context of the failing allocation and must not allocate with
+    ALLOC_MAY_RECLAIM itself.
+*/
+struct shrinker {
+    struct list_node link;
+    const char* name;
+    size_t (*scan)(struct shrinker* shrinker, size_t num_pages);
+
+    uint64_t calls;
+    uint64_t pages_freed;
+};
+
+void shrinker_register(struct shrinker* shrinker);
+void shrinker_unregister(struct shrinker* shrinker);
+
+// Runs the shrinkers until num_pages are freed, returns the pages freed.
+size_t shrink_caches(size_t num_pages);
+
+void shrinker_dump_stats(struct kbuf* out);
+
+#ifdef TEST
+void shrinker_test(void);
+#endif
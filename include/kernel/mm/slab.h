@@ -1,25 +1,98 @@
 #pragma once
 #include <stddef.h>
 #include <stdint.h>
+#include <kernel/libk/io.h>
+#include <kernel/libk/ds/list.h>
 
 #define SLAB_MAGIC        0x8BADF00D
-#define SLAB_SIZE_CLASSES 10
-#define SLAB_MIN_SIZE     16
-#define SLAB_MAX_OBJECTS  256
+#define SLAB_SIZE_CLASSES 15
+#define SLAB_RETAIN_PAGES 16 // Pages of empty slabs a cache may keep
+
+// Slabs are sized so that at most 1/2^SLAB_MAX_WASTE_SHIFT of them is waste.
+#define SLAB_MAX_WASTE_SHIFT 3
+#define SLAB_MIN_OBJECTS     8  // Per slab, unless the waste bound forbids
+#define SLAB_MAX_PAGES       64 // Per slab
+#define SLAB_OFF_SLAB_SIZE   512 // Objects this large keep headers off-slab
+
+#define SLAB_NUM_CPUS         1
+#define SLAB_MAGAZINE_ROUNDS  30 // Fills a 256 byte magazine
+#define SLAB_DEPOT_MAX_FULL   4  // Beyond this full magazines go to the slabs
+#define SLAB_DEPOT_MAX_EMPTY  4  // Beyond this empty magazines are freed
+
+struct slab_cache;
 
 struct slab_header {
     uint32_t magic;
-    size_t object_size;
+    struct slab_cache* cache; // Owning cache, so frees need no lookup
+    void* mem;                // First page, the header itself if on-slab
     size_t capacity;
     size_t used;
     void* free_list;
-    struct slab_header* next;
-    struct slab_header* prev;
+    struct list_node link; // On one of its cache's slab lists
+};
+
+struct slab_list {
+    struct list slabs;
+    size_t num_slabs;
+};
+
+/*
+    A stack of free objects. Each CPU holds a loaded and a previous magazine
+    per cache, and exchanges them with the cache's depot only when both are
+    empty (allocation) or full (free), so most operations touch no shared
+    state and no slab header.
+*/
+struct slab_magazine {
+    struct slab_magazine* next; // In the depot
+    size_t rounds;
+    void* objs[SLAB_MAGAZINE_ROUNDS];
+};
+
+struct slab_cpu_cache {
+    struct slab_magazine* loaded;
+    struct slab_magazine* previous;
+    uint64_t alloc_hits; // Served from a magazine
+    uint64_t alloc_misses;
+    uint64_t free_hits; // Absorbed by a magazine
+    uint64_t free_misses;
+    uint64_t requested_bytes; // Asked of kmalloc, against size * allocs
 };
 
+struct slab_depot {
+    struct slab_magazine* full;
+    struct slab_magazine* empty;
+    size_t num_full;
+    size_t num_empty;
+};
+
+/*
+    Slabs move between lists as their occupancy changes, so allocation
+    always takes from the head of the partial list (or an empty slab) without
+    searching, and full slabs are never visited.
+*/
 struct slab_cache {
-    size_t size;
-    struct slab_header* slabs;
+    const char* name;
+    size_t object_size; // As requested
+    size_t size;        // Stride between objects
+    size_t align;
+    size_t free_offset; // Of the free list pointer within a free object
+    size_t data_offset; // Of the first object from the start of the slab
+    size_t num_pages;   // Per slab
+    size_t capacity;    // Objects per slab
+    bool off_slab;      // Whether headers are allocated separately
+    void (*ctor)(void* obj);
+    void (*dtor)(void* obj);
+    bool magazines; // Whether the magazine layer is in front of the slabs
+    struct slab_cpu_cache cpu[SLAB_NUM_CPUS];
+    struct slab_depot depot;
+    struct slab_list partial; // 0 < used < capacity
+    struct slab_list full;    // used == capacity
+    struct slab_list empty;   // used == 0, at most max_empty
+    size_t max_empty;
+    size_t empty_min; // Fewest empty slabs since the last reap
+    uint64_t slabs_created;
+    uint64_t slabs_destroyed;
+    struct list_node link; // On the list of named caches
 };
 
 struct slab_state {
@@ -28,5 +101,44 @@ struct slab_state {
 
 void slab_init(struct slab_state* state);
 
-void* slab_kmalloc(struct slab_state* state, size_t size);
-void slab_kfree(struct slab_state* state, void* ptr);
+// flags are passed on to the page allocator, objects always come zeroed.
+void* slab_kmalloc(struct slab_state* state, size_t size, unsigned int flags);
+void slab_kfree(void* ptr);
+
+// Either all count objects are allocated into ptrs, or none and 0 is returned.
+size_t slab_kmalloc_bulk(struct slab_state* state, size_t size,
+                         unsigned int flags, size_t count, void** ptrs);
+void slab_kfree_bulk(size_t count, void** ptrs);
+
+// Returns every object held in magazines to its slab.
+void slab_drain(struct slab_state* state);
+
+/*
+    Empty slabs are kept, up to max_empty per cache, so that a cache going
+    back and forth across a slab boundary does not create and destroy a slab
+    each time. slab_reap releases the empty slabs that went unused since the
+    previous reap, slab_shrink releases them all under memory pressure. Both
+    return the number of pages freed.
+*/
+size_t slab_reap(struct slab_state* state);
+size_t slab_shrink(struct slab_state* state, size_t num_pages);
+
+/*
+    Named caches of objects with an exact size and alignment. Without a
+    constructor objects come zeroed. With one, it runs once per object when
+    its slab is created, objects must be freed back in their constructed
+    state, and the destructor runs when the slab is released.
+*/
+struct slab_cache* kmem_cache_create(const char* name, size_t size,
+                                     size_t align, void (*ctor)(void* obj),
+                                     void (*dtor)(void* obj));
+void kmem_cache_destroy(struct slab_cache* cache);
+void* kmem_cache_alloc_flags(struct slab_cache* cache, unsigned int flags);
+void* kmem_cache_alloc(struct slab_cache* cache);
+void kmem_cache_free(struct slab_cache* cache, void* obj);
+
+void slab_dump_stats(const struct slab_state* state, struct kbuf* out);
+
+#ifdef TEST
+void slab_test(void);
+#endif
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <kernel/libk/io.h>
+
+#define LATENCY_BUCKETS      16
+#define LATENCY_BUCKET_SHIFT 5 // Bucket 0 holds everything below 32 cycles
+
+/*
+    Log2 histogram of TSC cycles. Bucket i counts latencies in
+    [2^(i + LATENCY_BUCKET_SHIFT - 1), 2^(i + LATENCY_BUCKET_SHIFT)), the last
+    bucket also takes everything above.
+*/
+struct latency_hist {
+    const char* name;
+    uint64_t buckets[LATENCY_BUCKETS];
+    uint64_t count;
+    uint64_t total_cycles;
+    uint64_t max_cycles;
+};
+
+void latency_hist_add(struct latency_hist* hist, uint64_t cycles);
+void latency_hist_dump(const struct latency_hist* hist, struct kbuf* out);
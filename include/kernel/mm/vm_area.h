@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <kernel/libk/ds/list.h>
+
+struct address_space;
+
+#define VM_WRITE     (1 << 0)
+#define VM_EXEC      (1 << 1)
+#define VM_GROWSDOWN (1 << 2) // A stack, extended by faults below it
+
+#define USER_STACK_MAX_SIZE (8 * 1024 * 1024)
+
+/*
+    A range of an address space's user half that is populated on demand: the
+    first touch of a page faults, and the fault handler allocates a frame,
+    fills it and maps it. Pages are zero-filled, except for the part between
+    file_start and file_start + file_size, which is read from the file at
+    file_offset, so an ELF segment and its BSS are one area.
+*/
+struct vm_area {
+    struct list_node link;
+    uintptr_t start; // Page aligned
+    uintptr_t end;
+    unsigned int flags; // VM_*, readable is implied
+
+    char* path; // NULL for anonymous memory
+    uintptr_t file_start;
+    size_t file_size;
+    size_t file_offset;
+};
+
+void vm_area_init(void);
+
+struct vm_area* vm_area_map_anon(struct address_space* as, uintptr_t start,
+                                 size_t size, unsigned int flags);
+struct vm_area* vm_area_map_file(struct address_space* as, uintptr_t start,
+                                 size_t size, unsigned int flags,
+                                 const char* path, size_t file_offset,
+                                 size_t file_size);
+struct vm_area* vm_area_find(struct address_space* as, uintptr_t vaddr);
+void vm_area_copy_all(struct address_space* dst, struct address_space* src);
+void vm_area_free_all(struct address_space* as);
+size_t vm_area_num_pages(struct address_space* as);
+
+// Resolves a fault in the loaded address space, false if it is an error.
+bool vm_handle_fault(void* vaddr, uint64_t code);
+
+#ifdef TEST
+void vm_area_test(void);
+#endif
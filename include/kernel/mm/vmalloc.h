@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <kernel/libk/io.h>
+#include <kernel/libk/ds/list.h>
+#include <kernel/cpu/paging.h>
+
+/*
+    Virtually contiguous memory in [VMALLOC_BASE, VMALLOC_END), backed by
+    order 0 frames that need not be physically contiguous, so large
+    allocations never depend on finding a high order block. Each area is
+    followed by an unmapped guard page. The head frame's page descriptor
+    points at the area, so vfree finds it without searching.
+
+    The memory is not physically contiguous and must not be handed to a
+    device, DMA buffers come from alloc_pages or a dma_pool.
+*/
+struct vmap_area {
+    uintptr_t start;
+    size_t num_pages;      // Including the guard page
+    struct list_node link; // On the free list while free
+};
+
+struct vmalloc_stats {
+    uint64_t allocs;
+    uint64_t frees;
+    size_t num_areas;  // In use
+    size_t num_pages;  // Mapped by the areas in use
+    size_t num_ranges; // Free ranges of address space
+};
+
+void vmalloc_init(void);
+bool vmalloc_initialized(void);
+
+// flags are passed on to the page allocator for each frame.
+void* vmalloc_flags(size_t size, unsigned int flags);
+void* vmalloc(size_t size);
+void vfree(void* ptr);
+
+static inline bool
+is_vmalloc_addr(const void* ptr)
+{
+    return (uintptr_t)ptr >= VMALLOC_BASE && (uintptr_t)ptr < VMALLOC_END;
+}
+
+void vmalloc_dump_stats(struct kbuf* out);
+
+#ifdef TEST
+void vmalloc_test(void);
+#endif
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <kernel/mm/pfa.h>
+#include <kernel/libk/io.h>
+
+#define ZERO_POOL_HIGH  64 // Pages the worker keeps zeroed ahead of time
+#define ZERO_POOL_BATCH 4  // Pages the worker zeroes per run
+
+struct zero_pool_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t miss_cycles;
+    uint64_t zeroed;
+    uint64_t zero_cycles;
+};
+
+/*
+    Order 0 pages that are known to be zero. Every page outside of the pool is
+    treated as dirty, pages only become zero again when the worker refills the
+    pool while the CPU would otherwise be waiting.
+*/
+struct zero_pool {
+    struct page* head;
+    size_t count;
+    size_t high;
+    struct zero_pool_stats stats;
+};
+
+void zero_pool_init(struct zero_pool* pool);
+
+void* zero_pool_alloc(struct zero_pool* pool, struct pfa_state* state);
+void zero_pool_refill(struct zero_pool* pool, struct pfa_state* state,
+                      size_t budget);
+size_t zero_pool_drain(struct zero_pool* pool, struct pfa_state* state);
+
+void zero_pool_dump_stats(const struct zero_pool* pool, struct kbuf* out);
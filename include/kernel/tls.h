@@ -1,11 +1,13 @@
 #pragma once
 
 #include <stdint.h>
+#include <kernel/mm/pcp.h>
 
 struct tls {
     uint64_t kernel_rsp;
     uint64_t user_rsp;
     struct task* current_task;
+    struct pcp_cache pcp;
 };
 
 extern struct tls tls;
@@ -85,8 +85,10 @@ load_kernel(const char* path)
             panic("failed to read PT_LOAD segment data\n");
         }
 
-        map_pages(vaddr_to_paddr(buf), (void*)program_header->vaddr, 1, 0, 1, 1,
-                  0, buf_num_pages);
+        // Write-back, writable and executable only as the segment asks
+        map_pages(vaddr_to_paddr(buf), (void*)program_header->vaddr,
+                  program_header->flags & PF_W, 0, MEMORY_TYPE_WB,
+                  !(program_header->flags & PF_X), buf_num_pages);
 
         // The kernel needs to know where it is to map its code.
         if (boot_header->you.num_entries >= YOU_ENTRIES_MAX)
@@ -97,6 +99,8 @@ load_kernel(const char* path)
             (uintptr_t)buf;
         boot_header->you.entries[boot_header->you.num_entries].num_pages =
             buf_num_pages;
+        boot_header->you.entries[boot_header->you.num_entries].flags =
+            program_header->flags;
         ++boot_header->you.num_entries;
     }
 
@@ -5,6 +5,7 @@
 #include <kernel/libk/io.h>
 #include <kernel/cpu/paging.h>
 #include <kernel/libk/string.h>
+#include <kernel/libk/math.h>
 
 static struct pfa_state pfa_state;
 static struct slab_state slab_state;
@@ -40,48 +41,105 @@ mm_init(void)
 
     if (!start_paddr) panic("no usable memory found");
     void* kernel_start_vaddr = paddr_to_vaddr(start_paddr);
-    pfa_init(&pfa_state, kernel_start_vaddr, num_pages);
+    pfa_init(&pfa_state);
+    pfa_add_region(&pfa_state, kernel_start_vaddr, num_pages);
     slab_init(&slab_state);
 
     kprintf("[DONE ] Initialize Memory Manager\n");
 }
 
+/*
+    The bootloader has no caches to reclaim, ALLOC_MAY_RECLAIM is ignored.
+*/
 void*
-alloc_pages(size_t num_pages)
+alloc_pages_flags(size_t num_pages, unsigned int flags)
 {
-    return pfa_alloc_pages(&pfa_state, num_pages);
-}
+    void* ptr = flags & ALLOC_EXACT
+                    ? pfa_try_alloc_pages_exact(&pfa_state, num_pages)
+                    : pfa_try_alloc_pages(&pfa_state, num_pages);
 
-void*
-alloc_pagez(size_t num_pages)
-{
-    void* ptr = pfa_alloc_pages(&pfa_state, num_pages);
-    memset(ptr, 0, num_pages * PAGE_SIZE);
+    if (!ptr) {
+        if (flags & ALLOC_MAY_FAIL) return NULL;
+        pfa_out_of_memory(&pfa_state, num_pages);
+    }
+
+    if (flags & ALLOC_ZERO) memset(ptr, 0, num_pages * PAGE_SIZE);
     return ptr;
 }
 
 void
 free_pages(void* ptr, size_t num_pages)
 {
-    pfa_free_pages(&pfa_state, ptr, num_pages);
+    struct page* page = pfa_virt_to_page(&pfa_state, ptr);
+    if (!page) {
+        pfa_free_pages(&pfa_state, ptr, num_pages);
+        return;
+    }
+
+    if (page->flags & PAGE_FLAG_EXACT ? page->num_pages != num_pages
+                                      : page->order != ceil_log2(num_pages))
+        panic("freeing an order %d block as %lld pages, ptr=0x%llX\n",
+              page->order, (uint64_t)num_pages, ptr);
+    if (page->refcount == 0) panic("double free, ptr=0x%llX\n", ptr);
+    if (--page->refcount) return;
+
+    if (page->flags & PAGE_FLAG_EXACT)
+        pfa_free_pages_exact(&pfa_state, ptr, num_pages);
+    else
+        pfa_free_pages(&pfa_state, ptr, num_pages);
+}
+
+struct page*
+virt_to_page(void* ptr)
+{
+    return pfa_virt_to_page(&pfa_state, ptr);
 }
 
 void*
-kmalloc(size_t size)
+page_to_virt(struct page* page)
 {
-    return slab_kmalloc(&slab_state, size);
+    return pfa_page_to_virt(&pfa_state, page);
+}
+
+void
+get_page(void* ptr)
+{
+    struct page* page = pfa_virt_to_page(&pfa_state, ptr);
+    if (!page) panic("page is not managed, ptr=0x%llX\n", ptr);
+
+    ++page->refcount;
+}
+
+void
+put_page(void* ptr)
+{
+    struct page* page = pfa_virt_to_page(&pfa_state, ptr);
+    if (!page) panic("page is not managed, ptr=0x%llX\n", ptr);
+
+    free_pages(ptr, page->flags & PAGE_FLAG_EXACT ? page->num_pages
+                                                  : (size_t)1 << page->order);
 }
 
 void*
-kzmalloc(size_t size)
+kmalloc_flags(size_t size, unsigned int flags)
 {
-    void* ptr = slab_kmalloc(&slab_state, size);
-    memset(ptr, 0, size);
-    return ptr;
+    return slab_kmalloc(&slab_state, size, flags);
 }
 
 void
 kfree(void* ptr)
 {
-    slab_kfree(&slab_state, ptr);
+    slab_kfree(ptr);
+}
+
+size_t
+kmalloc_bulk_flags(size_t size, unsigned int flags, size_t count, void** ptrs)
+{
+    return slab_kmalloc_bulk(&slab_state, size, flags, count, ptrs);
+}
+
+void
+kfree_bulk(size_t count, void** ptrs)
+{
+    slab_kfree_bulk(count, ptrs);
 }
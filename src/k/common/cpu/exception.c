@@ -10,6 +10,14 @@
         kprintf("  ss: 0x%llX\n", frame->ss);                                  \
     } while (0);
 
+static bool (*page_fault_handler)(void* vaddr, uint64_t code);
+
+void
+page_fault_set_handler(bool (*handler)(void* vaddr, uint64_t code))
+{
+    page_fault_handler = handler;
+}
+
 [[gnu::interrupt]] void
 exception_handler_division_error(struct exception_frame* frame)
 {
@@ -128,10 +136,13 @@ exception_handler_general_protection_fault(struct exception_frame* frame,
 [[gnu::interrupt]] void
 exception_handler_page_fault(struct exception_frame* frame, uint64_t code)
 {
-    kprintf("page fault exception (code: 0x%llX)\n", code);
-    dump_exception_frame(frame);
     void* faulting_address;
     asm volatile("mov %%cr2, %0" : "=r"(faulting_address));
+    if (page_fault_handler && page_fault_handler(faulting_address, code))
+        return;
+
+    kprintf("page fault exception (code: 0x%llX)\n", code);
+    dump_exception_frame(frame);
     kprintf("faulting address: 0x%llX\n", faulting_address);
     panic();
 }
@@ -1,4 +1,5 @@
 #include <kernel/cpu/gdt.h>
+#include <kernel/cpu/idt.h>
 #include <stdint.h>
 #include <kernel/libk/io.h>
 #include <kernel/libk/string.h>
@@ -119,6 +120,9 @@ gdt_init(void)
     gdt_reload_segments();
     gdt_flush_tss();
 
+    // Only once the TSS that holds the stack is loaded
+    idt_set_ist(0x08, TSS_IST_DOUBLE_FAULT);
+
     kprintf("[DONE ] Initialize the Global Descriptor Table\n");
 };
 
@@ -285,8 +289,21 @@ gdt_init_entry_tss(struct system_segment_descriptor* entry)
     entry->granularity = 0;
 }
 
+/*
+    A double fault may come from a fault on a bad stack, so it switches to a
+    stack of its own. rsp0 is set once there is a kernel stack for ring 3 to
+    enter on, see tss_set_rsp0.
+*/
 static void
 gdt_init_tss(struct tss* tss)
 {
     memset(tss, 0, sizeof(struct tss));
+    tss->ist1 = (uint64_t)alloc_kernel_stack();
+    tss->iopb = sizeof(struct tss); // No I/O permission bitmap
+}
+
+void
+tss_set_rsp0(void* rsp0)
+{
+    tss.rsp0 = (uint64_t)rsp0;
 }
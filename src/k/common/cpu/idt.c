@@ -38,6 +38,12 @@ idt_set_descriptor(uint8_t vector, void* isr, uint8_t flags)
     descriptor->zero = 0;
 }
 
+void
+idt_set_ist(uint8_t vector, uint8_t ist)
+{
+    idt[vector].ist = ist;
+}
+
 [[gnu::interrupt]] void
 default_interrupt_handler(void* frame)
 {
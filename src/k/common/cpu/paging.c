@@ -1,12 +1,87 @@
 #include <kernel/cpu/paging.h>
+#include <kernel/cpu/tlb.h>
 #include <kernel/boot/header.h>
 #include <kernel/libk/io.h>
 #include <kernel/mm/mm.h>
+#include <kernel/mm/pfa.h>
+#include <kernel/libk/math.h>
+#include <kernel/libk/string.h>
+
+#define IA32_EFER_MSR 0xC0000080
+#define IA32_EFER_NXE (1 << 11)
+#define CR0_WP        (1 << 16)
+#define IA32_PAT_MSR  0x277
+
+/*
+    PA0-PA3 keep their power-on types WB, WT, UC- and UC, so entries built
+    before the PAT is programmed mean the same after. PA4 is WC, selected by
+    the PAT bit alone. PA5-PA7 repeat the defaults and are not used.
+*/
+#define PAT_VALUE 0x0007040100070406
+
+#define PT_LEVEL   0
+#define PML4_LEVEL 3
+
+// Attributes shared by every page of a range, passed down the walk.
+struct range_attrs {
+    bool read_write;
+    bool user_supervisor;
+    enum memory_type type;
+    bool execute_disable;
+    bool large_pages; // 2 MiB pages allowed
+    bool huge_pages;  // 1 GiB pages allowed
+};
+
+// Forward declarations
+static struct pt_entry* get_table(struct pt_entry* entry, size_t entry_size,
+                                  bool create);
+static void split_large_page(struct pt_entry* entry, size_t page_size);
+static struct pt_entry* table_of(struct pt_entry* entry);
+static struct pt_entry* find_leaf(void* vaddr, size_t* page_size);
+static void set_memory_type(struct pt_entry* entry, enum memory_type type,
+                            bool large);
+static enum memory_type get_memory_type(const struct pt_entry* entry,
+                                        bool large);
+static uintptr_t leaf_paddr(const struct pt_entry* entry, size_t page_size);
+static void map_range_level(struct pt_entry* table, int level, uintptr_t paddr,
+                            uintptr_t vaddr, size_t size,
+                            const struct range_attrs* attrs);
+static bool unmap_range_level(struct pt_entry* table, int level,
+                              uintptr_t vaddr, size_t size,
+                              struct mmu_gather* tlb);
+static size_t level_entry_size(int level);
+static size_t level_index(uintptr_t vaddr, int level);
+static bool table_empty(const struct pt_entry* table);
+static size_t copy_entries_cow(struct pt_entry* dst, struct pt_entry* src,
+                               int level, uintptr_t vaddr, size_t begin,
+                               size_t end);
+static void free_entries(struct pt_entry* table, int level, size_t begin,
+                         size_t end);
+
+void*
+alloc_page_table(void)
+{
+    void* table = alloc_pagez(1);
+
+    struct page* page = virt_to_page(table);
+    if (page) page->flags |= PAGE_FLAG_PAGETABLE;
+
+    return table;
+}
+
+void
+free_page_table(void* table)
+{
+    struct page* page = virt_to_page(table);
+    if (page) page->flags &= ~PAGE_FLAG_PAGETABLE;
+
+    free_pages(table, 1);
+}
 
 void
 init_pt_entry(struct pt_entry* pt, void* paddr, bool read_write,
-              bool user_supervisor, bool page_write_through,
-              bool page_cache_disabled, bool execute_disable)
+              bool user_supervisor, enum memory_type type,
+              bool execute_disable)
 {
     if ((uintptr_t)paddr >> PADDR_BITS != 0)
         panic("paddr takes more than 40 bits, paddr=0x%llX\n", paddr);
@@ -14,21 +89,20 @@ init_pt_entry(struct pt_entry* pt, void* paddr, bool read_write,
     pt->present = 1;
     pt->read_write = read_write;
     pt->user_supervisor = user_supervisor;
-    pt->page_write_through = page_write_through;
-    pt->page_cache_disabled = page_cache_disabled;
     pt->accessed = 0;
     pt->available_1 = 0;
-    pt->zero_1 = 0;
+    pt->page_size = 0;
+    pt->global = 0;
     pt->available_2 = 0;
     pt->address = (uintptr_t)paddr >> PAGE_SIZE_BITS;
     pt->available_3 = 0;
     pt->execute_disable = execute_disable;
+    set_memory_type(pt, type, false);
 }
 
 void
 map_page(void* paddr, void* vaddr, bool read_write, bool user_supervisor,
-         bool page_write_through, bool page_cache_disabled,
-         bool execute_disable)
+         enum memory_type type, bool execute_disable)
 {
     if (!PAGE_ALIGNED(paddr))
         panic("paddr is not page aligned, paddr=0x%llX, vaddr=0x%llX\n", paddr,
@@ -40,156 +114,526 @@ map_page(void* paddr, void* vaddr, bool read_write, bool user_supervisor,
     union vaddr v = {.raw = (uintptr_t)vaddr};
 
     struct pt_entry* pml4_entry = &pml4_vaddr[v.pml4_index];
-    if (!pml4_entry->present) {
-        void* pdpt_vaddr = alloc_pagez(1);
-        void* pdpt_paddr = vaddr_to_paddr(pdpt_vaddr);
-        init_pt_entry(pml4_entry, pdpt_paddr, 1, 1, 0, 0, 0);
+    struct pt_entry* pdpt_vaddr = get_table(pml4_entry, 0, true);
+    struct pt_entry* pdpt_entry = &pdpt_vaddr[v.pdpt_index];
+    struct pt_entry* pd_vaddr = get_table(pdpt_entry, HUGE_PAGE_SIZE, true);
+    struct pt_entry* pd_entry = &pd_vaddr[v.pd_index];
+    struct pt_entry* pt_vaddr = get_table(pd_entry, LARGE_PAGE_SIZE, true);
+    struct pt_entry* pt_entry = &pt_vaddr[v.pt_index];
+
+    if (!pt_entry->present) {
+        init_pt_entry(pt_entry, paddr, read_write, user_supervisor, type,
+                      execute_disable);
+        pt_entry->global = (uintptr_t)vaddr >= KERNEL_HALF_BASE;
+        tlb_flush_page(vaddr);
+    } else {
+        panic("page is already mapped, vaddr=0x%llX\n", vaddr);
     }
+}
 
-    struct pt_entry* pdpt_paddr =
-        (void*)(uintptr_t)(pml4_entry->address << PAGE_SIZE_BITS);
-    struct pt_entry* pdpt_vaddr = paddr_to_vaddr(pdpt_paddr);
-    struct pt_entry* pdpt_entry = &pdpt_vaddr[v.pdpt_index];
-    if (!pdpt_entry->present) {
-        void* pt_vaddr = alloc_pagez(1);
-        void* pt_paddr = vaddr_to_paddr(pt_vaddr);
-        init_pt_entry(pdpt_entry, pt_paddr, 1, 1, 0, 0, 0);
+void
+map_large_page(void* paddr, void* vaddr, size_t page_size, bool read_write,
+               bool user_supervisor, enum memory_type type,
+               bool execute_disable)
+{
+    if (page_size != LARGE_PAGE_SIZE && page_size != HUGE_PAGE_SIZE)
+        panic("invalid large page size %lld\n", (uint64_t)page_size);
+    if (user_supervisor)
+        panic("user mappings must use 4 KiB pages, vaddr=0x%llX\n", vaddr);
+    if ((uintptr_t)paddr % page_size || (uintptr_t)vaddr % page_size)
+        panic("large page is misaligned, paddr=0x%llX, vaddr=0x%llX\n", paddr,
+              vaddr);
+    if (page_size == HUGE_PAGE_SIZE && !huge_pages_supported())
+        panic("1 GiB pages are not supported\n");
+
+    union vaddr v = {.raw = (uintptr_t)vaddr};
+
+    struct pt_entry* pml4_entry = &pml4_vaddr[v.pml4_index];
+    struct pt_entry* pdpt_vaddr = get_table(pml4_entry, 0, true);
+    struct pt_entry* entry = &pdpt_vaddr[v.pdpt_index];
+    if (page_size == LARGE_PAGE_SIZE) {
+        struct pt_entry* pd_vaddr = get_table(entry, HUGE_PAGE_SIZE, true);
+        entry = &pd_vaddr[v.pd_index];
     }
 
-    struct pt_entry* pd_paddr =
-        (void*)(uintptr_t)(pdpt_entry->address << PAGE_SIZE_BITS);
-    struct pt_entry* pd_vaddr = paddr_to_vaddr(pd_paddr);
-    struct pt_entry* pd_entry = &pd_vaddr[v.pd_index];
-    if (!pd_entry->present) {
-        void* pt_vaddr = alloc_pagez(1);
-        void* pt_paddr = vaddr_to_paddr(pt_vaddr);
-        init_pt_entry(pd_entry, pt_paddr, 1, 1, 0, 0, 0);
+    if (entry->present)
+        panic("large page overlaps a mapping, vaddr=0x%llX\n", vaddr);
+
+    init_pt_entry(entry, paddr, read_write, user_supervisor, MEMORY_TYPE_WB,
+                  execute_disable);
+    entry->page_size = 1;
+    entry->global = (uintptr_t)vaddr >= KERNEL_HALF_BASE;
+    set_memory_type(entry, type, true);
+    tlb_flush_page(vaddr);
+}
+
+/*
+    Descends from the PML4 once for the whole range: each table on the way is
+    visited once and its entries for the range are filled in order, rather
+    than walking from the root for every page. User mappings are always
+    4 KiB pages: each holds a reference on its own frame, see address_space.h,
+    and copy-on-write breaks them a page at a time.
+*/
+void
+map_range(void* paddr, void* vaddr, size_t size, bool read_write,
+          bool user_supervisor, enum memory_type type, bool execute_disable,
+          bool large_pages)
+{
+    if (!PAGE_ALIGNED(paddr) || !PAGE_ALIGNED(vaddr) || !PAGE_ALIGNED(size))
+        panic("range is not page aligned, paddr=0x%llX, vaddr=0x%llX, "
+              "size=0x%llX\n",
+              paddr, vaddr, (uint64_t)size);
+    if (large_pages && user_supervisor)
+        panic("user mappings must use 4 KiB pages, vaddr=0x%llX\n", vaddr);
+    if (size == 0) return;
+
+    struct range_attrs attrs = {
+        .read_write = read_write,
+        .user_supervisor = user_supervisor,
+        .type = type,
+        .execute_disable = execute_disable,
+        .large_pages = large_pages,
+        .huge_pages = large_pages && huge_pages_supported(),
+    };
+    map_range_level(pml4_vaddr, PML4_LEVEL, (uintptr_t)paddr, (uintptr_t)vaddr,
+                    size, &attrs);
+}
+
+/*
+    Maps [vaddr, vaddr + size) of the part of the address space table covers.
+    Entries that were not present cannot be cached in the TLB, so filling
+    them needs no invalidation.
+*/
+static void
+map_range_level(struct pt_entry* table, int level, uintptr_t paddr,
+                uintptr_t vaddr, size_t size, const struct range_attrs* attrs)
+{
+    size_t entry_size = level_entry_size(level);
+    bool large = level == 1 ? attrs->large_pages
+                            : level == 2 && attrs->huge_pages;
+
+    for (size_t i = level_index(vaddr, level); size > 0; ++i) {
+        size_t step = MIN(entry_size - vaddr % entry_size, size);
+        struct pt_entry* entry = &table[i];
+
+        if (level == PT_LEVEL) {
+            if (entry->present)
+                panic("page is already mapped, vaddr=0x%llX\n", vaddr);
+
+            init_pt_entry(entry, (void*)paddr, attrs->read_write,
+                          attrs->user_supervisor, attrs->type,
+                          attrs->execute_disable);
+            entry->global = vaddr >= KERNEL_HALF_BASE;
+        } else if (large && step == entry_size && paddr % entry_size == 0 &&
+                   !entry->present) {
+            init_pt_entry(entry, (void*)paddr, attrs->read_write,
+                          attrs->user_supervisor, MEMORY_TYPE_WB,
+                          attrs->execute_disable);
+            entry->page_size = 1;
+            entry->global = vaddr >= KERNEL_HALF_BASE;
+            set_memory_type(entry, attrs->type, true);
+        } else {
+            map_range_level(get_table(entry, entry_size, true), level - 1,
+                            paddr, vaddr, step, attrs);
+        }
+
+        paddr += step;
+        vaddr += step;
+        size -= step;
     }
+}
 
-    struct pt_entry* pt_paddr =
-        (void*)(uintptr_t)(pd_entry->address << PAGE_SIZE_BITS);
-    struct pt_entry* pt_vaddr = paddr_to_vaddr(pt_paddr);
-    struct pt_entry* pt_entry = &pt_vaddr[v.pt_index];
-    if (!pt_entry->present) {
-        init_pt_entry(pt_entry, paddr, read_write, user_supervisor,
-                      page_write_through, page_cache_disabled, execute_disable);
-        asm volatile("invlpg (%0)" ::"r"(vaddr) : "memory");
+/*
+    Unmaps whatever is mapped in the range, skipping holes, and frees the
+    page tables it leaves empty. The PDPTs of the kernel half stay, every
+    address space shares them. The TLB is flushed once at the end.
+*/
+void
+unmap_range(void* vaddr, size_t size)
+{
+    struct mmu_gather tlb;
+    mmu_gather_init(&tlb);
+    unmap_range_gather(vaddr, size, &tlb);
+    mmu_gather_finish(&tlb);
+}
+
+void
+unmap_range_gather(void* vaddr, size_t size, struct mmu_gather* tlb)
+{
+    if (!PAGE_ALIGNED(vaddr) || !PAGE_ALIGNED(size))
+        panic("range is not page aligned, vaddr=0x%llX, size=0x%llX\n",
+              vaddr, (uint64_t)size);
+    if (size == 0) return;
+
+    unmap_range_level(pml4_vaddr, PML4_LEVEL, (uintptr_t)vaddr, size, tlb);
+}
+
+// Returns whether table is left empty.
+static bool
+unmap_range_level(struct pt_entry* table, int level, uintptr_t vaddr,
+                  size_t size, struct mmu_gather* tlb)
+{
+    size_t entry_size = level_entry_size(level);
+
+    for (size_t i = level_index(vaddr, level); size > 0; ++i) {
+        size_t step = MIN(entry_size - vaddr % entry_size, size);
+        struct pt_entry* entry = &table[i];
+
+        if (!entry->present) {
+            // Nothing to unmap
+        } else if (level == PT_LEVEL ||
+                   (entry->page_size && step == entry_size)) {
+            entry->present = 0;
+            mmu_gather_add(tlb, vaddr, entry_size);
+        } else {
+            // A large page only partly in the range is split first.
+            struct pt_entry* child = get_table(entry, entry_size, false);
+            bool kernel_pdpt =
+                level == PML4_LEVEL && vaddr >= KERNEL_HALF_BASE;
+
+            if (unmap_range_level(child, level - 1, vaddr, step, tlb) &&
+                !kernel_pdpt) {
+                entry->present = 0;
+                mmu_gather_add_table(tlb, vaddr, child);
+            }
+        }
+
+        vaddr += step;
+        size -= step;
+    }
+
+    return table_empty(table);
+}
+
+/*
+    Gives every kernel half entry of the PML4 a PDPT up front, 1 MiB in all,
+    so a PML4 that copies those entries shares every kernel mapping made
+    later too. unmap_range never frees them.
+*/
+void
+alloc_kernel_pdpts(void)
+{
+    for (size_t i = PML4_ENTRIES / 2; i < PML4_ENTRIES; ++i)
+        get_table(&pml4_vaddr[i], 0, true);
+}
+
+/*
+    Drops the reference each user mapping holds on its frame and frees the
+    user half's page tables, a table at a time rather than a page at a time.
+    The TLB is not touched, pml4 must not be loaded and its PCID must be
+    flushed before it is used again.
+*/
+void
+free_user_half(struct pt_entry* pml4)
+{
+    free_entries(pml4, PML4_LEVEL, 0, PML4_ENTRIES / 2);
+}
+
+/*
+    Copies the user half of src into dst, whose user half must be empty,
+    sharing the frames instead of copying them: the entries in both are made
+    read-only and each frame gets a reference for dst, so the first write
+    through either faults and goes to break_cow. Returns the number of pages
+    shared. src's TLB entries still allow writes until its PCID is flushed.
+    User mappings are all 4 KiB pages, a large one panics here.
+*/
+size_t
+copy_user_half_cow(struct pt_entry* dst, struct pt_entry* src)
+{
+    return copy_entries_cow(dst, src, PML4_LEVEL, 0, 0, PML4_ENTRIES / 2);
+}
+
+static size_t
+copy_entries_cow(struct pt_entry* dst, struct pt_entry* src, int level,
+                 uintptr_t vaddr, size_t begin, size_t end)
+{
+    size_t num_pages = 0;
+
+    for (size_t i = begin; i < end; ++i) {
+        if (!src[i].present) continue;
+        uintptr_t entry_vaddr = vaddr + i * level_entry_size(level);
+
+        // map_range refuses to build these, a write to one could not be
+        // broken into a copy of a single page.
+        if (level != PT_LEVEL && src[i].page_size)
+            panic("cannot fork a large user page, vaddr=0x%llX\n",
+                  entry_vaddr);
+
+        if (level == PT_LEVEL) {
+            get_page(paddr_to_vaddr((void*)leaf_paddr(&src[i], PAGE_SIZE)));
+            src[i].read_write = 0;
+            dst[i] = src[i];
+            ++num_pages;
+        } else {
+            struct pt_entry* child = alloc_page_table();
+            init_pt_entry(&dst[i], vaddr_to_paddr(child), 1, 1,
+                          MEMORY_TYPE_WB, 0);
+            num_pages += copy_entries_cow(child, table_of(&src[i]), level - 1,
+                                          entry_vaddr, 0, PT_ENTRIES);
+        }
+    }
+
+    return num_pages;
+}
+
+/*
+    Makes the read-only page at vaddr in the loaded address space writable,
+    in place when this mapping holds the only reference to its frame and
+    onto a copy of the frame otherwise. False if the page is not a shared
+    one, that is unmapped, large or already writable.
+*/
+bool
+break_cow(void* vaddr)
+{
+    size_t page_size;
+    struct pt_entry* entry = find_leaf(vaddr, &page_size);
+    if (!entry || page_size != PAGE_SIZE || entry->read_write) return false;
+
+    void* frame = paddr_to_vaddr((void*)leaf_paddr(entry, PAGE_SIZE));
+    if (virt_to_page(frame)->refcount != 1) {
+        void* copy = alloc_pages(1);
+        memcpy(copy, frame, PAGE_SIZE);
+        entry->address = (uintptr_t)vaddr_to_paddr(copy) >> PAGE_SIZE_BITS;
+        put_page(frame);
+    }
+
+    entry->read_write = 1;
+    tlb_flush_page(vaddr);
+    return true;
+}
+
+static void
+free_entries(struct pt_entry* table, int level, size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; ++i) {
+        struct pt_entry* entry = &table[i];
+        if (!entry->present) continue;
+
+        if (level == PT_LEVEL || entry->page_size) {
+            size_t page_size = level_entry_size(level);
+            put_page(paddr_to_vaddr((void*)leaf_paddr(entry, page_size)));
+        } else {
+            struct pt_entry* child = table_of(entry);
+            free_entries(child, level - 1, 0, PT_ENTRIES);
+            free_page_table(child);
+        }
+
+        entry->present = 0;
+    }
+}
+
+static size_t
+level_entry_size(int level)
+{
+    return (size_t)PAGE_SIZE << (9 * level);
+}
+
+static size_t
+level_index(uintptr_t vaddr, int level)
+{
+    return (vaddr >> (PAGE_SIZE_BITS + 9 * level)) % PT_ENTRIES;
+}
+
+static bool
+table_empty(const struct pt_entry* table)
+{
+    for (size_t i = 0; i < PT_ENTRIES; ++i) {
+        if (table[i].present) return false;
+    }
+
+    return true;
+}
+
+bool
+huge_pages_supported(void)
+{
+    return cpuid(0x80000001, 0).edx & (1 << 26);
+}
+
+/*
+    Returns the table an entry points to, allocating it when create is set
+    and splitting the large page the entry maps, which is entry_size bytes
+    when it is one. NULL when there is nothing mapped.
+*/
+static struct pt_entry*
+get_table(struct pt_entry* entry, size_t entry_size, bool create)
+{
+    if (!entry->present) {
+        if (!create) return NULL;
+
+        void* table_vaddr = alloc_page_table();
+        void* table_paddr = vaddr_to_paddr(table_vaddr);
+        init_pt_entry(entry, table_paddr, 1, 1, MEMORY_TYPE_WB, 0);
+    } else if (entry->page_size) {
+        split_large_page(entry, entry_size);
+    }
+
+    return table_of(entry);
+}
+
+/*
+    Replaces a large page with a table of pages one level smaller that map
+    the same memory with the same attributes. Since no translation changes
+    the TLB can keep the old entry until the caller changes one of them.
+*/
+static void
+split_large_page(struct pt_entry* entry, size_t page_size)
+{
+    struct pt_entry* table = alloc_page_table();
+    size_t sub_page_size = page_size / PT_ENTRIES;
+    bool sub_large = sub_page_size != PAGE_SIZE;
+    enum memory_type type = get_memory_type(entry, true);
+    uintptr_t paddr = leaf_paddr(entry, page_size);
+
+    for (size_t i = 0; i < PT_ENTRIES; ++i) {
+        table[i] = *entry;
+        table[i].address = (paddr + i * sub_page_size) >> PAGE_SIZE_BITS;
+        table[i].page_size = sub_large;
+        set_memory_type(&table[i], type, sub_large);
+    }
+
+    init_pt_entry(entry, vaddr_to_paddr(table), 1, 1, MEMORY_TYPE_WB, 0);
+}
+
+static struct pt_entry*
+table_of(struct pt_entry* entry)
+{
+    return paddr_to_vaddr((void*)(uintptr_t)(entry->address << PAGE_SIZE_BITS));
+}
+
+/*
+    The PAT bit is bit 7 of a PT entry, but in a large page bit 7 is the page
+    size and the PAT bit moves to bit 12, the lowest address bit, which large
+    page addresses leave clear.
+*/
+static void
+set_memory_type(struct pt_entry* entry, enum memory_type type, bool large)
+{
+    bool pat = type == MEMORY_TYPE_WC;
+
+    entry->page_write_through =
+        type == MEMORY_TYPE_WT || type == MEMORY_TYPE_UC;
+    entry->page_cache_disabled = type == MEMORY_TYPE_UC;
+    if (large) {
+        entry->address = (entry->address & ~(uint64_t)1) | pat;
     } else {
-        panic("page is already mapped, vaddr=0x%llX\n", vaddr);
+        entry->page_size = pat;
     }
 }
 
+static enum memory_type
+get_memory_type(const struct pt_entry* entry, bool large)
+{
+    if (large ? entry->address & 1 : entry->page_size) return MEMORY_TYPE_WC;
+    if (entry->page_cache_disabled) return MEMORY_TYPE_UC;
+    if (entry->page_write_through) return MEMORY_TYPE_WT;
+    return MEMORY_TYPE_WB;
+}
+
+static uintptr_t
+leaf_paddr(const struct pt_entry* entry, size_t page_size)
+{
+    uintptr_t paddr = entry->address << PAGE_SIZE_BITS;
+    return page_size == PAGE_SIZE ? paddr : paddr & ~(uintptr_t)PAGE_SIZE;
+}
+
 void
 map_page_kernel_code(void* paddr, void* vaddr)
 {
-    map_page(paddr, vaddr, 1, 0, 0, 0, 0);
+    map_page(paddr, vaddr, 1, 0, MEMORY_TYPE_WB, 0);
 };
 
 void
 map_page_kernel_data(void* paddr, void* vaddr)
 {
-    map_page(paddr, vaddr, 1, 0, 0, 0, 1);
+    map_page(paddr, vaddr, 1, 0, MEMORY_TYPE_WB, 1);
 }
 
 void
 map_page_kernel_rodata(void* paddr, void* vaddr)
 {
-    map_page(paddr, vaddr, 0, 0, 0, 0, 1);
+    map_page(paddr, vaddr, 0, 0, MEMORY_TYPE_WB, 1);
 }
 
 void
 map_page_user_code(void* paddr, void* vaddr)
 {
-    map_page(paddr, vaddr, 1, 1, 0, 0, 0);
+    map_page(paddr, vaddr, 1, 1, MEMORY_TYPE_WB, 0);
 }
 
 void
 map_page_user_data(void* paddr, void* vaddr)
 {
-    map_page(paddr, vaddr, 1, 1, 0, 0, 1);
+    map_page(paddr, vaddr, 1, 1, MEMORY_TYPE_WB, 1);
 }
 
 void
 map_page_user_rodata(void* paddr, void* vaddr)
 {
-    map_page(paddr, vaddr, 0, 1, 0, 0, 1);
+    map_page(paddr, vaddr, 0, 1, MEMORY_TYPE_WB, 1);
 }
 
 void
 map_page_dma(void* paddr, void* vaddr)
 {
-    map_page(paddr, vaddr, 1, 0, 1, 1, 1);
+    map_page(paddr, vaddr, 1, 0, MEMORY_TYPE_UC, 1);
 }
 
+/*
+    The map_pages family maps through map_range, with large pages where the
+    range allows. Unmapping part of one later splits it.
+*/
 void
 map_pages(void* paddr, void* vaddr, bool read_write, bool user_supervisor,
-          bool page_write_through, bool page_cache_disabled,
-          bool execute_disable, size_t num_pages)
+          enum memory_type type, bool execute_disable, size_t num_pages)
 {
-    for (size_t i = 0; i < num_pages; ++i) {
-        map_page(paddr + i * PAGE_SIZE, vaddr + i * PAGE_SIZE, read_write,
-                 user_supervisor, page_write_through, page_cache_disabled,
-                 execute_disable);
-    }
+    map_range(paddr, vaddr, num_pages * PAGE_SIZE, read_write, user_supervisor,
+              type, execute_disable, !user_supervisor);
 }
 
 void
 map_pages_kernel_code(void* paddr, void* vaddr, size_t num_pages)
 {
-    for (size_t i = 0; i < num_pages; ++i) {
-        map_page_kernel_code(paddr + i * PAGE_SIZE, vaddr + i * PAGE_SIZE);
-    }
+    map_pages(paddr, vaddr, 1, 0, MEMORY_TYPE_WB, 0, num_pages);
 }
 
 void
 map_pages_kernel_data(void* paddr, void* vaddr, size_t num_pages)
 {
-    for (size_t i = 0; i < num_pages; ++i) {
-        map_page_kernel_data(paddr + i * PAGE_SIZE, vaddr + i * PAGE_SIZE);
-    }
+    map_pages(paddr, vaddr, 1, 0, MEMORY_TYPE_WB, 1, num_pages);
 }
 
 void
 map_pages_kernel_rodata(void* paddr, void* vaddr, size_t num_pages)
 {
-    for (size_t i = 0; i < num_pages; ++i) {
-        map_page_kernel_rodata(paddr + i * PAGE_SIZE, vaddr + i * PAGE_SIZE);
-    }
+    map_pages(paddr, vaddr, 0, 0, MEMORY_TYPE_WB, 1, num_pages);
 }
 
 void
 map_pages_user_code(void* paddr, void* vaddr, size_t num_pages)
 {
-    for (size_t i = 0; i < num_pages; ++i) {
-        map_page_user_code(paddr + i * PAGE_SIZE, vaddr + i * PAGE_SIZE);
-    }
+    map_pages(paddr, vaddr, 1, 1, MEMORY_TYPE_WB, 0, num_pages);
 }
 
 void
 map_pages_user_data(void* paddr, void* vaddr, size_t num_pages)
 {
-    for (size_t i = 0; i < num_pages; ++i) {
-        map_page_user_data(paddr + i * PAGE_SIZE, vaddr + i * PAGE_SIZE);
-    }
+    map_pages(paddr, vaddr, 1, 1, MEMORY_TYPE_WB, 1, num_pages);
 }
 
 void
 map_pages_user_rodata(void* paddr, void* vaddr, size_t num_pages)
 {
-    for (size_t i = 0; i < num_pages; ++i) {
-        map_page_user_rodata(paddr + i * PAGE_SIZE, vaddr + i * PAGE_SIZE);
-    }
+    map_pages(paddr, vaddr, 0, 1, MEMORY_TYPE_WB, 1, num_pages);
 }
 
 void
 map_pages_dma(void* paddr, void* vaddr, size_t num_pages)
 {
-    for (size_t i = 0; i < num_pages; ++i) {
-        map_page_dma(paddr + i * PAGE_SIZE, vaddr + i * PAGE_SIZE);
-    }
+    map_pages(paddr, vaddr, 1, 0, MEMORY_TYPE_UC, 1, num_pages);
 }
 
-void
+void*
 unmap_page(void* vaddr)
 {
     if (!PAGE_ALIGNED(vaddr)) panic("vaddr is not page aligned\n");
@@ -197,37 +641,98 @@ unmap_page(void* vaddr)
     union vaddr v = {.raw = (uintptr_t)vaddr};
 
     struct pt_entry* pml4_entry = &pml4_vaddr[v.pml4_index];
-    if (!pml4_entry->present)
+    struct pt_entry* pdpt_vaddr = get_table(pml4_entry, 0, false);
+    if (!pdpt_vaddr)
         panic("page is already unmapped because pml4_entry is not present\n");
 
-    struct pt_entry* pdpt_paddr =
-        (void*)(uintptr_t)(pml4_entry->address << PAGE_SIZE_BITS);
-    struct pt_entry* pdpt_vaddr = paddr_to_vaddr(pdpt_paddr);
     struct pt_entry* pdpt_entry = &pdpt_vaddr[v.pdpt_index];
-    if (!pdpt_entry->present)
+    struct pt_entry* pd_vaddr = get_table(pdpt_entry, HUGE_PAGE_SIZE, false);
+    if (!pd_vaddr)
         panic("page is already unmapped because pdpt_entry is not present\n");
 
-    struct pt_entry* pd_paddr =
-        (void*)(uintptr_t)(pdpt_entry->address << PAGE_SIZE_BITS);
-    struct pt_entry* pd_vaddr = paddr_to_vaddr(pd_paddr);
     struct pt_entry* pd_entry = &pd_vaddr[v.pd_index];
-    if (!pd_entry->present)
+    struct pt_entry* pt_vaddr = get_table(pd_entry, LARGE_PAGE_SIZE, false);
+    if (!pt_vaddr)
         panic("page is already unmapped because pd_entry is not present\n");
 
-    struct pt_entry* pt_paddr =
-        (void*)(uintptr_t)(pd_entry->address << PAGE_SIZE_BITS);
-    struct pt_entry* pt_vaddr = paddr_to_vaddr(pt_paddr);
     struct pt_entry* pt_entry = &pt_vaddr[v.pt_index];
     if (!pt_entry->present)
         panic("page is already unmapped because pt_entry is not present\n");
 
     pt_entry->present = 0;
+    tlb_flush_page(vaddr);
+
+    return (void*)(uintptr_t)(pt_entry->address << PAGE_SIZE_BITS);
 }
 
 void
 unmap_pages(void* vaddr, size_t num_pages)
 {
-    for (size_t i = 0; i < num_pages; ++i) {
-        unmap_page(vaddr + i * PAGE_SIZE);
-    }
+    unmap_range(vaddr, num_pages * PAGE_SIZE);
+}
+
+void*
+lookup_paddr(void* vaddr)
+{
+    size_t page_size;
+    struct pt_entry* entry = find_leaf(vaddr, &page_size);
+    if (!entry) return NULL;
+
+    return (void*)(leaf_paddr(entry, page_size) + (uintptr_t)vaddr % page_size);
+}
+
+// Returns the entry that maps vaddr, which may be a large page, or NULL.
+static struct pt_entry*
+find_leaf(void* vaddr, size_t* page_size)
+{
+    union vaddr v = {.raw = (uintptr_t)vaddr};
+
+    struct pt_entry* pml4_entry = &pml4_vaddr[v.pml4_index];
+    if (!pml4_entry->present) return NULL;
+
+    struct pt_entry* pdpt_entry = &table_of(pml4_entry)[v.pdpt_index];
+    if (!pdpt_entry->present) return NULL;
+    *page_size = HUGE_PAGE_SIZE;
+    if (pdpt_entry->page_size) return pdpt_entry;
+
+    struct pt_entry* pd_entry = &table_of(pdpt_entry)[v.pd_index];
+    if (!pd_entry->present) return NULL;
+    *page_size = LARGE_PAGE_SIZE;
+    if (pd_entry->page_size) return pd_entry;
+
+    struct pt_entry* pt_entry = &table_of(pd_entry)[v.pt_index];
+    if (!pt_entry->present) return NULL;
+    *page_size = PAGE_SIZE;
+    return pt_entry;
+}
+
+/*
+    Execute-disable bits need EFER.NXE, read-only pages only stop the kernel
+    with CR0.WP, global pages need CR4.PGE and WC mappings need the PAT. The
+    firmware may or may not have set them. PCIDs are used where supported,
+    CR4.PCIDE can only be set while PCID 0 is loaded. Toggling CR4.PGE also
+    flushes every TLB entry, global or not, which a PAT change requires, so
+    this runs after loading new page tables.
+*/
+void
+paging_enable_features(void)
+{
+    if (!(cpuid(0x80000001, 0).edx & (1 << 20)))
+        panic("the CPU does not support execute-disable\n");
+
+    if (!(cpuid(1, 0).edx & (1 << 16)))
+        panic("the CPU does not support the PAT\n");
+
+    wrmsr(IA32_EFER_MSR, rdmsr(IA32_EFER_MSR) | IA32_EFER_NXE);
+    wrmsr(IA32_PAT_MSR, PAT_VALUE);
+
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" ::"r"(cr0 | CR0_WP) : "memory");
+
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    if (cpuid(1, 0).ecx & (1 << 17)) cr4 |= CR4_PCIDE;
+    asm volatile("mov %0, %%cr4" ::"r"(cr4 & ~CR4_PGE) : "memory");
+    asm volatile("mov %0, %%cr4" ::"r"(cr4 | CR4_PGE) : "memory");
 }
@@ -0,0 +1,267 @@
+#include <kernel/cpu/tlb.h>
+#include <kernel/cpu/paging.h>
+#include <kernel/libk/io.h>
+#include <kernel/libk/math.h>
+#include <kernel/mm/mm.h>
+
+void
+mmu_gather_init(struct mmu_gather* tlb)
+{
+    tlb->start = 0;
+    tlb->last = 0;
+    tlb->stride = 0;
+    tlb->kernel_half = false;
+    tlb->num_tables = 0;
+}
+
+// Records that the page_size page at vaddr was unmapped.
+void
+mmu_gather_add(struct mmu_gather* tlb, uintptr_t vaddr, size_t page_size)
+{
+    uintptr_t last = vaddr + (page_size - 1);
+
+    if (tlb->stride == 0) {
+        tlb->start = vaddr;
+        tlb->last = last;
+        tlb->stride = page_size;
+    } else {
+        tlb->start = MIN(tlb->start, vaddr);
+        tlb->last = MAX(tlb->last, last);
+        tlb->stride = MIN(tlb->stride, page_size);
+    }
+
+    if (vaddr >= KERNEL_HALF_BASE) tlb->kernel_half = true;
+}
+
+// Records that table, which mapped vaddr, was unlinked and can be freed.
+void
+mmu_gather_add_table(struct mmu_gather* tlb, uintptr_t vaddr, void* table)
+{
+    if (tlb->num_tables == MMU_GATHER_TABLES) mmu_gather_finish(tlb);
+
+    tlb->tables[tlb->num_tables++] = table;
+    if (vaddr >= KERNEL_HALF_BASE) tlb->kernel_half = true;
+}
+
+/*
+    Only the current address space is flushed. Kernel half tables may be
+    cached under every PCID, so freeing one flushes them all.
+*/
+void
+mmu_gather_flush(struct mmu_gather* tlb)
+{
+    size_t num_pages = tlb->stride ? (tlb->last - tlb->start) / tlb->stride + 1
+                                   : 0;
+
+    if (tlb->num_tables && tlb->kernel_half) {
+        tlb_flush_all();
+    } else if (num_pages > TLB_FLUSH_THRESHOLD) {
+        if (tlb->kernel_half)
+            tlb_flush_all();
+        else
+            tlb_flush();
+    } else if (num_pages) {
+        // invlpg also empties the paging-structure caches of this PCID.
+        for (size_t i = 0; i < num_pages; ++i)
+            tlb_flush_page((void*)(tlb->start + i * tlb->stride));
+    } else if (tlb->num_tables) {
+        tlb_flush();
+    }
+
+    tlb->stride = 0;
+}
+
+void
+mmu_gather_finish(struct mmu_gather* tlb)
+{
+    mmu_gather_flush(tlb);
+
+    for (size_t i = 0; i < tlb->num_tables; ++i)
+        free_page_table(tlb->tables[i]);
+
+    mmu_gather_init(tlb);
+}
+
+void
+tlb_flush_page(void* vaddr)
+{
+    asm volatile("invlpg (%0)" ::"r"(vaddr) : "memory");
+}
+
+void
+tlb_flush(void)
+{
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    asm volatile("mov %0, %%cr3" ::"r"(cr3) : "memory");
+}
+
+void
+tlb_flush_all(void)
+{
+    bool enabled = interrupts_enabled();
+    interrupts_disable();
+
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    asm volatile("mov %0, %%cr4" ::"r"(cr4 & ~CR4_PGE) : "memory");
+    asm volatile("mov %0, %%cr4" ::"r"(cr4) : "memory");
+
+    interrupts_restore(enabled);
+}
+
+bool
+pcid_enabled(void)
+{
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    return cr4 & CR4_PCIDE;
+}
+
+void
+tlb_load_cr3(void* pml4_paddr, uint16_t pcid, bool flush)
+{
+    if (!PAGE_ALIGNED(pml4_paddr))
+        panic("pml4 is not page aligned, pml4_paddr=0x%llX\n", pml4_paddr);
+    if (pcid > PCID_MAX) panic("invalid pcid %d\n", pcid);
+
+    uint64_t cr3 = (uintptr_t)pml4_paddr;
+    if (pcid_enabled()) {
+        cr3 |= pcid;
+        if (!flush) cr3 |= CR3_NOFLUSH;
+    }
+
+    asm volatile("mov %0, %%cr3" ::"r"(cr3) : "memory");
+}
+
+#ifdef TEST
+
+#define TLB_TEST_VADDR        USER_TEST_SLOT(2)
+#define TLB_TEST_UNMAP_PAGES  1000
+#define TLB_TEST_SWITCH_PAGES 64
+#define TLB_TEST_ITERATIONS   1000
+
+// Forward declarations
+static void tlb_test_unmap(void);
+static void tlb_test_switch(void);
+static uint64_t tlb_test_switch_cycles(void* other_pml4_paddr, bool pcid);
+static void tlb_test_touch(size_t num_pages);
+
+void
+tlb_test(void)
+{
+    kprintf("tlb_test\n");
+
+    tlb_test_unmap();
+    tlb_test_switch();
+}
+
+/*
+    Times unmapping pages that are in the TLB one invlpg at a time, as
+    unmap_page does, and gathered, which flushes once.
+*/
+static void
+tlb_test_unmap(void)
+{
+    size_t size = TLB_TEST_UNMAP_PAGES * PAGE_SIZE;
+    char* buf = alloc_pages(TLB_TEST_UNMAP_PAGES);
+    uint64_t cycles[2];
+
+    for (int i = 0; i < 2; ++i) {
+        map_range(vaddr_to_paddr(buf), TLB_TEST_VADDR, size, 1, 0,
+                  MEMORY_TYPE_WB, 1, false);
+        tlb_test_touch(TLB_TEST_UNMAP_PAGES);
+
+        uint64_t start = rdtsc();
+        if (i == 0) {
+            for (size_t j = 0; j < TLB_TEST_UNMAP_PAGES; ++j)
+                unmap_page(TLB_TEST_VADDR + j * PAGE_SIZE);
+        } else {
+            unmap_range(TLB_TEST_VADDR, size);
+        }
+        cycles[i] = rdtsc() - start;
+
+        if (lookup_paddr(TLB_TEST_VADDR))
+            panic("tlb_test: unmapped page is still mapped\n");
+    }
+
+    free_pages(buf, TLB_TEST_UNMAP_PAGES);
+
+    kprintf("tlb_test: unmapping %lld pages takes %lld cycles page by page, "
+            "%lld gathered\n",
+            (uint64_t)TLB_TEST_UNMAP_PAGES, cycles[0], cycles[1]);
+}
+
+/*
+    Times switching to a second set of page tables and back, touching
+    TLB_TEST_SWITCH_PAGES user pages in each, with every switch flushing the
+    TLB and with PCIDs keeping both address spaces' entries.
+*/
+static void
+tlb_test_switch(void)
+{
+    size_t size = TLB_TEST_SWITCH_PAGES * PAGE_SIZE;
+    char* buf = alloc_pages(2 * TLB_TEST_SWITCH_PAGES);
+    struct pt_entry* kernel_pml4 = pml4_vaddr;
+    struct pt_entry* other_pml4 = alloc_page_table();
+
+    for (size_t i = PML4_ENTRIES / 2; i < PML4_ENTRIES; ++i)
+        other_pml4[i] = kernel_pml4[i];
+
+    // The walker works on pml4_vaddr, point it at the other tables to map
+    // the second address space's pages.
+    map_range(vaddr_to_paddr(buf), TLB_TEST_VADDR, size, 1, 0, MEMORY_TYPE_WB,
+              1, false);
+    pml4_vaddr = other_pml4;
+    map_range(vaddr_to_paddr(buf + size), TLB_TEST_VADDR, size, 1, 0,
+              MEMORY_TYPE_WB, 1, false);
+    pml4_vaddr = kernel_pml4;
+
+    uint64_t flush = tlb_test_switch_cycles(vaddr_to_paddr(other_pml4), false);
+    if (pcid_enabled()) {
+        uint64_t pcid =
+            tlb_test_switch_cycles(vaddr_to_paddr(other_pml4), true);
+        kprintf("tlb_test: address space round trip takes %lld cycles "
+                "flushing, %lld with PCIDs\n",
+                flush / TLB_TEST_ITERATIONS, pcid / TLB_TEST_ITERATIONS);
+    } else {
+        kprintf("tlb_test: address space round trip takes %lld cycles, PCIDs "
+                "are not supported\n",
+                flush / TLB_TEST_ITERATIONS);
+    }
+
+    pml4_vaddr = other_pml4;
+    unmap_range(TLB_TEST_VADDR, size);
+    pml4_vaddr = kernel_pml4;
+    unmap_range(TLB_TEST_VADDR, size);
+
+    // Drop what is left tagged with the other PCID.
+    tlb_flush_all();
+    free_page_table(other_pml4);
+    free_pages(buf, 2 * TLB_TEST_SWITCH_PAGES);
+}
+
+static uint64_t
+tlb_test_switch_cycles(void* other_pml4_paddr, bool pcid)
+{
+    void* kernel_pml4_paddr = vaddr_to_paddr(pml4_vaddr);
+    uint64_t start = rdtsc();
+
+    for (size_t i = 0; i < TLB_TEST_ITERATIONS; ++i) {
+        tlb_load_cr3(other_pml4_paddr, pcid, !pcid);
+        tlb_test_touch(TLB_TEST_SWITCH_PAGES);
+        tlb_load_cr3(kernel_pml4_paddr, 0, !pcid);
+        tlb_test_touch(TLB_TEST_SWITCH_PAGES);
+    }
+
+    return rdtsc() - start;
+}
+
+static void
+tlb_test_touch(size_t num_pages)
+{
+    for (size_t i = 0; i < num_pages; ++i)
+        (void)*(volatile char*)(TLB_TEST_VADDR + i * PAGE_SIZE);
+}
+
+#endif
@@ -8,6 +8,7 @@
 #include <kernel/drivers/blk.h>
 #include <limits.h>
 #include <kernel/cpu/paging.h>
+#include <kernel/mm/dma_pool.h>
 
 #define NVME_TIMEOUT 1'000'000'000
 
@@ -44,6 +45,15 @@
 
 #define BLOCK_SIZE 512
 
+#define NVME_QUEUE_SIZE 64
+
+// Admin and I/O queue pairs plus one identify buffer
+#define NVME_PAGE_POOL_PREALLOC 5
+
+// A PRP list describes every page of a transfer after the first, and must
+// not cross a page boundary.
+#define NVME_PRP_LIST_MAX_ENTRIES (PAGE_SIZE / sizeof(uint64_t))
+
 static uint32_t nvme_read_reg_dword(uint32_t offset);
 static void nvme_write_reg_dword(uint32_t offset, uint32_t value);
 static int64_t nvme_read_reg_qword(uint32_t offset);
@@ -78,6 +88,7 @@ struct nvme_submission_queue_entry {
 
 struct nvme_submission_queue {
     struct nvme_submission_queue_entry* vaddr;
+    uintptr_t paddr;
     size_t size;
 };
 
@@ -93,10 +104,15 @@ struct nvme_completion_queue_entry {
 
 struct nvme_completion_queue {
     struct nvme_completion_queue_entry* vaddr;
+    uintptr_t paddr;
     size_t size;
 };
 
 static uint64_t nvme_base_vaddr;
+
+// Page sized, page aligned chunks for queues and identify buffers
+static struct dma_pool nvme_page_pool;
+static struct dma_pool nvme_prp_list_pool;
 static uint64_t nvme_doorbell_stride;
 
 struct nvme_submission_queue admin_submission_queue;
@@ -140,7 +156,8 @@ nvme_init(uint8_t bus, uint8_t device, uint8_t function)
     uint64_t nvme_base_paddr = ((uint64_t)bar1 << 32) | (bar0 & ~0xF);
     assert(PAGE_ALIGNED(nvme_base_paddr));
     nvme_base_vaddr = (uintptr_t)paddr_to_vaddr((void*)nvme_base_paddr);
-    map_pages((void*)nvme_base_paddr, (void*)nvme_base_vaddr, 1, 0, 1, 1, 0, 4);
+    map_pages((void*)nvme_base_paddr, (void*)nvme_base_vaddr, 1, 0,
+              MEMORY_TYPE_UC, 1, 4);
 
     // Check the controller version is supported.
     uint32_t nvme_version = nvme_read_reg_dword(NVME_REGISTER_OFFSET_VS);
@@ -181,19 +198,22 @@ nvme_init(uint8_t bus, uint8_t device, uint8_t function)
         timeout--;
     }
 
+    dma_pool_init(&nvme_page_pool, "nvme_page", PAGE_SIZE, PAGE_SIZE,
+                  PAGE_SIZE, NVME_PAGE_POOL_PREALLOC);
+
     // Initialize admin submission queue
-    admin_submission_queue.vaddr = alloc_pagez(1);
-    admin_submission_queue.size = 63;
-    nvme_write_reg_qword(
-        NVME_REGISTER_OFFSET_ASQ,
-        (uintptr_t)vaddr_to_paddr(admin_submission_queue.vaddr));
+    admin_submission_queue.vaddr =
+        dma_pool_zalloc(&nvme_page_pool, &admin_submission_queue.paddr);
+    admin_submission_queue.size = NVME_QUEUE_SIZE - 1;
+    nvme_write_reg_qword(NVME_REGISTER_OFFSET_ASQ,
+                         admin_submission_queue.paddr);
 
     // Initialize admin completion queue
-    admin_completion_queue.vaddr = alloc_pagez(1);
-    admin_completion_queue.size = 63;
-    nvme_write_reg_qword(
-        NVME_REGISTER_OFFSET_ACQ,
-        (uintptr_t)vaddr_to_paddr(admin_completion_queue.vaddr));
+    admin_completion_queue.vaddr =
+        dma_pool_zalloc(&nvme_page_pool, &admin_completion_queue.paddr);
+    admin_completion_queue.size = NVME_QUEUE_SIZE - 1;
+    nvme_write_reg_qword(NVME_REGISTER_OFFSET_ACQ,
+                         admin_completion_queue.paddr);
 
     // Set AQA sizes
     nvme_write_reg_dword(NVME_REGISTER_OFFSET_AQA,
@@ -219,6 +239,16 @@ nvme_init(uint8_t bus, uint8_t device, uint8_t function)
     nvme_send_admin_command_create_io_completion_queue();
     nvme_send_admin_command_create_io_submission_queue();
 
+    // One PRP list per I/O queue entry, sized for the largest transfer the
+    // controller accepts.
+    size_t prp_list_num_entries = NVME_PRP_LIST_MAX_ENTRIES;
+    if (nvme_max_transfer_size_pages != 0)
+        prp_list_num_entries =
+            MIN(prp_list_num_entries, nvme_max_transfer_size_pages - 1);
+    dma_pool_init(&nvme_prp_list_pool, "nvme_prp_list",
+                  MAX(prp_list_num_entries, 1) * sizeof(uint64_t),
+                  sizeof(uint64_t), PAGE_SIZE, io_submission_queue.size);
+
     uint8_t irq_line = pci_config_get_interrupt_line(bus, device, function);
     idt_set_descriptor(irq_line + 32, nvme_interrupt_handler, 0x8E);
 
@@ -240,7 +270,9 @@ nvme_deinit(void)
 static void
 nvme_send_admin_command_identify_controller()
 {
-    char* nvme_identify_controller_buf = alloc_pagez(1);
+    uintptr_t nvme_identify_controller_buf_paddr;
+    char* nvme_identify_controller_buf =
+        dma_pool_zalloc(&nvme_page_pool, &nvme_identify_controller_buf_paddr);
 
     struct nvme_submission_queue_entry* sqe =
         &admin_submission_queue.vaddr[admin_submission_queue_tail];
@@ -256,7 +288,7 @@ nvme_send_admin_command_identify_controller()
         NVME_COMMAND_IDENTIFIER_IDENTIFY_CONTROLLER;
     sqe->nsid = 0;
     sqe->metadata_ptr = 0;
-    sqe->data_ptr[0] = (uintptr_t)vaddr_to_paddr(nvme_identify_controller_buf);
+    sqe->data_ptr[0] = nvme_identify_controller_buf_paddr;
     sqe->data_ptr[1] = 0;
     sqe->command_specific[0] = 1;
     sqe->command_specific[1] = 0;
@@ -325,12 +357,16 @@ nvme_send_admin_command_identify_controller()
             break;
         }
     }
+
+    dma_pool_free(&nvme_page_pool, nvme_identify_controller_buf);
 }
 
 static void
 nvme_send_admin_command_identify_namespace_list()
 {
-    char* nvme_identify_namespace_list_buf = alloc_pagez(1);
+    uintptr_t nvme_identify_namespace_list_buf_paddr;
+    char* nvme_identify_namespace_list_buf = dma_pool_zalloc(
+        &nvme_page_pool, &nvme_identify_namespace_list_buf_paddr);
 
     struct nvme_submission_queue_entry* sqe =
         &admin_submission_queue.vaddr[admin_submission_queue_tail];
@@ -346,8 +382,7 @@ nvme_send_admin_command_identify_namespace_list()
         NVME_COMMAND_IDENTIFIER_IDENTIFY_NAMESPACE_LIST;
     sqe->nsid = 0;
     sqe->metadata_ptr = 0;
-    sqe->data_ptr[0] =
-        (uintptr_t)vaddr_to_paddr(nvme_identify_namespace_list_buf);
+    sqe->data_ptr[0] = nvme_identify_namespace_list_buf_paddr;
     sqe->data_ptr[1] = 0;
     sqe->command_specific[0] = 2;
     sqe->command_specific[1] = 0;
@@ -421,13 +456,16 @@ nvme_send_admin_command_identify_namespace_list()
             break;
         }
     }
+
+    dma_pool_free(&nvme_page_pool, nvme_identify_namespace_list_buf);
 }
 
 static void
 nvme_send_admin_command_create_io_completion_queue()
 {
-    io_completion_queue.vaddr = alloc_pagez(1);
-    io_completion_queue.size = 64;
+    io_completion_queue.vaddr =
+        dma_pool_zalloc(&nvme_page_pool, &io_completion_queue.paddr);
+    io_completion_queue.size = NVME_QUEUE_SIZE;
 
     struct nvme_submission_queue_entry* sqe =
         &admin_submission_queue.vaddr[admin_submission_queue_tail];
@@ -442,7 +480,7 @@ nvme_send_admin_command_create_io_completion_queue()
         NVME_COMMAND_IDENTIFIER_CREATE_IO_COMPLETION_QUEUE;
     sqe->nsid = 0;
     sqe->metadata_ptr = 0;
-    sqe->data_ptr[0] = (uintptr_t)vaddr_to_paddr(io_completion_queue.vaddr);
+    sqe->data_ptr[0] = io_completion_queue.paddr;
     sqe->data_ptr[1] = 0;
     sqe->command_specific[0] = 1 | ((io_completion_queue.size - 1) << 16);
     sqe->command_specific[1] = (1 << 1) | 1;
@@ -505,8 +543,9 @@ nvme_send_admin_command_create_io_completion_queue()
 static void
 nvme_send_admin_command_create_io_submission_queue()
 {
-    io_submission_queue.vaddr = alloc_pagez(1);
-    io_submission_queue.size = 64;
+    io_submission_queue.vaddr =
+        dma_pool_zalloc(&nvme_page_pool, &io_submission_queue.paddr);
+    io_submission_queue.size = NVME_QUEUE_SIZE;
 
     struct nvme_submission_queue_entry* sqe =
         &admin_submission_queue.vaddr[admin_submission_queue_tail];
@@ -522,7 +561,7 @@ nvme_send_admin_command_create_io_submission_queue()
         NVME_COMMAND_IDENTIFIER_CREATE_IO_SUBMISSION_QUEUE;
     sqe->nsid = 0;
     sqe->metadata_ptr = 0;
-    sqe->data_ptr[0] = (uintptr_t)vaddr_to_paddr(io_submission_queue.vaddr);
+    sqe->data_ptr[0] = io_submission_queue.paddr;
     sqe->data_ptr[1] = 0;
     sqe->command_specific[0] = 1 | ((io_submission_queue.size - 1) << 16);
     sqe->command_specific[1] = 1 | (1 << 16);
@@ -603,6 +642,7 @@ nvme_submit_io(uint8_t opcode, uint64_t lba, uint16_t num_blocks, void* buf)
     sqe->data_ptr[0] = (uintptr_t)vaddr_to_paddr(buf);
 
     uint32_t total_bytes = num_blocks * BLOCK_SIZE;
+    uint64_t* prp_list = NULL;
 
     if (total_bytes <= PAGE_SIZE) {
         sqe->data_ptr[1] = 0;
@@ -611,7 +651,8 @@ nvme_submit_io(uint8_t opcode, uint64_t lba, uint16_t num_blocks, void* buf)
         uintptr_t second_prp = (uintptr_t)vaddr_to_paddr(buf) + PAGE_SIZE;
         sqe->data_ptr[1] = second_prp;
     } else {
-        uint64_t* prp_list = (uint64_t*)alloc_pagez(1);
+        uintptr_t prp_list_paddr;
+        prp_list = dma_pool_alloc(&nvme_prp_list_pool, &prp_list_paddr);
 
         int pages_needed = (total_bytes + PAGE_SIZE - 1) / PAGE_SIZE;
         for (int i = 1; i < pages_needed; ++i) {
@@ -619,7 +660,7 @@ nvme_submit_io(uint8_t opcode, uint64_t lba, uint16_t num_blocks, void* buf)
             prp_list[i - 1] = (uintptr_t)vaddr_to_paddr(buf) + i * PAGE_SIZE;
         }
 
-        sqe->data_ptr[1] = (uintptr_t)vaddr_to_paddr(prp_list);
+        sqe->data_ptr[1] = prp_list_paddr;
     }
 
     sqe->command_specific[0] = (uint32_t)lba;
@@ -646,6 +687,8 @@ nvme_submit_io(uint8_t opcode, uint64_t lba, uint16_t num_blocks, void* buf)
     }
 
     interrupts_disable();
+
+    if (prp_list) dma_pool_free(&nvme_prp_list_pool, prp_list);
 }
 
 void
@@ -1,5 +1,12 @@
 #include <kernel/drivers/pic.h>
 #include <kernel/libk/io.h>
+#include <kernel/drivers/pit.h>
+#include <stddef.h>
+
+#define TIMER_CALLBACKS_MAX 4
+
+static void (*timer_callbacks[TIMER_CALLBACKS_MAX])(void);
+static size_t timer_callbacks_size = 0;
 
 void
 pic_init(void)
@@ -25,6 +32,19 @@ pic_init(void)
 timer_interrupt_handler(void* frame)
 {
     (void)(frame);
+
+    for (size_t i = 0; i < timer_callbacks_size; ++i)
+        timer_callbacks[i]();
+
     outb(0x20, 0x20); // End of interrupt (EOI) for master PIC
     outb(0xA0, 0x20); // End of interrupt (EOI) for slave PIC
 }
+
+void
+timer_add_callback(void (*callback)(void))
+{
+    if (timer_callbacks_size >= TIMER_CALLBACKS_MAX)
+        panic("timer_callbacks is full\n");
+
+    timer_callbacks[timer_callbacks_size++] = callback;
+}
@@ -3,16 +3,21 @@
 #include <kernel/libk/io.h>
 #include <stdint.h>
 
+#define PIT_CALIBRATE_PERIODS 10
+
+// Forward declarations
+static uint16_t pit_read_count(void);
+
 void
 pit_init(void)
 {
-    uint16_t divisor = 1193180 / 100;
+    uint16_t divisor = PIT_FREQUENCY / PIT_HZ;
 
     // Send the command byte
     // 0x36 = 0b00110110
     // - Channel 0
     // - Access mode: lobyte/hibyte
-    // - Operating mode: rate generator
+    // - Operating mode: square wave generator
     // - Binary mode
     outb(PIT_COMMAND, 0x36);
     outb(PIT_DATA, divisor & 0xFF);        // Low byte
@@ -21,3 +26,34 @@ pit_init(void)
     // Unmask IRQ0
     outb(PIC1_DATA, inb(PIC1_DATA) & ~(1 << 0) & ~(1 << 1));
 }
+
+/*
+    Counts TSC cycles over PIT_CALIBRATE_PERIODS periods of channel 0 by
+    polling its count for reloads, so it works with interrupts disabled but
+    needs pit_init and takes a tenth of a second. In square wave mode the
+    count runs down twice per period, reloading every half period.
+*/
+uint64_t
+pit_tsc_frequency(void)
+{
+    uint16_t prev = pit_read_count();
+    uint64_t start = 0;
+
+    for (int reloads = -1; reloads < 2 * PIT_CALIBRATE_PERIODS;) {
+        uint16_t count = pit_read_count();
+        if (count > prev && ++reloads == 0) start = rdtsc();
+        prev = count;
+    }
+
+    return (rdtsc() - start) * PIT_HZ / PIT_CALIBRATE_PERIODS;
+}
+
+// The count only decreases, until it reloads with the divisor.
+static uint16_t
+pit_read_count(void)
+{
+    outb(PIT_COMMAND, 0x00); // Latch the count of channel 0
+    uint8_t low = inb(PIT_DATA);
+    uint8_t high = inb(PIT_DATA);
+    return low | (uint16_t)high << 8;
+}
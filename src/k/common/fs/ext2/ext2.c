@@ -10,6 +10,7 @@
 #include <kernel/cpu/paging.h>
 #include <kernel/fs/fs.h>
 #include <kernel/libk/ds/list.h>
+#include <kernel/mm/slab.h>
 
 // Forward declarations
 static void ext2_read_superblock(struct blk_device* dev,
@@ -64,6 +65,12 @@ ext2_init(struct blk_device* dev, struct fs** ext2_out)
     state->bgdt = kmalloc(num_groups * sizeof(struct ext2_group_desc));
     ext2_read_bgdt(ext2, state->bgdt);
 
+    // On-disk inodes may be larger than struct ext2_inode and are copied
+    // whole.
+    state->inode_cache = kmem_cache_create(
+        "ext2_inode", MAX(sizeof(struct ext2_inode), state->sb->inode_size),
+        _Alignof(struct ext2_inode), NULL, NULL);
+
     *ext2_out = ext2;
 }
 
@@ -80,6 +87,9 @@ ext2_deinit(struct fs* ext2)
     kfree(state->bgdt);
     state->bgdt = NULL;
 
+    kmem_cache_destroy(state->inode_cache);
+    state->inode_cache = NULL;
+
     kfree(ext2->state);
     ext2->state = NULL;
 }
@@ -100,7 +110,7 @@ ext2_stat(struct fs* ext2, const struct path* path, struct fs_stat* st)
 
     st->size = inode->size;
 
-    ext2_free_inode(inode);
+    ext2_free_inode(ext2, inode);
     inode = NULL;
     return FS_RESULT_OK;
 }
@@ -161,7 +171,7 @@ ext2_read(struct fs* ext2, const struct path* path, void* buf, size_t count,
         kfree(block_data);
     }
 
-    ext2_free_inode(inode);
+    ext2_free_inode(ext2, inode);
     inode = NULL;
     return (bytes_read == count) ? FS_RESULT_OK : FS_RESULT_NOT_OK;
 }
@@ -191,7 +201,7 @@ ext2_path_lookup(struct fs* ext2, const struct path* path,
     struct ext2_inode* inode = NULL;
     ext2_get_inode(ext2, EXT2_ROOT_INO, &inode);
     if (!EXT2_ISDIR(inode->mode)) {
-        ext2_free_inode(inode);
+        ext2_free_inode(ext2, inode);
         inode = NULL;
         return FS_RESULT_NOT_OK;
     }
@@ -220,7 +230,7 @@ ext2_path_lookup(struct fs* ext2, const struct path* path,
 
                 if (strcmp(entry->name, comp->name) == 0) {
                     // Matched paths, so get the inode
-                    ext2_free_inode(inode);
+                    ext2_free_inode(ext2, inode);
                     inode = NULL;
                     ext2_get_inode(ext2, entry->inode, &inode);
 
@@ -234,7 +244,7 @@ ext2_path_lookup(struct fs* ext2, const struct path* path,
 
                     // If we matched and we are not done, then we are not ok
                     if (!EXT2_ISDIR(inode->mode)) {
-                        ext2_free_inode(inode);
+                        ext2_free_inode(ext2, inode);
                         inode = NULL;
                         kfree(block_data);
                         block_data = NULL;
@@ -252,7 +262,7 @@ ext2_path_lookup(struct fs* ext2, const struct path* path,
         }
     }
 
-    ext2_free_inode(inode);
+    ext2_free_inode(ext2, inode);
     inode = NULL;
     return FS_RESULT_NOT_OK;
 }
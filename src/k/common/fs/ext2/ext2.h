@@ -112,4 +112,5 @@ struct ext2_state {
     struct ext2_superblock* sb;
     struct ext2_group_desc* bgdt;
     uint32_t block_size;
+    struct slab_cache* inode_cache; // Objects of sb->inode_size bytes
 };
@@ -2,6 +2,7 @@
 #include "blk.h"
 #include <kernel/mm/mm.h>
 #include <kernel/libk/string.h>
+#include <kernel/mm/slab.h>
 
 void
 ext2_get_inode(struct fs* ext2, size_t ino, struct ext2_inode** inode_out)
@@ -15,7 +16,7 @@ ext2_get_inode(struct fs* ext2, size_t ino, struct ext2_inode** inode_out)
         panic("invalid inode number");
     }
 
-    struct ext2_inode* inode = kmalloc(sizeof(struct ext2_inode));
+    struct ext2_inode* inode = kmem_cache_alloc(state->inode_cache);
 
     size_t group = (ino - 1) / sb->inodes_per_group;
     size_t index_in_group = (ino - 1) % sb->inodes_per_group;
@@ -39,8 +40,11 @@ ext2_get_inode(struct fs* ext2, size_t ino, struct ext2_inode** inode_out)
 }
 
 void
-ext2_free_inode(struct ext2_inode* inode)
+ext2_free_inode(struct fs* ext2, struct ext2_inode* inode)
 {
+    assert(ext2 && ext2->state);
     assert(inode);
-    kfree(inode);
+    struct ext2_state* state = ext2->state;
+
+    kmem_cache_free(state->inode_cache, inode);
 }
@@ -2,6 +2,44 @@
 #include <kernel/mm/mm.h>
 #include <kernel/libk/string.h>
 #include <kernel/fs/fs.h>
+#include <kernel/mm/slab.h>
+
+// Component names collected by path_deinit before each kfree_bulk call
+#define PATH_FREE_BATCH 32
+
+static struct slab_cache* path_cache;
+static struct slab_cache* path_component_cache;
+
+void
+path_cache_init(void)
+{
+    path_cache = kmem_cache_create("path", sizeof(struct path),
+                                   _Alignof(struct path), NULL, NULL);
+    path_component_cache = kmem_cache_create(
+        "path_component", sizeof(struct path_component),
+        _Alignof(struct path_component), NULL, NULL);
+}
+
+struct path*
+path_alloc(void)
+{
+    struct path* path = kmem_cache_alloc(path_cache);
+    list_init(&path->components);
+    return path;
+}
+
+void
+path_push(struct path* path, const char* name, size_t name_len)
+{
+    assert(path);
+    assert(name);
+
+    struct path_component* comp = kmem_cache_alloc(path_component_cache);
+    comp->name = kmalloc(name_len + 1);
+    memcpy(comp->name, name, name_len);
+    comp->name[name_len] = '\0';
+    list_push(&path->components, &comp->link);
+}
 
 enum fs_result
 path_init(const char* path_str, struct path** path_out)
@@ -12,8 +50,7 @@ path_init(const char* path_str, struct path** path_out)
     size_t path_str_len = strlen(path_str);
     if (path_str_len == 0 || path_str[0] != '/') return FS_RESULT_NOT_OK;
 
-    struct path* path = kmalloc(sizeof(struct path));
-    list_init(&path->components);
+    struct path* path = path_alloc();
 
     for (size_t i = 1; i < path_str_len; ++i) {
         size_t comp_len = 0;
@@ -28,11 +65,7 @@ path_init(const char* path_str, struct path** path_out)
             return FS_RESULT_NOT_OK;
         }
 
-        struct path_component* comp = kmalloc(sizeof(struct path_component));
-        comp->name = kmalloc(comp_len + 1);
-        memcpy(comp->name, path_str + i, comp_len);
-        comp->name[comp_len] = '\0';
-        list_push(&path->components, &comp->link);
+        path_push(path, path_str + i, comp_len);
         i += comp_len;
     }
 
@@ -45,16 +78,24 @@ path_deinit(struct path* path)
 {
     assert(path);
 
+    void* names[PATH_FREE_BATCH];
+    size_t count = 0;
+
     list_foreach_safe(&path->components, component, tmp)
     {
         struct path_component* comp =
             container_of(component, struct path_component, link);
 
-        kfree(comp->name);
-        kfree(comp);
+        if (count == PATH_FREE_BATCH) {
+            kfree_bulk(count, names);
+            count = 0;
+        }
+        names[count++] = comp->name;
+        kmem_cache_free(path_component_cache, comp);
     }
 
-    kfree(path);
+    kfree_bulk(count, names);
+    kmem_cache_free(path_cache, path);
 }
 
 void
@@ -72,6 +113,8 @@ path_print(const struct path* path)
 
 #ifdef TEST
 
+#define PATH_TEST_COMPONENTS 48
+
 void
 path_test(void)
 {
@@ -140,6 +183,24 @@ path_test(void)
     path_deinit(path);
     path = NULL;
 
+    // Crosses the end of path_deinit's first batch
+    char long_path[2 * PATH_TEST_COMPONENTS + 1];
+    for (size_t i = 0; i < PATH_TEST_COMPONENTS; ++i) {
+        long_path[2 * i] = '/';
+        long_path[2 * i + 1] = 'a' + i % 26;
+    }
+    long_path[2 * PATH_TEST_COMPONENTS] = '\0';
+
+    assert(path_init(long_path, &path) == FS_RESULT_OK);
+    size_t num_components = 0;
+    list_foreach(&path->components, component)
+    {
+        ++num_components;
+    }
+    assert(num_components == PATH_TEST_COMPONENTS);
+    path_deinit(path);
+    path = NULL;
+
     assert(path_init("", &path) == FS_RESULT_NOT_OK);
     assert(path_init("a", &path) == FS_RESULT_NOT_OK);
     assert(path_init("abacus", &path) == FS_RESULT_NOT_OK);
@@ -16,6 +16,8 @@ uvfs_init(void)
 {
     kprintf("[START] Initialize UVFS\n");
 
+    path_cache_init();
+    vfs_cache_init();
     vfs_init(&uvfs);
 
     kprintf("[DONE ] Initialize UVFS\n");
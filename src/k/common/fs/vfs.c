@@ -6,6 +6,7 @@
 #include <kernel/libk/ds/list.h>
 #include <stddef.h>
 #include <kernel/fs/path.h>
+#include <kernel/mm/slab.h>
 
 struct mount_node {
     struct tree_node node;
@@ -13,11 +14,21 @@ struct mount_node {
     struct fs* fs;
 };
 
+static struct slab_cache* mount_node_cache;
+
 // Forward declarations
 static enum fs_result vfs_path_lookup(struct fs* vfs, const struct path* path,
                                       struct mount_node** mount_node_out,
                                       struct path** subpath_out);
 
+void
+vfs_cache_init(void)
+{
+    mount_node_cache =
+        kmem_cache_create("mount_node", sizeof(struct mount_node),
+                          _Alignof(struct mount_node), NULL, NULL);
+}
+
 void
 vfs_init(struct fs** vfs_ptr)
 {
@@ -68,7 +79,7 @@ vfs_mount(struct fs* vfs, const struct path* mount_path, struct fs* mount_fs)
         }
 
         // Create root mount node
-        struct mount_node* root_mount = kmalloc(sizeof(struct mount_node));
+        struct mount_node* root_mount = kmem_cache_alloc(mount_node_cache);
         tree_node_init(&root_mount->node, 0);
         root_mount->name = kmalloc(2);
         strcpy(root_mount->name, "/");
@@ -117,7 +128,7 @@ vfs_mount(struct fs* vfs, const struct path* mount_path, struct fs* mount_fs)
             child->fs = mount_fs;
         } else if (child == NULL) {
             // Create new node
-            child = kmalloc(sizeof(struct mount_node));
+            child = kmem_cache_alloc(mount_node_cache);
             tree_node_init(&child->node, 0);
 
             // Copy component name
@@ -288,8 +299,7 @@ vfs_path_lookup(struct fs* vfs, const struct path* path,
     *mount_node_ptr = deepest_mount;
 
     // Create subpath from components after the mount point
-    struct path* subpath = kmalloc(sizeof(struct path));
-    list_init(&subpath->components);
+    struct path* subpath = path_alloc();
 
     // Skip components up to the mount point
     struct list_node* comp_link = path->components.head;
@@ -305,13 +315,7 @@ vfs_path_lookup(struct fs* vfs, const struct path* path,
         struct path_component* orig_comp =
             container_of(comp_link, struct path_component, link);
 
-        struct path_component* new_comp =
-            kmalloc(sizeof(struct path_component));
-        size_t name_len = strlen(orig_comp->name);
-        new_comp->name = kmalloc(name_len + 1);
-        strcpy(new_comp->name, orig_comp->name);
-
-        list_push(&subpath->components, &new_comp->link);
+        path_push(subpath, orig_comp->name, strlen(orig_comp->name));
 
         comp_link = comp_link->next;
     }
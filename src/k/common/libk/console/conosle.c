@@ -5,7 +5,8 @@
 #include <stdint.h>
 #include <kernel/boot/header.h>
 #include <kernel/drivers/serial.h>
-#include <kernel/drivers/gop.h>
+#include <kernel/drivers/pit.h>
+#include <kernel/libk/io.h>
 
 // Forward declarations
 static void console_scroll_down(void);
@@ -91,3 +92,37 @@ console_scroll_down(void)
     }
     boot_header->console.y -= font.height;
 }
+
+#ifdef TEST
+
+#define CONSOLE_TEST_LINES 256
+
+/*
+    Fills whole lines through console_putchar, which scrolls on every line
+    once the screen is full, and reports lines per second against the TSC.
+*/
+void
+console_test(void)
+{
+    kprintf("console_test\n");
+
+    size_t line_length = FB_WIDTH / font.width - 1;
+    uint64_t start = rdtsc();
+
+    for (size_t i = 0; i < CONSOLE_TEST_LINES; ++i) {
+        for (size_t j = 0; j < line_length; ++j)
+            console_putchar('!' + (i + j) % ('~' - '!' + 1));
+        console_putchar('\n');
+    }
+
+    uint64_t cycles = rdtsc() - start;
+    uint64_t tsc_frequency = pit_tsc_frequency();
+
+    kprintf("console_test: %lld lines in %lld cycles, %lld lines per second "
+            "at %lld MHz\n",
+            (uint64_t)CONSOLE_TEST_LINES, cycles,
+            CONSOLE_TEST_LINES * tsc_frequency / cycles,
+            tsc_frequency / 1000000);
+}
+
+#endif
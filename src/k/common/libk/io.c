@@ -111,6 +111,26 @@ wrmsr(uint32_t msr, uint64_t value)
     asm volatile("wrmsr" : : "a"(low), "d"(high), "c"(msr));
 }
 
+struct cpuid
+cpuid(uint32_t leaf, uint32_t subleaf)
+{
+    struct cpuid result;
+    asm volatile("cpuid"
+                 : "=a"(result.eax), "=b"(result.ebx), "=c"(result.ecx),
+                   "=d"(result.edx)
+                 : "a"(leaf), "c"(subleaf));
+    return result;
+}
+
+uint64_t
+rdtsc(void)
+{
+    uint32_t low = 0;
+    uint32_t high = 0;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | (uint64_t)low;
+}
+
 void
 kputchar(char ch)
 {
@@ -123,12 +143,27 @@ kputchar(char ch)
     console_putchar(ch);
 }
 
+/*
+    Output goes to the console when there is no buffer.
+*/
 static void
-kprint(const char* str)
+kbputchar(struct kbuf* out, char ch)
+{
+    if (!out) {
+        kputchar(ch);
+        return;
+    }
+
+    if (out->len + 1 < out->size) out->data[out->len] = ch;
+    ++out->len;
+}
+
+static void
+kprint(struct kbuf* out, const char* str)
 {
     char ch;
     while ((ch = *str)) {
-        kputchar(ch);
+        kbputchar(out, ch);
         ++str;
     }
 }
@@ -139,14 +174,14 @@ typedef enum BASE {
 } BASE;
 
 static void
-kprintuld(uint64_t num, BASE base, uint8_t min_width)
+kprintuld(struct kbuf* out, uint64_t num, BASE base, uint8_t min_width)
 {
     if (num == 0) {
-        kputchar('0');
+        kbputchar(out, '0');
 
         if (min_width > 1) {
             for (size_t i = 0; i < min_width - 1; ++i) {
-                kputchar('0');
+                kbputchar(out, '0');
             }
         }
 
@@ -172,12 +207,12 @@ kprintuld(uint64_t num, BASE base, uint8_t min_width)
 
     if (min_width > len) {
         for (size_t i = 0; i < min_width - len; ++i) {
-            kputchar('0');
+            kbputchar(out, '0');
         }
     }
 
     for (size_t i = 0; i < len; ++i) {
-        kputchar(nums[len - 1 - i]);
+        kbputchar(out, nums[len - 1 - i]);
     }
 }
 
@@ -191,12 +226,9 @@ typedef enum KPRINTF_STATE {
 
 #define MAX_MIN_WIDTH_SPECIFIER_LENGTH 8
 
-void
-kprintf(const char* fmt, ...)
+static void
+vkbprintf(struct kbuf* out, const char* fmt, va_list args)
 {
-    va_list args;
-    va_start(args, fmt);
-
     KPRINTF_STATE state = KPRINTF_STATE_NORMAL;
     char ch;
 
@@ -208,32 +240,32 @@ kprintf(const char* fmt, ...)
             if (ch == '%') {
                 state = KPRINTF_STATE_FIND_FORMAT;
             } else {
-                kputchar(ch);
+                kbputchar(out, ch);
             }
         } else if (state == KPRINTF_STATE_FIND_FORMAT) {
             if (ch == '%') {
-                kputchar('%');
+                kbputchar(out, '%');
                 state = KPRINTF_STATE_NORMAL;
             } else if (ch == 's') {
-                kprint(va_arg(args, const char*));
+                kprint(out, va_arg(args, const char*));
                 state = KPRINTF_STATE_NORMAL;
             } else if (ch == 'b') {
                 uint32_t arg = va_arg(args, uint32_t);
 
                 if (arg == 0) {
-                    kprint("false");
+                    kprint(out, "false");
                 } else if (arg == 1) {
-                    kprint("true");
+                    kprint(out, "true");
                 } else {
                     assert(false && "invalid kprintf state");
                 }
 
                 state = KPRINTF_STATE_NORMAL;
             } else if (ch == 'd') {
-                kprintuld(va_arg(args, uint32_t), DECIMAL, 0);
+                kprintuld(out, va_arg(args, uint32_t), DECIMAL, 0);
                 state = KPRINTF_STATE_NORMAL;
             } else if (ch == 'X') {
-                kprintuld(va_arg(args, uint32_t), HEXADECIMAL, 0);
+                kprintuld(out, va_arg(args, uint32_t), HEXADECIMAL, 0);
                 state = KPRINTF_STATE_NORMAL;
             } else if ('0' <= ch && ch <= '9') {
                 uint8_t digit = (uint8_t)(ch - '0');
@@ -263,11 +295,12 @@ kprintf(const char* fmt, ...)
                 }
 
                 if (ch == 'd') {
-                    kprintuld(va_arg(args, uint32_t), DECIMAL, min_width);
+                    kprintuld(out, va_arg(args, uint32_t), DECIMAL, min_width);
                     min_width_specifier_len = 0;
                     state = KPRINTF_STATE_NORMAL;
                 } else if (ch == 'X') {
-                    kprintuld(va_arg(args, uint32_t), HEXADECIMAL, min_width);
+                    kprintuld(out, va_arg(args, uint32_t), HEXADECIMAL,
+                              min_width);
                     min_width_specifier_len = 0;
                     state = KPRINTF_STATE_NORMAL;
                 } else if (ch == 'l') {
@@ -278,10 +311,10 @@ kprintf(const char* fmt, ...)
             }
         } else if (state == KPRINTF_STATE_FIND_FORMAT_AFTER_LONG) {
             if (ch == 'd') {
-                kprintuld(va_arg(args, uint64_t), DECIMAL, 0);
+                kprintuld(out, va_arg(args, uint64_t), DECIMAL, 0);
                 state = KPRINTF_STATE_NORMAL;
             } else if (ch == 'X') {
-                kprintuld(va_arg(args, uint64_t), HEXADECIMAL, 0);
+                kprintuld(out, va_arg(args, uint64_t), HEXADECIMAL, 0);
                 state = KPRINTF_STATE_NORMAL;
             }
         } else if (state ==
@@ -295,11 +328,11 @@ kprintf(const char* fmt, ...)
             }
 
             if (ch == 'd') {
-                kprintuld(va_arg(args, uint64_t), DECIMAL, min_width);
+                kprintuld(out, va_arg(args, uint64_t), DECIMAL, min_width);
                 min_width_specifier_len = 0;
                 state = KPRINTF_STATE_NORMAL;
             } else if (ch == 'X') {
-                kprintuld(va_arg(args, uint64_t), HEXADECIMAL, min_width);
+                kprintuld(out, va_arg(args, uint64_t), HEXADECIMAL, min_width);
                 min_width_specifier_len = 0;
                 state = KPRINTF_STATE_NORMAL;
             } else {
@@ -312,3 +345,24 @@ kprintf(const char* fmt, ...)
         ++fmt;
     }
 }
+
+void
+kprintf(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vkbprintf(NULL, fmt, args);
+    va_end(args);
+}
+
+void
+kbprintf(struct kbuf* buf, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vkbprintf(buf, fmt, args);
+    va_end(args);
+
+    if (buf && buf->size)
+        buf->data[buf->len < buf->size ? buf->len : buf->size - 1] = '\0';
+}
@@ -0,0 +1,142 @@
+#include <kernel/mm/dma_pool.h>
+#include <kernel/mm/mm.h>
+#include <kernel/mm/pfa.h>
+#include <kernel/cpu/paging.h>
+#include <kernel/libk/io.h>
+#include <kernel/libk/math.h>
+#include <kernel/libk/string.h>
+
+#define IS_POWER_OF_TWO(x) ((x) != 0 && ((x) & ((x) - 1)) == 0)
+
+// Forward declarations
+static void dma_pool_grow(struct dma_pool* pool);
+
+void
+dma_pool_init(struct dma_pool* pool, const char* name, size_t size,
+              size_t align, size_t boundary, size_t num_prealloc)
+{
+    assert(pool);
+    if (!IS_POWER_OF_TWO(align) || align > PAGE_SIZE)
+        panic("dma_pool %s: invalid alignment %lld\n", name, (uint64_t)align);
+
+    size = MAX(size, sizeof(void*));
+    size = CEIL_DIV(size, align) * align;
+
+    if (boundary && (!IS_POWER_OF_TWO(boundary) || boundary < size))
+        panic("dma_pool %s: chunks of %lld bytes cannot respect a %lld byte "
+              "boundary\n",
+              name, (uint64_t)size, (uint64_t)boundary);
+
+    pool->name = name;
+    pool->size = size;
+    pool->align = align;
+    pool->boundary = boundary;
+    pool->block_num_pages = CEIL_DIV(size, PAGE_SIZE);
+    pool->free_list = NULL;
+    pool->blocks = NULL;
+    pool->num_chunks = 0;
+    pool->num_free = 0;
+    pool->num_grows = 0;
+
+    while (pool->num_chunks < num_prealloc)
+        dma_pool_grow(pool);
+    pool->num_grows = 0;
+}
+
+void
+dma_pool_deinit(struct dma_pool* pool)
+{
+    assert(pool);
+    if (pool->num_free != pool->num_chunks)
+        panic("dma_pool %s: %lld chunks still in use\n", pool->name,
+              (uint64_t)(pool->num_chunks - pool->num_free));
+
+    while (pool->blocks) {
+        struct page* page = pool->blocks;
+        pool->blocks = page->next;
+        page->next = NULL;
+        page->owner = NULL;
+        free_pages(page_to_virt(page), pool->block_num_pages);
+    }
+
+    pool->free_list = NULL;
+    pool->num_chunks = 0;
+    pool->num_free = 0;
+}
+
+void*
+dma_pool_alloc(struct dma_pool* pool, uintptr_t* paddr)
+{
+    assert(pool);
+    assert(paddr);
+
+    if (!pool->free_list) {
+        ++pool->num_grows;
+        dma_pool_grow(pool);
+    }
+
+    void* vaddr = pool->free_list;
+    pool->free_list = *(void**)vaddr;
+    --pool->num_free;
+
+    *paddr = (uintptr_t)vaddr_to_paddr(vaddr);
+    return vaddr;
+}
+
+void*
+dma_pool_zalloc(struct dma_pool* pool, uintptr_t* paddr)
+{
+    void* vaddr = dma_pool_alloc(pool, paddr);
+    memset(vaddr, 0, pool->size);
+    return vaddr;
+}
+
+void
+dma_pool_free(struct dma_pool* pool, void* vaddr)
+{
+    assert(pool);
+    if (!vaddr) panic("dma_pool %s: vaddr is NULL\n", pool->name);
+
+    struct page* page = virt_to_page(PAGE_ALIGN_DOWN(vaddr));
+    if (!page || page->owner != pool)
+        panic("dma_pool %s: 0x%llX is not from this pool\n", pool->name,
+              vaddr);
+
+    *(void**)vaddr = pool->free_list;
+    pool->free_list = vaddr;
+    ++pool->num_free;
+}
+
+/*
+    Carves a new block into chunks. A block is a single page when chunks are
+    smaller than one, otherwise it holds exactly one chunk.
+*/
+static void
+dma_pool_grow(struct dma_pool* pool)
+{
+    char* block = alloc_pages_exact(pool->block_num_pages);
+    size_t block_size = pool->block_num_pages * PAGE_SIZE;
+
+    struct page* page = virt_to_page(block);
+    page->owner = pool;
+    page->next = pool->blocks;
+    pool->blocks = page;
+
+    size_t offset = 0;
+    while (offset + pool->size <= block_size) {
+        size_t last = offset + pool->size - 1;
+        if (pool->boundary &&
+            offset / pool->boundary != last / pool->boundary) {
+            offset = CEIL_DIV(offset, pool->boundary) * pool->boundary;
+            continue;
+        }
+
+        void* chunk = block + offset;
+        *(void**)chunk = pool->free_list;
+        pool->free_list = chunk;
+        ++pool->num_chunks;
+        ++pool->num_free;
+
+        offset += pool->size;
+    }
+}
@@ -4,7 +4,6 @@
 #include <kernel/libk/string.h>
 
 #define KERNEL_STACK_NUM_PAGES 16
-#define USER_STACK_NUM_PAGES   16
 
 void*
 alloc_kernel_stack(void)
@@ -27,26 +26,3 @@ free_kernel_stack(void* stack_top)
 
     free_pages(stack_btm, KERNEL_STACK_NUM_PAGES);
 }
-
-void*
-alloc_user_stack(void* stack_top_user_vaddr)
-{
-    assert(PAGE_ALIGNED(stack_top_user_vaddr));
-
-    // Allocate a stack
-    void* stack_btm_kernel_vaddr = alloc_pagez(USER_STACK_NUM_PAGES);
-
-    // Remap the pages to user data
-    void* stack_btm_kernel_paddr = vaddr_to_paddr(stack_btm_kernel_vaddr);
-    unmap_pages(stack_btm_kernel_vaddr, USER_STACK_NUM_PAGES);
-
-    void* stack_btm_user_vaddr =
-        stack_top_user_vaddr - (USER_STACK_NUM_PAGES - 1) * PAGE_SIZE;
-    map_pages_user_data(stack_btm_kernel_paddr + PAGE_SIZE,
-                        stack_btm_user_vaddr, USER_STACK_NUM_PAGES - 1);
-
-    // Return a pointer to the top of the stack for the kernel
-    void* stack_top_kernel_vaddr =
-        stack_btm_kernel_vaddr + USER_STACK_NUM_PAGES * PAGE_SIZE;
-    return stack_top_kernel_vaddr;
-}
@@ -4,29 +4,61 @@
 #include <kernel/boot/header.h>
 #include <kernel/cpu/paging.h>
 #include <kernel/libk/math.h>
+#include <kernel/libk/string.h>
+#include <kernel/mm/mm.h>
 
 // Forward declarations
-static void* get_buddy(struct pfa_state* state, void* page, size_t order);
-static void free_list_add(struct pfa_state* state, void* page, size_t order);
-static void* free_list_remove(struct pfa_state* state, size_t order);
+static struct page* region_alloc(struct pfa_region* region, size_t order);
+static void region_free(struct pfa_region* region, size_t page_idx,
+                        size_t order);
+static void region_free_range(struct pfa_region* region, size_t page_idx,
+                              size_t num_pages);
+static struct pfa_region* get_region(struct pfa_state* state, void* page);
+static struct pfa_region* get_page_region(struct pfa_state* state,
+                                          struct page* page);
+static struct page* get_page_desc(struct pfa_region* region, void* page);
+static void* get_page_addr(struct pfa_region* region, struct page* page);
+static void free_list_add(struct pfa_region* region, struct page* page,
+                          size_t order);
+static void free_list_del(struct pfa_region* region, struct page* page,
+                          size_t order);
+static struct page* free_list_remove(struct pfa_region* region, size_t order);
 static size_t get_order(size_t num_pages);
 
 void
-pfa_init(struct pfa_state* state, void* start, size_t num_pages)
+pfa_init(struct pfa_state* state)
 {
-    kprintf("[START] Initialize Page Frame Allocator\n");
+    state->num_regions = 0;
+}
 
-    state->start = start;
-    state->num_pages = num_pages;
+size_t
+pfa_add_region(struct pfa_state* state, void* start, size_t num_pages)
+{
+    // The page descriptors live at the start of the region they describe.
+    size_t pages_num_pages =
+        CEIL_DIV(num_pages * sizeof(struct page), PAGE_SIZE);
+    if (pages_num_pages >= num_pages) return 0;
+
+    if (state->num_regions >= PFA_REGIONS_MAX) {
+        kprintf("pfa: too many regions, dropping %lld pages at 0x%llX\n",
+                (uint64_t)num_pages, start);
+        return 0;
+    }
+
+    struct pfa_region* region = &state->regions[state->num_regions++];
+    region->pages = start;
+    region->start = (void*)((uintptr_t)start + pages_num_pages * PAGE_SIZE);
+    region->num_pages = num_pages - pages_num_pages;
+    memset(region->pages, 0, region->num_pages * sizeof(struct page));
 
     for (size_t i = 0; i <= MAX_ORDER; i++) {
-        state->free_areas[i].free_list = NULL;
-        state->free_areas[i].nr_free = 0;
+        region->free_areas[i].free_list = NULL;
+        region->free_areas[i].nr_free = 0;
     }
 
-    for (size_t page_idx = 0; page_idx < state->num_pages;) {
+    for (size_t page_idx = 0; page_idx < region->num_pages;) {
         size_t max_order = 0;
-        size_t pages_left = state->num_pages - page_idx;
+        size_t pages_left = region->num_pages - page_idx;
 
         for (size_t order = MAX_ORDER; order > 0; order--) {
             if ((page_idx & ((1 << order) - 1)) == 0 &&
@@ -36,119 +68,384 @@ pfa_init(struct pfa_state* state, void* start, size_t num_pages)
             }
         }
 
-        void* page = (void*)((uintptr_t)state->start + page_idx * PAGE_SIZE);
-        free_list_add(state, page, max_order);
+        free_list_add(region, &region->pages[page_idx], max_order);
         page_idx += (1 << max_order);
     }
 
-    kprintf("[DONE ] Initialize Page Frame Allocator\n");
+    return region->num_pages;
 }
 
 void*
 pfa_alloc_pages(struct pfa_state* state, size_t num_pages)
+{
+    void* ptr = pfa_try_alloc_pages(state, num_pages);
+    if (!ptr) pfa_out_of_memory(state, num_pages);
+
+    return ptr;
+}
+
+void*
+pfa_try_alloc_pages(struct pfa_state* state, size_t num_pages)
+{
+    if (num_pages == 0) panic("you cannot allocate 0 pages");
+
+    size_t order = get_order(num_pages);
+
+    for (size_t i = 0; i < state->num_regions; ++i) {
+        struct pfa_region* region = &state->regions[i];
+        struct page* page = region_alloc(region, order);
+        if (page) return get_page_addr(region, page);
+    }
+
+    return NULL;
+}
+
+void
+pfa_free_pages(struct pfa_state* state, void* ptr, size_t num_pages)
+{
+    if (!ptr) panic("ptr is NULL");
+    if (!PAGE_ALIGNED(ptr)) panic("ptr is not page aligned");
+
+    size_t order = get_order(num_pages);
+
+    struct pfa_region* region = get_region(state, ptr);
+    if (!region) return;
+
+    struct page* page = get_page_desc(region, ptr);
+    if (!(page->flags & PAGE_FLAGS_UNALLOCATED) &&
+        (page->order != order || page->flags & PAGE_FLAG_EXACT))
+        panic("freeing an order %d block as order %lld, ptr=0x%llX\n",
+              page->order, (uint64_t)order, ptr);
+
+    region_free(region, page - region->pages, order);
+}
+
+void*
+pfa_alloc_pages_exact(struct pfa_state* state, size_t num_pages)
+{
+    void* ptr = pfa_try_alloc_pages_exact(state, num_pages);
+    if (!ptr) pfa_out_of_memory(state, num_pages);
+
+    return ptr;
+}
+
+void*
+pfa_try_alloc_pages_exact(struct pfa_state* state, size_t num_pages)
 {
     if (num_pages == 0) panic("you cannot allocate 0 pages");
 
     size_t order = get_order(num_pages);
+
+    for (size_t i = 0; i < state->num_regions; ++i) {
+        struct pfa_region* region = &state->regions[i];
+        struct page* page = region_alloc(region, order);
+        if (!page) continue;
+
+        size_t page_idx = page - region->pages;
+        region_free_range(region, page_idx + num_pages,
+                          ((size_t)1 << order) - num_pages);
+
+        page->flags |= PAGE_FLAG_EXACT;
+        page->num_pages = num_pages;
+        return get_page_addr(region, page);
+    }
+
+    return NULL;
+}
+
+void
+pfa_free_pages_exact(struct pfa_state* state, void* ptr, size_t num_pages)
+{
+    if (!ptr) panic("ptr is NULL");
+    if (!PAGE_ALIGNED(ptr)) panic("ptr is not page aligned");
+
+    struct pfa_region* region = get_region(state, ptr);
+    if (!region) return;
+
+    struct page* page = get_page_desc(region, ptr);
+    if (!(page->flags & PAGE_FLAGS_UNALLOCATED) &&
+        (!(page->flags & PAGE_FLAG_EXACT) || page->num_pages != num_pages))
+        panic("freeing %lld pages that were not allocated as such, "
+              "ptr=0x%llX\n",
+              (uint64_t)num_pages, ptr);
+
+    region_free_range(region, page - region->pages, num_pages);
+}
+
+size_t
+pfa_alloc_pages_bulk(struct pfa_state* state, size_t count,
+                     struct page** list)
+{
+    size_t num_pages = 0;
+    *list = NULL;
+
+    for (size_t i = 0; i < state->num_regions && num_pages < count; ++i) {
+        struct pfa_region* region = &state->regions[i];
+
+        while (num_pages < count) {
+            struct page* page = region_alloc(region, 0);
+            if (!page) break;
+
+            page->next = *list;
+            *list = page;
+            ++num_pages;
+        }
+    }
+
+    return num_pages;
+}
+
+void
+pfa_free_pages_bulk(struct pfa_state* state, struct page* list)
+{
+    while (list) {
+        struct page* next = list->next;
+        struct pfa_region* region = get_page_region(state, list);
+        if (!region) panic("page is not in any region\n");
+
+        region_free(region, list - region->pages, 0);
+        list = next;
+    }
+}
+
+void
+pfa_get_stats(const struct pfa_state* state, struct pfa_stats* stats)
+{
+    *stats = (struct pfa_stats){.largest_order = -1};
+
+    for (size_t i = 0; i < state->num_regions; ++i) {
+        const struct pfa_region* region = &state->regions[i];
+        stats->num_pages += region->num_pages;
+
+        for (size_t order = 0; order <= MAX_ORDER; ++order) {
+            size_t nr_free = region->free_areas[order].nr_free;
+            stats->nr_free[order] += nr_free;
+            stats->free_pages += nr_free << order;
+            if (nr_free) stats->largest_order = order;
+        }
+    }
+}
+
+/*
+    The share of free memory, in per mille, that sits in blocks too small to
+    serve an allocation of the given order. 0 means any free page could be
+    used, 1000 means the allocation fails even though memory is free.
+*/
+size_t
+pfa_frag_index(const struct pfa_stats* stats, size_t order)
+{
+    if (stats->free_pages == 0) return 0;
+
+    size_t usable = 0;
+    for (size_t i = order; i <= MAX_ORDER; ++i)
+        usable += stats->nr_free[i] << i;
+
+    return (stats->free_pages - usable) * 1000 / stats->free_pages;
+}
+
+void
+pfa_dump_stats(const struct pfa_state* state, struct kbuf* out)
+{
+    struct pfa_stats stats;
+    pfa_get_stats(state, &stats);
+
+    kbprintf(out, "pfa: %lld of %lld pages free in %lld regions\n",
+             (uint64_t)stats.free_pages, (uint64_t)stats.num_pages,
+             (uint64_t)state->num_regions);
+
+    for (size_t order = 0; order <= MAX_ORDER; ++order) {
+        kbprintf(out, "pfa: order %lld: %lld free, fragmentation %lld/1000\n",
+                 (uint64_t)order, (uint64_t)stats.nr_free[order],
+                 (uint64_t)pfa_frag_index(&stats, order));
+    }
+
+    if (stats.largest_order >= 0)
+        kbprintf(out, "pfa: largest free block is order %d (%lld pages)\n",
+                 stats.largest_order, (uint64_t)1 << stats.largest_order);
+}
+
+void
+pfa_out_of_memory(const struct pfa_state* state, size_t num_pages)
+{
+    struct pfa_stats stats;
+    pfa_get_stats(state, &stats);
+    panic("out of memory, %lld pages requested, %lld pages free, largest "
+          "free block %lld pages\n",
+          (uint64_t)num_pages, (uint64_t)stats.free_pages,
+          stats.largest_order < 0 ? 0 : (uint64_t)1 << stats.largest_order);
+}
+
+struct page*
+pfa_virt_to_page(struct pfa_state* state, void* ptr)
+{
+    struct pfa_region* region = get_region(state, ptr);
+    if (!region) return NULL;
+
+    return get_page_desc(region, ptr);
+}
+
+void*
+pfa_page_to_virt(struct pfa_state* state, struct page* page)
+{
+    struct pfa_region* region = get_page_region(state, page);
+    if (!region) return NULL;
+
+    return get_page_addr(region, page);
+}
+
+static struct page*
+region_alloc(struct pfa_region* region, size_t order)
+{
     size_t current = order;
-    void* page = NULL;
+    struct page* page = NULL;
 
     while (current <= MAX_ORDER) {
-        page = free_list_remove(state, current);
+        page = free_list_remove(region, current);
         if (page) {
             break;
         }
         current++;
     }
 
-    if (!page) {
-        panic("out of memory");
-    }
+    if (!page) return NULL;
 
     while (current > order) {
         current--;
-        void* buddy = (void*)((uintptr_t)page + (1 << current) * PAGE_SIZE);
-        free_list_add(state, buddy, current);
+        free_list_add(region, page + (1 << current), current);
     }
 
+    page_set_allocated(page, order);
     return page;
 }
 
-void
-pfa_free_pages(struct pfa_state* state, void* ptr, size_t num_pages)
+static void
+region_free(struct pfa_region* region, size_t page_idx, size_t order)
 {
-    if (!ptr) panic("ptr is NULL");
-    if (!PAGE_ALIGNED(ptr)) panic("ptr is not page aligned");
+    if (region->pages[page_idx].flags & PAGE_FLAGS_UNALLOCATED)
+        panic("double free, ptr=0x%llX\n",
+              get_page_addr(region, &region->pages[page_idx]));
 
-    size_t order = get_order(num_pages);
+    while (order < MAX_ORDER) {
+        size_t buddy_idx = page_idx ^ (1 << order);
+        if (buddy_idx >= region->num_pages) break;
+
+        struct page* buddy = &region->pages[buddy_idx];
+        if (!(buddy->flags & PAGE_FLAG_FREE) || buddy->order != order) break;
 
-    if (ptr < state->start || ptr >= (void*)((uintptr_t)state->start +
-                                             state->num_pages * PAGE_SIZE)) {
-        return;
+        free_list_del(region, buddy, order);
+        page_idx &= ~((size_t)1 << order);
+        order++;
     }
 
-    while (order < MAX_ORDER) {
-        void* buddy = get_buddy(state, ptr, order);
-        void* current = state->free_areas[order].free_list;
-        void* prev = NULL;
-        bool found = false;
-
-        while (current) {
-            if (current == buddy) {
-                if (prev) {
-                    *(void**)prev = *(void**)current;
-                } else {
-                    state->free_areas[order].free_list = *(void**)current;
-                }
-                state->free_areas[order].nr_free--;
-                found = true;
-                break;
-            }
-            prev = current;
-            current = *(void**)current;
-        }
+    free_list_add(region, &region->pages[page_idx], order);
+}
 
-        if (!found) {
-            free_list_add(state, ptr, order);
-            return;
-        }
+/*
+    Frees an arbitrary run of pages by breaking it into the largest naturally
+    aligned buddy blocks it contains.
+*/
+static void
+region_free_range(struct pfa_region* region, size_t page_idx,
+                  size_t num_pages)
+{
+    while (num_pages > 0) {
+        size_t order = MAX_ORDER;
+        while (order > 0 && ((page_idx & ((1 << order) - 1)) != 0 ||
+                             num_pages < ((size_t)1 << order)))
+            order--;
 
-        if (buddy < ptr) {
-            ptr = buddy;
-        }
-        order++;
+        region_free(region, page_idx, order);
+        page_idx += (size_t)1 << order;
+        num_pages -= (size_t)1 << order;
     }
+}
 
-    free_list_add(state, ptr, order);
+static struct pfa_region*
+get_region(struct pfa_state* state, void* page)
+{
+    for (size_t i = 0; i < state->num_regions; ++i) {
+        struct pfa_region* region = &state->regions[i];
+        if (page >= region->start &&
+            page < (void*)((uintptr_t)region->start +
+                           region->num_pages * PAGE_SIZE))
+            return region;
+    }
+
+    return NULL;
+}
+
+static struct pfa_region*
+get_page_region(struct pfa_state* state, struct page* page)
+{
+    for (size_t i = 0; i < state->num_regions; ++i) {
+        struct pfa_region* region = &state->regions[i];
+        if (page >= region->pages && page < region->pages + region->num_pages)
+            return region;
+    }
+
+    return NULL;
+}
+
+static struct page*
+get_page_desc(struct pfa_region* region, void* page)
+{
+    size_t page_idx = ((uintptr_t)page - (uintptr_t)region->start) / PAGE_SIZE;
+    return &region->pages[page_idx];
 }
 
 static void*
-get_buddy(struct pfa_state* state, void* page, size_t order)
+get_page_addr(struct pfa_region* region, struct page* page)
 {
-    size_t page_idx = ((uintptr_t)page - (uintptr_t)state->start) / PAGE_SIZE;
-    size_t buddy_idx = page_idx ^ (1 << order);
-    return (void*)((uintptr_t)state->start + (buddy_idx * PAGE_SIZE));
+    size_t page_idx = page - region->pages;
+    return (void*)((uintptr_t)region->start + page_idx * PAGE_SIZE);
 }
 
 static void
-free_list_add(struct pfa_state* state, void* page, size_t order)
+free_list_add(struct pfa_region* region, struct page* page, size_t order)
 {
-    *(void**)page = state->free_areas[order].free_list;
-    state->free_areas[order].free_list = page;
-    state->free_areas[order].nr_free++;
+    struct free_area* area = &region->free_areas[order];
+
+    page->prev = NULL;
+    page->next = area->free_list;
+    if (area->free_list) area->free_list->prev = page;
+    area->free_list = page;
+    area->nr_free++;
+
+    page->owner = NULL;
+    page->refcount = 0;
+    page->order = order;
+    page->flags = PAGE_FLAG_FREE;
 }
 
-static void*
-free_list_remove(struct pfa_state* state, size_t order)
+static void
+free_list_del(struct pfa_region* region, struct page* page, size_t order)
 {
-    void* page = state->free_areas[order].free_list;
+    struct free_area* area = &region->free_areas[order];
+
+    if (page->prev)
+        page->prev->next = page->next;
+    else
+        area->free_list = page->next;
+
+    if (page->next) page->next->prev = page->prev;
+
+    page->next = NULL;
+    page->prev = NULL;
+    page->flags = 0;
+    area->nr_free--;
+}
+
+static struct page*
+free_list_remove(struct pfa_region* region, size_t order)
+{
+    struct page* page = region->free_areas[order].free_list;
     if (page) {
-        state->free_areas[order].free_list = *(void**)page;
-        state->free_areas[order].nr_free--;
+        free_list_del(region, page, order);
     }
     return page;
 }
 
+
 size_t
 get_order(size_t num_pages)
 {
@@ -157,3 +454,167 @@ get_order(size_t num_pages)
 
     return order;
 }
+
+#ifdef TEST
+
+#define PFA_TEST_ITERATIONS 4096
+
+/*
+    Runs a private allocator over a block of pool_num_pages, fragments it so
+    that every other page is free, then times free/alloc pairs. Each free
+    has to look up a buddy on an order 0 free list holding half the pool.
+*/
+static void
+pfa_test_fragmented(size_t pool_num_pages)
+{
+    static struct pfa_state state;
+    void* pool = alloc_pages(pool_num_pages);
+    pfa_init(&state);
+    pfa_add_region(&state, pool, pool_num_pages);
+
+    struct pfa_region* region = &state.regions[0];
+    size_t num_pages = region->num_pages;
+    void** pages = alloc_pages(CEIL_DIV(num_pages * sizeof(void*), PAGE_SIZE));
+
+    for (size_t i = 0; i < num_pages; ++i) {
+        pages[i] = pfa_alloc_pages(&state, 1);
+    }
+
+    for (size_t i = 0; i < num_pages; ++i) {
+        if ((i & 1) == 0) pfa_free_pages(&state, pages[i], 1);
+    }
+
+    if (region->free_areas[0].nr_free != CEIL_DIV(num_pages, 2))
+        panic("pfa_test: pool should be fully fragmented\n");
+
+    uint64_t start = rdtsc();
+    for (size_t n = 0; n < PFA_TEST_ITERATIONS; ++n) {
+        size_t i = (2 * n + 1) % (num_pages & ~(size_t)1);
+        pfa_free_pages(&state, pages[i], 1);
+        pages[i] = pfa_alloc_pages(&state, 1);
+    }
+    uint64_t cycles = rdtsc() - start;
+
+    kprintf("pfa_test: %lld free pages at order 0, %lld cycles per "
+            "free/alloc pair\n",
+            (uint64_t)region->free_areas[0].nr_free,
+            cycles / PFA_TEST_ITERATIONS);
+
+    free_pages(pages, CEIL_DIV(num_pages * sizeof(void*), PAGE_SIZE));
+    free_pages(pool, pool_num_pages);
+}
+
+static void
+pfa_test_coalesce(void)
+{
+    static struct pfa_state state;
+    size_t pool_num_pages = 1 << MAX_ORDER;
+    void* pool = alloc_pages(pool_num_pages);
+    pfa_init(&state);
+    pfa_add_region(&state, pool, pool_num_pages);
+
+    struct pfa_region* region = &state.regions[0];
+    size_t num_pages = region->num_pages;
+    size_t nr_free[MAX_ORDER + 1];
+    for (size_t i = 0; i <= MAX_ORDER; ++i)
+        nr_free[i] = region->free_areas[i].nr_free;
+
+    void** pages = alloc_pages(CEIL_DIV(num_pages * sizeof(void*), PAGE_SIZE));
+    for (size_t i = 0; i < num_pages; ++i) {
+        pages[i] = pfa_alloc_pages(&state, 1);
+    }
+
+    for (size_t i = 0; i <= MAX_ORDER; ++i) {
+        if (region->free_areas[i].nr_free != 0)
+            panic("pfa_test: pool should be exhausted\n");
+    }
+
+    for (size_t i = 0; i < num_pages; ++i) {
+        pfa_free_pages(&state, pages[i], 1);
+    }
+
+    for (size_t i = 0; i <= MAX_ORDER; ++i) {
+        if (region->free_areas[i].nr_free != nr_free[i])
+            panic("pfa_test: pool should coalesce back to its initial state\n");
+    }
+
+    free_pages(pages, CEIL_DIV(num_pages * sizeof(void*), PAGE_SIZE));
+    free_pages(pool, pool_num_pages);
+}
+
+static size_t
+pfa_test_free_pages(struct pfa_region* region)
+{
+    size_t num_pages = 0;
+    for (size_t i = 0; i <= MAX_ORDER; ++i)
+        num_pages += region->free_areas[i].nr_free << i;
+    return num_pages;
+}
+
+/*
+    Allocates one block of each size 2^k + 1, the worst case for rounding up,
+    and compares the pages taken from the pool with what power-of-two blocks
+    would have cost.
+*/
+static void
+pfa_test_exact(void)
+{
+    static struct pfa_state state;
+    size_t pool_num_pages = 1 << MAX_ORDER;
+    void* pool = alloc_pages(pool_num_pages);
+    pfa_init(&state);
+    pfa_add_region(&state, pool, pool_num_pages);
+
+    struct pfa_region* region = &state.regions[0];
+    size_t nr_free[MAX_ORDER + 1];
+    for (size_t i = 0; i <= MAX_ORDER; ++i)
+        nr_free[i] = region->free_areas[i].nr_free;
+
+    size_t initial_free = pfa_test_free_pages(region);
+    size_t requested = 0;
+    size_t rounded = 0;
+    void* blocks[MAX_ORDER - 1];
+
+    // Largest first, rounded up they would not all fit in the pool.
+    for (size_t i = MAX_ORDER - 1; i-- > 0;) {
+        size_t num_pages = ((size_t)1 << i) + 1;
+        blocks[i] = pfa_alloc_pages_exact(&state, num_pages);
+        requested += num_pages;
+        rounded += (size_t)1 << get_order(num_pages);
+    }
+
+    size_t used = initial_free - pfa_test_free_pages(region);
+    if (used != requested)
+        panic("pfa_test: exact allocations took %lld pages for %lld\n",
+              (uint64_t)used, (uint64_t)requested);
+
+    for (size_t i = 0; i < MAX_ORDER - 1; ++i) {
+        pfa_free_pages_exact(&state, blocks[i], ((size_t)1 << i) + 1);
+    }
+
+    for (size_t i = 0; i <= MAX_ORDER; ++i) {
+        if (region->free_areas[i].nr_free != nr_free[i])
+            panic("pfa_test: pool should coalesce back to its initial state\n");
+    }
+
+    kprintf("pfa_test: exact-size allocations used %lld pages, power-of-two "
+            "blocks would use %lld\n",
+            (uint64_t)used, (uint64_t)rounded);
+
+    free_pages(pool, pool_num_pages);
+}
+
+void
+pfa_test(void)
+{
+    kprintf("pfa_test\n");
+
+    pfa_test_coalesce();
+    pfa_test_exact();
+
+    for (size_t order = 6; order <= MAX_ORDER; order += 2) {
+        pfa_test_fragmented(1 << order);
+    }
+}
+
+#endif
@@ -0,0 +1,299 @@
+#include <kernel/mm/vmalloc.h>
+#include <kernel/mm/mm.h>
+#include <kernel/mm/pfa.h>
+#include <kernel/mm/slab.h>
+#include <kernel/cpu/paging.h>
+#include <kernel/libk/io.h>
+#include <kernel/libk/math.h>
+
+// Forward declarations
+static struct vmap_area* vmap_alloc_area(size_t num_pages,
+                                         unsigned int flags);
+static void vmap_free_area(struct vmap_area* area);
+static void vmap_unmap(struct vmap_area* area, size_t num_pages);
+static struct vmap_area* vmap_area_of(void* ptr);
+
+static struct slab_cache* vmap_area_cache;
+static struct list vmap_free; // Unordered, adjacent ranges are merged
+static struct vmalloc_stats vmalloc_stats;
+
+void
+vmalloc_init(void)
+{
+    kprintf("[START] Initialize vmalloc\n");
+
+    vmap_area_cache =
+        kmem_cache_create("vmap_area", sizeof(struct vmap_area),
+                          _Alignof(struct vmap_area), NULL, NULL);
+    list_init(&vmap_free);
+
+    struct vmap_area* area = kmem_cache_alloc(vmap_area_cache);
+    area->start = VMALLOC_BASE;
+    area->num_pages = (VMALLOC_END - VMALLOC_BASE) / PAGE_SIZE;
+    list_push(&vmap_free, &area->link);
+    vmalloc_stats.num_ranges = 1;
+
+    kprintf("[DONE ] Initialize vmalloc\n");
+}
+
+/*
+    vmalloc needs the kernel's own page tables, until they are loaded large
+    allocations are physically contiguous.
+*/
+bool
+vmalloc_initialized(void)
+{
+    return vmap_area_cache != NULL;
+}
+
+void*
+vmalloc_flags(size_t size, unsigned int flags)
+{
+    if (size == 0) panic("size must not be 0");
+    if (!vmalloc_initialized()) panic("vmalloc is not initialized");
+
+    size_t num_pages = CEIL_DIV(size, PAGE_SIZE);
+    struct vmap_area* area = vmap_alloc_area(num_pages + 1, flags);
+    if (!area) {
+        if (flags & ALLOC_MAY_FAIL) return NULL;
+        panic("vmalloc: out of address space for %lld pages\n",
+              (uint64_t)num_pages);
+    }
+
+    for (size_t i = 0; i < num_pages; ++i) {
+        void* frame = alloc_pages_flags(1, flags & ~ALLOC_EXACT);
+        if (!frame) {
+            vmap_unmap(area, i);
+            vmap_free_area(area);
+            return NULL;
+        }
+
+        struct page* page = virt_to_page(frame);
+        page->flags |= PAGE_FLAG_VMALLOC;
+        if (i == 0) page->owner = area;
+
+        map_page_kernel_data(vaddr_to_paddr(frame),
+                             (void*)(area->start + i * PAGE_SIZE));
+    }
+
+    ++vmalloc_stats.allocs;
+    ++vmalloc_stats.num_areas;
+    vmalloc_stats.num_pages += num_pages;
+    return (void*)area->start;
+}
+
+void*
+vmalloc(size_t size)
+{
+    return vmalloc_flags(size, ALLOC_KERNEL);
+}
+
+void
+vfree(void* ptr)
+{
+    if (!ptr) panic("ptr must not be NULL");
+
+    struct vmap_area* area = vmap_area_of(ptr);
+    if (!area) panic("vfree: invalid pointer 0x%llX\n", (uint64_t)ptr);
+
+    size_t num_pages = area->num_pages - 1;
+    vmap_unmap(area, num_pages);
+    vmap_free_area(area);
+
+    ++vmalloc_stats.frees;
+    --vmalloc_stats.num_areas;
+    vmalloc_stats.num_pages -= num_pages;
+}
+
+/*
+    First fit over the free ranges, splitting the range found. Fragmentation
+    of a 32 TiB range is not a concern, the list stays short.
+*/
+static struct vmap_area*
+vmap_alloc_area(size_t num_pages, unsigned int flags)
+{
+    list_foreach(&vmap_free, node)
+    {
+        struct vmap_area* range = container_of(node, struct vmap_area, link);
+        if (range->num_pages < num_pages) continue;
+
+        if (range->num_pages == num_pages) {
+            list_remove(&vmap_free, &range->link);
+            --vmalloc_stats.num_ranges;
+            return range;
+        }
+
+        struct vmap_area* area =
+            kmem_cache_alloc_flags(vmap_area_cache, flags);
+        if (!area) return NULL;
+
+        area->start = range->start;
+        area->num_pages = num_pages;
+        range->start += num_pages * PAGE_SIZE;
+        range->num_pages -= num_pages;
+        return area;
+    }
+
+    return NULL;
+}
+
+static void
+vmap_free_area(struct vmap_area* area)
+{
+    list_foreach_safe(&vmap_free, node, tmp)
+    {
+        struct vmap_area* range = container_of(node, struct vmap_area, link);
+
+        if (range->start + range->num_pages * PAGE_SIZE == area->start) {
+            area->start = range->start;
+        } else if (area->start + area->num_pages * PAGE_SIZE != range->start) {
+            continue;
+        }
+
+        area->num_pages += range->num_pages;
+        list_remove(&vmap_free, &range->link);
+        kmem_cache_free(vmap_area_cache, range);
+        --vmalloc_stats.num_ranges;
+    }
+
+    list_push(&vmap_free, &area->link);
+    ++vmalloc_stats.num_ranges;
+}
+
+// Unmaps and frees the first num_pages frames of area.
+static void
+vmap_unmap(struct vmap_area* area, size_t num_pages)
+{
+    for (size_t i = 0; i < num_pages; ++i) {
+        void* frame =
+            paddr_to_vaddr(unmap_page((void*)(area->start + i * PAGE_SIZE)));
+
+        struct page* page = virt_to_page(frame);
+        page->flags &= ~PAGE_FLAG_VMALLOC;
+        page->owner = NULL;
+        free_pages(frame, 1);
+    }
+}
+
+static struct vmap_area*
+vmap_area_of(void* ptr)
+{
+    if (!is_vmalloc_addr(ptr) || !PAGE_ALIGNED(ptr)) return NULL;
+
+    void* paddr = lookup_paddr(ptr);
+    if (!paddr) return NULL;
+
+    struct page* page = virt_to_page(paddr_to_vaddr(paddr));
+    if (!page || !(page->flags & PAGE_FLAG_VMALLOC)) return NULL;
+
+    struct vmap_area* area = page->owner;
+    if (!area || area->start != (uintptr_t)ptr) return NULL;
+
+    return area;
+}
+
+void
+vmalloc_dump_stats(struct kbuf* out)
+{
+    kbprintf(out,
+             "vmalloc: %lld areas mapping %lld pages, %lld free ranges, "
+             "%lld allocs, %lld frees\n",
+             (uint64_t)vmalloc_stats.num_areas,
+             (uint64_t)vmalloc_stats.num_pages,
+             (uint64_t)vmalloc_stats.num_ranges, vmalloc_stats.allocs,
+             vmalloc_stats.frees);
+}
+
+#ifdef TEST
+
+#define VMALLOC_TEST_ITERATIONS 16
+
+static void
+vmalloc_test_area(void)
+{
+    size_t num_ranges = vmalloc_stats.num_ranges;
+    size_t size = 3 * PAGE_SIZE + 1;
+    size_t num_pages = CEIL_DIV(size, PAGE_SIZE);
+
+    uint8_t* ptr = vmalloc_flags(size, ALLOC_KERNEL | ALLOC_ZERO);
+    if (!is_vmalloc_addr(ptr) || !PAGE_ALIGNED(ptr))
+        panic("vmalloc_test: 0x%llX is not a page aligned vmalloc address\n",
+              (uint64_t)ptr);
+
+    for (size_t i = 0; i < num_pages * PAGE_SIZE; ++i) {
+        if (ptr[i] != 0) panic("vmalloc_test: memory is not zeroed\n");
+        ptr[i] = i;
+    }
+
+    for (size_t i = 0; i < num_pages * PAGE_SIZE; ++i) {
+        if (ptr[i] != (uint8_t)i) panic("vmalloc_test: pages overlap\n");
+    }
+
+    if (lookup_paddr(ptr + num_pages * PAGE_SIZE))
+        panic("vmalloc_test: guard page is mapped\n");
+
+    // kfree of any vmalloc address goes to vfree
+    kfree(ptr);
+
+    if (lookup_paddr(ptr)) panic("vmalloc_test: freed page is still mapped\n");
+    if (vmalloc_stats.num_ranges != num_ranges)
+        panic("vmalloc_test: freed area was not merged back\n");
+
+    void* large = kmalloc(64 * 1024);
+    if (!is_vmalloc_addr(large))
+        panic("vmalloc_test: large kmalloc should use vmalloc\n");
+    kfree(large);
+}
+
+/*
+    Times allocating and freeing zeroed memory through vmalloc and as one
+    exact-size physically contiguous block, the previous large kmalloc path.
+*/
+static void
+vmalloc_test_bench(size_t size)
+{
+    size_t num_pages = size / PAGE_SIZE;
+    uint64_t vmalloc_alloc = 0, vmalloc_free = 0;
+    uint64_t contig_alloc = 0, contig_free = 0;
+
+    for (size_t n = 0; n < VMALLOC_TEST_ITERATIONS; ++n) {
+        uint64_t start = rdtsc();
+        void* ptr = vmalloc_flags(size, ALLOC_KERNEL | ALLOC_ZERO);
+        uint64_t mid = rdtsc();
+        vfree(ptr);
+        uint64_t end = rdtsc();
+        vmalloc_alloc += mid - start;
+        vmalloc_free += end - mid;
+
+        start = rdtsc();
+        ptr = alloc_pages_flags(num_pages,
+                                ALLOC_KERNEL | ALLOC_ZERO | ALLOC_EXACT);
+        mid = rdtsc();
+        free_pages(ptr, num_pages);
+        end = rdtsc();
+        contig_alloc += mid - start;
+        contig_free += end - mid;
+    }
+
+    kprintf("vmalloc_test: %lld KiB, vmalloc %lld + %lld cycles, contiguous "
+            "%lld + %lld cycles per alloc + free\n",
+            (uint64_t)(size / 1024), vmalloc_alloc / VMALLOC_TEST_ITERATIONS,
+            vmalloc_free / VMALLOC_TEST_ITERATIONS,
+            contig_alloc / VMALLOC_TEST_ITERATIONS,
+            contig_free / VMALLOC_TEST_ITERATIONS);
+}
+
+void
+vmalloc_test(void)
+{
+    kprintf("vmalloc_test\n");
+
+    vmalloc_test_area();
+
+    for (size_t size = 64 * 1024; size <= 4 * 1024 * 1024; size *= 4)
+        vmalloc_test_bench(size);
+
+    vmalloc_dump_stats(NULL);
+}
+
+#endif
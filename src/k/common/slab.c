@@ -8,30 +8,88 @@
 #include <kernel/boot/header.h>
 #include <kernel/cpu/paging.h>
 #include <kernel/mm/pfa.h>
+#include <kernel/mm/vmalloc.h>
 #include <kernel/libk/math.h>
 
 // Forward declarations
-static struct slab_header* slab_create(size_t object_size);
+static void slab_cache_init(struct slab_cache* cache, const char* name,
+                            size_t size, size_t align, void (*ctor)(void*),
+                            void (*dtor)(void*));
+static void slab_cache_size_slabs(struct slab_cache* cache);
+static void slab_cache_dump_stats(const struct slab_cache* cache,
+                                  struct kbuf* out);
+static void* slab_cache_alloc(struct slab_cache* cache, unsigned int flags);
+static void slab_cache_free(struct slab_cache* cache, void* obj);
+static void slab_cache_drain(struct slab_cache* cache);
+static size_t slab_cache_release_empty(struct slab_cache* cache,
+                                       size_t num_slabs);
+static struct slab_header* slab_cache_get_slab(struct slab_cache* cache,
+                                               unsigned int flags);
+static struct slab_cpu_cache* slab_cpu(struct slab_cache* cache);
+static void* slab_magazine_alloc(struct slab_cache* cache);
+static bool slab_magazine_free(struct slab_cache* cache, void* obj);
+static void slab_magazine_flush(struct slab_magazine* mag);
+static void slab_depot_put_full(struct slab_cache* cache,
+                                struct slab_magazine* mag);
+static void slab_depot_put_empty(struct slab_cache* cache,
+                                 struct slab_magazine* mag);
+static struct slab_header* slab_create(struct slab_cache* cache,
+                                       unsigned int flags);
+static size_t slab_destroy(struct slab_header* slab);
+static void* slab_pop(struct slab_header* slab);
+static void slab_push(struct slab_header* slab, void* obj);
+static void slab_update_list(struct slab_header* slab, size_t old_used);
+static void slab_list_init(struct slab_list* list);
+static void slab_list_push(struct slab_list* list, struct slab_header* slab);
+static void slab_list_remove(struct slab_list* list, struct slab_header* slab);
+static struct slab_header* slab_list_head(struct slab_list* list);
+static struct slab_header* slab_of(void* ptr);
+static void* slab_kmalloc_large(size_t size, unsigned int flags);
+static void slab_kfree_large(void* ptr);
 static size_t slab_get_cache_index(size_t size);
 
+/*
+    kmalloc size classes. The intermediate classes halve the worst case
+    internal fragmentation of power of two classes between 16 and 512 bytes,
+    where most kernel objects and path names fall.
+*/
+static const size_t slab_class_sizes[SLAB_SIZE_CLASSES] = {
+    16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 1024, 2048, 4096, 8192,
+};
+
+// Magazines and off-slab headers come from their own caches, which have no
+// magazine layer.
+static struct slab_cache slab_magazine_cache;
+static struct slab_cache slab_header_cache;
+
 void
 slab_init(struct slab_state* state)
 {
     kprintf("[START] Initialize Slab Allocator\n");
 
-    size_t current_size = SLAB_MIN_SIZE;
+    if (!slab_magazine_cache.size) {
+        slab_cache_init(&slab_magazine_cache, "slab_magazine",
+                        sizeof(struct slab_magazine),
+                        _Alignof(struct slab_magazine), NULL, NULL);
+        slab_magazine_cache.magazines = false;
+        slab_cache_init(&slab_header_cache, "slab_header",
+                        sizeof(struct slab_header),
+                        _Alignof(struct slab_header), NULL, NULL);
+        slab_header_cache.magazines = false;
+    }
 
+    // Objects are aligned to the largest power of two dividing their size.
     for (int i = 0; i < SLAB_SIZE_CLASSES; ++i) {
-        state->slab_caches[i].size = current_size;
-        state->slab_caches[i].slabs = NULL;
-        current_size *= 2;
+        size_t size = slab_class_sizes[i];
+        slab_cache_init(&state->slab_caches[i], "kmalloc", size,
+                        MIN(size & -size, PAGE_SIZE), NULL, NULL);
     }
 
     kprintf("[DONE ] Initialize Slab Allocator\n");
 }
 
 void*
-slab_kmalloc(struct slab_state* state, size_t size)
+slab_kmalloc(struct slab_state* state, size_t size, unsigned int flags)
 {
     if (size == 0) panic("size must not be 0");
 
@@ -40,124 +98,1039 @@ slab_kmalloc(struct slab_state* state, size_t size)
     }
 
     size_t cache_index = slab_get_cache_index(size);
+    if (cache_index == SIZE_MAX) return slab_kmalloc_large(size, flags);
 
-    if (cache_index == SIZE_MAX) {
-        size_t total_size = size + sizeof(size_t);
-        size_t total_num_pages = CEIL_DIV(total_size, PAGE_SIZE);
-        void* ptr = alloc_pagez(total_num_pages);
-        if (!ptr) panic("out of memory");
+    struct slab_cache* cache = &state->slab_caches[cache_index];
+    slab_cpu(cache)->requested_bytes += size;
+    return slab_cache_alloc(cache, flags);
+}
+
+void
+slab_kfree(void* ptr)
+{
+    if (!ptr) panic("ptr must not be NULL");
+
+    struct slab_header* slab = slab_of(ptr);
+    if (!slab) {
+        slab_kfree_large(ptr);
+        return;
+    }
+
+    slab_cache_free(slab->cache, ptr);
+}
+
+size_t
+slab_kmalloc_bulk(struct slab_state* state, size_t size, unsigned int flags,
+                  size_t count, void** ptrs)
+{
+    if (size == 0) panic("size must not be 0");
+
+    if (size < sizeof(void*)) {
+        size = sizeof(void*);
+    }
+
+    size_t cache_index = slab_get_cache_index(size);
+    size_t i = 0;
 
-        *(size_t*)ptr = total_num_pages;
+    if (cache_index == SIZE_MAX) {
+        for (; i < count; ++i) {
+            ptrs[i] = slab_kmalloc_large(size, flags);
+            if (!ptrs[i]) goto fail;
+        }
 
-        return (void*)((char*)ptr + sizeof(size_t));
+        return count;
     }
 
+    // Fill from one slab at a time, updating its list once per slab.
     struct slab_cache* cache = &state->slab_caches[cache_index];
-    struct slab_header* slab = cache->slabs;
+    while (i < count) {
+        struct slab_header* slab = slab_cache_get_slab(cache, flags);
+        if (!slab) goto fail;
 
-    while (slab && slab->used >= slab->capacity) {
-        slab = slab->next;
+        size_t old_used = slab->used;
+        while (i < count && slab->used < slab->capacity) {
+            ptrs[i] = slab_pop(slab);
+            memset(ptrs[i++], 0, cache->object_size);
+        }
+        slab_update_list(slab, old_used);
     }
 
-    if (!slab) {
-        slab = slab_create(cache->size);
-        if (!slab) panic("out of memory");
+    return count;
+
+fail:
+    slab_kfree_bulk(i, ptrs);
+    return 0;
+}
+
+// Named caches, for statistics
+static struct list kmem_caches;
+
+void
+slab_kfree_bulk(size_t count, void** ptrs)
+{
+    size_t i = 0;
+
+    while (i < count) {
+        if (!ptrs[i]) panic("ptr must not be NULL");
+
+        struct slab_header* slab = slab_of(ptrs[i]);
+        if (!slab) {
+            slab_kfree_large(ptrs[i++]);
+            continue;
+        }
+
+        // Objects from the same slab are usually adjacent in the array.
+        size_t old_used = slab->used;
+        do {
+            slab_push(slab, ptrs[i++]);
+        } while (i < count && ptrs[i] && slab_of(ptrs[i]) == slab);
+        slab_update_list(slab, old_used);
+    }
+}
+
+void
+slab_drain(struct slab_state* state)
+{
+    for (int i = 0; i < SLAB_SIZE_CLASSES; ++i) {
+        slab_cache_drain(&state->slab_caches[i]);
+    }
+
+    list_foreach(&kmem_caches, node)
+    {
+        slab_cache_drain(container_of(node, struct slab_cache, link));
+    }
+}
+
+size_t
+slab_reap(struct slab_state* state)
+{
+    size_t num_freed = 0;
+
+    for (int i = 0; i < SLAB_SIZE_CLASSES; ++i) {
+        struct slab_cache* cache = &state->slab_caches[i];
+        num_freed += slab_cache_release_empty(cache, cache->empty_min);
+        cache->empty_min = cache->empty.num_slabs;
+    }
+
+    list_foreach(&kmem_caches, node)
+    {
+        struct slab_cache* cache = container_of(node, struct slab_cache, link);
+        num_freed += slab_cache_release_empty(cache, cache->empty_min);
+        cache->empty_min = cache->empty.num_slabs;
+    }
+
+    return num_freed;
+}
+
+size_t
+slab_shrink(struct slab_state* state, size_t num_pages)
+{
+    size_t num_freed = 0;
+
+    for (int i = 0; i < SLAB_SIZE_CLASSES && num_freed < num_pages; ++i) {
+        struct slab_cache* cache = &state->slab_caches[i];
+        slab_cache_drain(cache);
+        num_freed += slab_cache_release_empty(cache, SIZE_MAX);
+    }
+
+    list_foreach(&kmem_caches, node)
+    {
+        if (num_freed >= num_pages) break;
+
+        struct slab_cache* cache = container_of(node, struct slab_cache, link);
+        slab_cache_drain(cache);
+        num_freed += slab_cache_release_empty(cache, SIZE_MAX);
+    }
+
+    // Draining frees magazines, so their cache goes last.
+    num_freed += slab_cache_release_empty(&slab_magazine_cache, SIZE_MAX);
+    num_freed += slab_cache_release_empty(&slab_header_cache, SIZE_MAX);
+
+    return num_freed;
+}
+
+struct slab_cache*
+kmem_cache_create(const char* name, size_t size, size_t align,
+                  void (*ctor)(void* obj), void (*dtor)(void* obj))
+{
+    assert(name);
+    if (size == 0) panic("size must not be 0");
+    if (align == 0 || (align & (align - 1)) != 0 || align > PAGE_SIZE)
+        panic("invalid alignment %lld\n", (uint64_t)align);
+
+    struct slab_cache* cache = kzmalloc(sizeof(struct slab_cache));
+    slab_cache_init(cache, name, size, align, ctor, dtor);
+    list_node_init(&kmem_caches, &cache->link);
+    list_push(&kmem_caches, &cache->link);
+
+    return cache;
+}
+
+void
+kmem_cache_destroy(struct slab_cache* cache)
+{
+    assert(cache);
+    slab_cache_drain(cache);
+    if (cache->partial.num_slabs != 0 || cache->full.num_slabs != 0)
+        panic("kmem_cache_destroy: %s still has objects in use\n",
+              cache->name);
+
+    slab_cache_release_empty(cache, SIZE_MAX);
+
+    list_remove(&kmem_caches, &cache->link);
+    kfree(cache);
+}
+
+void*
+kmem_cache_alloc_flags(struct slab_cache* cache, unsigned int flags)
+{
+    assert(cache);
+
+    return slab_cache_alloc(cache, flags);
+}
+
+void*
+kmem_cache_alloc(struct slab_cache* cache)
+{
+    return kmem_cache_alloc_flags(cache, ALLOC_KERNEL);
+}
+
+void
+kmem_cache_free(struct slab_cache* cache, void* obj)
+{
+    assert(cache);
+    if (!obj) panic("obj must not be NULL");
+
+    struct slab_header* slab = slab_of(obj);
+    if (!slab || slab->cache != cache)
+        panic("kmem_cache_free: 0x%llX is not from %s\n", (uint64_t)obj,
+              cache->name);
+
+    slab_cache_free(cache, obj);
+}
+
+void
+slab_dump_stats(const struct slab_state* state, struct kbuf* out)
+{
+    for (int i = 0; i < SLAB_SIZE_CLASSES; ++i) {
+        slab_cache_dump_stats(&state->slab_caches[i], out);
+    }
+
+    list_foreach(&kmem_caches, node)
+    {
+        slab_cache_dump_stats(container_of(node, struct slab_cache, link),
+                              out);
+    }
+
+    slab_cache_dump_stats(&slab_magazine_cache, out);
+    slab_cache_dump_stats(&slab_header_cache, out);
+}
+
+/*
+    Lays out slabs of the cache: the header unless it is kept off-slab, then
+    objects at the stride rounded to the alignment. Objects with a
+    constructor keep their free list pointer past the end of the object, so
+    a free object stays constructed.
+*/
+static void
+slab_cache_init(struct slab_cache* cache, const char* name, size_t size,
+                size_t align, void (*ctor)(void*), void (*dtor)(void*))
+{
+    align = MAX(align, sizeof(void*));
+
+    cache->name = name;
+    cache->object_size = size;
+    cache->free_offset = ctor ? CEIL_DIV(size, sizeof(void*)) * sizeof(void*)
+                              : 0;
+    cache->size = CEIL_DIV(MAX(size, cache->free_offset + sizeof(void*)),
+                           align) *
+                  align;
+    cache->align = align;
+    cache->off_slab = cache->size >= SLAB_OFF_SLAB_SIZE;
+    cache->data_offset =
+        cache->off_slab ? 0
+                        : CEIL_DIV(sizeof(struct slab_header), align) * align;
+    slab_cache_size_slabs(cache);
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+    cache->magazines = true;
+    for (int i = 0; i < SLAB_NUM_CPUS; ++i) {
+        cache->cpu[i] = (struct slab_cpu_cache){0};
+    }
+    cache->depot = (struct slab_depot){0};
+    slab_list_init(&cache->partial);
+    slab_list_init(&cache->full);
+    slab_list_init(&cache->empty);
+    cache->max_empty = MAX(SLAB_RETAIN_PAGES / cache->num_pages, 1);
+    cache->empty_min = 0;
+    cache->slabs_created = 0;
+    cache->slabs_destroyed = 0;
+    cache->link.next = NULL;
+    cache->link.prev = NULL;
+}
+
+/*
+    Picks the smallest slab that holds SLAB_MIN_OBJECTS within the waste
+    bound, falling back to the slab with the least waste.
+*/
+static void
+slab_cache_size_slabs(struct slab_cache* cache)
+{
+    size_t best_num_pages = 0;
+    size_t best_waste = 0;
+
+    for (size_t num_pages = 1; num_pages <= SLAB_MAX_PAGES; ++num_pages) {
+        size_t slab_size = num_pages * PAGE_SIZE;
+        if (slab_size < cache->data_offset + cache->size) continue;
+
+        size_t capacity = (slab_size - cache->data_offset) / cache->size;
+        size_t waste = slab_size - capacity * cache->size;
+
+        if (!best_num_pages ||
+            waste * best_num_pages < best_waste * num_pages) {
+            best_num_pages = num_pages;
+            best_waste = waste;
+        }
+
+        if (capacity >= SLAB_MIN_OBJECTS &&
+            (waste << SLAB_MAX_WASTE_SHIFT) <= slab_size) {
+            best_num_pages = num_pages;
+            break;
+        }
+    }
+
+    if (!best_num_pages)
+        panic("%s: %lld byte objects do not fit in a slab\n", cache->name,
+              (uint64_t)cache->size);
+
+    cache->num_pages = best_num_pages;
+    cache->capacity =
+        (best_num_pages * PAGE_SIZE - cache->data_offset) / cache->size;
+}
+
+static void
+slab_cache_dump_stats(const struct slab_cache* cache, struct kbuf* out)
+{
+    size_t used = cache->full.num_slabs * cache->capacity;
+    size_t num_slabs = cache->partial.num_slabs + cache->full.num_slabs +
+                       cache->empty.num_slabs;
+    size_t capacity = num_slabs * cache->capacity;
+
+    list_foreach(&cache->partial.slabs, node)
+    {
+        used += container_of(node, struct slab_header, link)->used;
+    }
+
+    kbprintf(out,
+             "slab: %s %lld bytes: %lld/%lld/%lld partial/full/empty slabs, "
+             "%lld of %lld objects used, occupancy %lld%%\n",
+             cache->name, (uint64_t)cache->object_size,
+             (uint64_t)cache->partial.num_slabs,
+             (uint64_t)cache->full.num_slabs,
+             (uint64_t)cache->empty.num_slabs, (uint64_t)used,
+             (uint64_t)capacity,
+             capacity ? (uint64_t)(used * 100 / capacity) : 0);
+    kbprintf(out,
+             "slab: %s %lld bytes: %lld slabs created, %lld destroyed, up to "
+             "%lld empty kept\n",
+             cache->name, (uint64_t)cache->object_size, cache->slabs_created,
+             cache->slabs_destroyed, (uint64_t)cache->max_empty);
+    kbprintf(out,
+             "slab: %s %lld bytes: %lld pages, %lld objects per slab, "
+             "%lld bytes wasted, header %s\n",
+             cache->name, (uint64_t)cache->object_size,
+             (uint64_t)cache->num_pages, (uint64_t)cache->capacity,
+             (uint64_t)(cache->num_pages * PAGE_SIZE -
+                        cache->capacity * cache->size),
+             cache->off_slab ? "off-slab" : "on-slab");
+
+    if (!cache->magazines) return;
+
+    struct slab_cpu_cache total = {0};
+    for (int i = 0; i < SLAB_NUM_CPUS; ++i) {
+        total.alloc_hits += cache->cpu[i].alloc_hits;
+        total.alloc_misses += cache->cpu[i].alloc_misses;
+        total.free_hits += cache->cpu[i].free_hits;
+        total.free_misses += cache->cpu[i].free_misses;
+        total.requested_bytes += cache->cpu[i].requested_bytes;
+    }
+
+    uint64_t allocs = total.alloc_hits + total.alloc_misses;
+    uint64_t frees = total.free_hits + total.free_misses;
+    kbprintf(out,
+             "slab: %s %lld bytes: magazines: %lld/%lld alloc hits/misses "
+             "(%lld%%), %lld/%lld free hits/misses (%lld%%), depot %lld/%lld "
+             "full/empty\n",
+             cache->name, (uint64_t)cache->object_size, total.alloc_hits,
+             total.alloc_misses,
+             allocs ? total.alloc_hits * 100 / allocs : 0, total.free_hits,
+             total.free_misses, frees ? total.free_hits * 100 / frees : 0,
+             (uint64_t)cache->depot.num_full,
+             (uint64_t)cache->depot.num_empty);
+
+    // Only kmalloc records requested sizes, named caches are exact.
+    if (total.requested_bytes && allocs)
+        kbprintf(out, "slab: %s %lld bytes: average request %lld bytes\n",
+                 cache->name, (uint64_t)cache->object_size,
+                 total.requested_bytes / allocs);
+}
+
+static void*
+slab_cache_alloc(struct slab_cache* cache, unsigned int flags)
+{
+    void* obj = cache->magazines ? slab_magazine_alloc(cache) : NULL;
+
+    if (!obj) {
+        struct slab_header* slab = slab_cache_get_slab(cache, flags);
+        if (!slab) return NULL;
+
+        size_t old_used = slab->used;
+        obj = slab_pop(slab);
+        slab_update_list(slab, old_used);
+    }
+
+    if (!cache->ctor) memset(obj, 0, cache->object_size);
+    return obj;
+}
+
+static void
+slab_cache_free(struct slab_cache* cache, void* obj)
+{
+    if (cache->magazines && slab_magazine_free(cache, obj)) return;
+
+    struct slab_header* slab = slab_of(obj);
+    size_t old_used = slab->used;
+    slab_push(slab, obj);
+    slab_update_list(slab, old_used);
+}
+
+static void
+slab_cache_drain(struct slab_cache* cache)
+{
+    struct slab_magazine* mag;
+
+    for (int i = 0; i < SLAB_NUM_CPUS; ++i) {
+        struct slab_cpu_cache* cpu = &cache->cpu[i];
+        struct slab_magazine* mags[] = {cpu->loaded, cpu->previous};
+
+        for (size_t j = 0; j < 2; ++j) {
+            if (!mags[j]) continue;
+            slab_magazine_flush(mags[j]);
+            slab_cache_free(&slab_magazine_cache, mags[j]);
+        }
+
+        cpu->loaded = NULL;
+        cpu->previous = NULL;
+    }
+
+    while ((mag = cache->depot.full)) {
+        cache->depot.full = mag->next;
+        --cache->depot.num_full;
+        slab_magazine_flush(mag);
+        slab_cache_free(&slab_magazine_cache, mag);
+    }
+
+    while ((mag = cache->depot.empty)) {
+        cache->depot.empty = mag->next;
+        --cache->depot.num_empty;
+        slab_cache_free(&slab_magazine_cache, mag);
+    }
+}
+
+// Frees up to num_slabs empty slabs, returning the number of pages freed.
+static size_t
+slab_cache_release_empty(struct slab_cache* cache, size_t num_slabs)
+{
+    size_t num_freed = 0;
+    struct slab_header* slab;
+
+    while (num_slabs-- > 0 && (slab = slab_list_head(&cache->empty))) {
+        slab_list_remove(&cache->empty, slab);
+        num_freed += slab_destroy(slab);
+    }
+
+    cache->empty_min = MIN(cache->empty_min, cache->empty.num_slabs);
+    return num_freed;
+}
+
+/*
+    Returns the slab the next object of the cache should come from: the head
+    of the partial list, else an empty slab, creating one if needed.
+*/
+static struct slab_header*
+slab_cache_get_slab(struct slab_cache* cache, unsigned int flags)
+{
+    struct slab_header* slab = slab_list_head(&cache->partial);
+    if (slab) return slab;
 
-        if (cache->slabs) {
-            cache->slabs->prev = slab;
-            slab->next = cache->slabs;
+    slab = slab_list_head(&cache->empty);
+    if (slab) return slab;
+
+    slab = slab_create(cache, flags);
+    if (!slab) return NULL;
+
+    slab_list_push(&cache->empty, slab);
+    return slab;
+}
+
+static struct slab_header*
+slab_create(struct slab_cache* cache, unsigned int flags)
+{
+    size_t total_num_pages = cache->num_pages;
+    void* mem = alloc_pages_flags(total_num_pages,
+                                  flags | ALLOC_ZERO | ALLOC_EXACT);
+    if (!mem) return NULL;
+
+    struct slab_header* slab = mem;
+    if (cache->off_slab) {
+        slab = slab_cache_alloc(&slab_header_cache, flags | ALLOC_ZERO);
+        if (!slab) {
+            free_pages(mem, total_num_pages);
+            return NULL;
+        }
+    }
+
+    /*
+        Every page of the slab points back at the header, so an object can be
+        freed from any of them.
+    */
+    struct page* page = virt_to_page(mem);
+    for (size_t i = 0; i < total_num_pages; ++i) {
+        page[i].flags |= PAGE_FLAG_SLAB;
+        page[i].owner = slab;
+    }
+
+    ++cache->slabs_created;
+    slab->magic = SLAB_MAGIC;
+    slab->cache = cache;
+    slab->mem = mem;
+    slab->capacity = cache->capacity;
+    slab->used = 0;
+    slab->free_list = NULL;
+    slab->link.next = NULL;
+    slab->link.prev = NULL;
+
+    // Push in reverse so objects are handed out in address order.
+    char* data = (char*)mem + cache->data_offset;
+    for (size_t i = cache->capacity; i-- > 0;) {
+        void* obj = data + i * cache->size;
+        if (cache->ctor) cache->ctor(obj);
+        *(void**)((char*)obj + cache->free_offset) = slab->free_list;
+        slab->free_list = obj;
+    }
+
+    return slab;
+}
+
+static size_t
+slab_destroy(struct slab_header* slab)
+{
+    struct slab_cache* cache = slab->cache;
+    size_t total_num_pages = cache->num_pages;
+    void* mem = slab->mem;
+
+    if (cache->dtor) {
+        char* data = (char*)mem + cache->data_offset;
+        for (size_t i = 0; i < cache->capacity; ++i) {
+            cache->dtor(data + i * cache->size);
         }
-        cache->slabs = slab;
     }
 
+    struct page* page = virt_to_page(mem);
+    for (size_t i = 0; i < total_num_pages; ++i) {
+        page[i].flags &= ~PAGE_FLAG_SLAB;
+        page[i].owner = NULL;
+    }
+
+    ++cache->slabs_destroyed;
+    slab->magic = 0;
+    if (cache->off_slab) slab_cache_free(&slab_header_cache, slab);
+    free_pages(mem, total_num_pages);
+
+    return total_num_pages;
+}
+
+static void*
+slab_pop(struct slab_header* slab)
+{
     void* obj = slab->free_list;
-    slab->free_list = *(void**)obj;
+    slab->free_list = *(void**)((char*)obj + slab->cache->free_offset);
     slab->used++;
 
-    memset(obj, 0, slab->object_size);
     return obj;
 }
 
-void
-slab_kfree(struct slab_state* state, void* ptr)
+static void
+slab_push(struct slab_header* slab, void* obj)
 {
-    if (!ptr) panic("ptr must not be NULL");
+    if (slab->magic != SLAB_MAGIC) panic("invalid slab magic number");
 
-    uintptr_t page_addr = (uintptr_t)ptr & ~(PAGE_SIZE - 1);
-    if (page_addr != (uintptr_t)ptr - sizeof(size_t)) {
-        struct slab_header* slab = (struct slab_header*)(page_addr);
-        if (slab->magic != SLAB_MAGIC) panic("invalid slab magic number");
+    *(void**)((char*)obj + slab->cache->free_offset) = slab->free_list;
+    slab->free_list = obj;
+    --slab->used;
+}
 
-        *(void**)ptr = slab->free_list;
-        slab->free_list = ptr;
-        --slab->used;
+/*
+    Moves a slab to the list matching its occupancy, after objects were taken
+    from or returned to it. Empty slabs beyond max_empty are freed.
+*/
+static void
+slab_update_list(struct slab_header* slab, size_t old_used)
+{
+    struct slab_cache* cache = slab->cache;
+    struct slab_list* lists[] = {&cache->empty, &cache->partial, &cache->full};
+    struct slab_list* from =
+        lists[(old_used != 0) + (old_used == slab->capacity)];
+    struct slab_list* to =
+        lists[(slab->used != 0) + (slab->used == slab->capacity)];
+    if (from == to) return;
 
-        if (slab->used == 0 && slab->next) {
-            if (slab->prev) {
-                slab->prev->next = slab->next;
-            } else {
-                for (int i = 0; i < SLAB_SIZE_CLASSES; ++i) {
-                    if (state->slab_caches[i].slabs == slab) {
-                        state->slab_caches[i].slabs = slab->next;
-                        break;
-                    }
-                }
+    slab_list_remove(from, slab);
+    if (from == &cache->empty)
+        cache->empty_min = MIN(cache->empty_min, cache->empty.num_slabs);
+
+    if (to == &cache->empty && cache->empty.num_slabs >= cache->max_empty) {
+        slab_destroy(slab);
+        return;
+    }
+
+    slab_list_push(to, slab);
+}
+
+/*
+    Until there is more than one CPU, every CPU is CPU 0.
+*/
+static struct slab_cpu_cache*
+slab_cpu(struct slab_cache* cache)
+{
+    return &cache->cpu[0];
+}
+
+static void*
+slab_magazine_alloc(struct slab_cache* cache)
+{
+    struct slab_cpu_cache* cpu = slab_cpu(cache);
+    struct slab_magazine* mag = cpu->loaded;
+
+    if (!mag || mag->rounds == 0) {
+        struct slab_magazine* prev = cpu->previous;
+
+        if (prev && prev->rounds > 0) {
+            cpu->previous = mag;
+            cpu->loaded = prev;
+        } else {
+            // Both are empty, trade one for a full magazine from the depot.
+            struct slab_magazine* full = cache->depot.full;
+            if (!full) {
+                ++cpu->alloc_misses;
+                return NULL;
             }
 
-            if (slab->next) {
-                slab->next->prev = slab->prev;
+            cache->depot.full = full->next;
+            --cache->depot.num_full;
+
+            if (prev) slab_depot_put_empty(cache, prev);
+            cpu->previous = mag;
+            cpu->loaded = full;
+        }
+
+        mag = cpu->loaded;
+    }
+
+    ++cpu->alloc_hits;
+    return mag->objs[--mag->rounds];
+}
+
+static bool
+slab_magazine_free(struct slab_cache* cache, void* obj)
+{
+    struct slab_cpu_cache* cpu = slab_cpu(cache);
+    struct slab_magazine* mag = cpu->loaded;
+
+    if (!mag || mag->rounds == SLAB_MAGAZINE_ROUNDS) {
+        struct slab_magazine* prev = cpu->previous;
+
+        if (prev && prev->rounds < SLAB_MAGAZINE_ROUNDS) {
+            cpu->previous = mag;
+            cpu->loaded = prev;
+        } else {
+            // Both are full, trade one for an empty magazine from the depot.
+            struct slab_magazine* empty = cache->depot.empty;
+            if (empty) {
+                cache->depot.empty = empty->next;
+                --cache->depot.num_empty;
+            } else {
+                empty = slab_cache_alloc(&slab_magazine_cache, ALLOC_MAY_FAIL);
+                if (!empty) {
+                    ++cpu->free_misses;
+                    return false;
+                }
             }
 
-            size_t total_size = sizeof(struct slab_header) +
-                                (slab->object_size * SLAB_MAX_OBJECTS);
-            size_t total_num_pages = CEIL_DIV(total_size, PAGE_SIZE);
-            free_pages(slab, total_num_pages);
+            if (prev) slab_depot_put_full(cache, prev);
+            empty->rounds = 0;
+            cpu->previous = mag;
+            cpu->loaded = empty;
         }
-    } else {
-        void* page_ptr = (void*)(page_addr);
-        size_t total_num_pages = *(size_t*)page_ptr;
-        free_pages(page_ptr, total_num_pages);
+
+        mag = cpu->loaded;
     }
+
+    ++cpu->free_hits;
+    mag->objs[mag->rounds++] = obj;
+    return true;
+}
+
+// Returns the objects of a magazine to their slabs, leaving it empty.
+static void
+slab_magazine_flush(struct slab_magazine* mag)
+{
+    while (mag->rounds) {
+        void* obj = mag->objs[--mag->rounds];
+        struct slab_header* slab = slab_of(obj);
+        size_t old_used = slab->used;
+        slab_push(slab, obj);
+        slab_update_list(slab, old_used);
+    }
+}
+
+static void
+slab_depot_put_full(struct slab_cache* cache, struct slab_magazine* mag)
+{
+    if (mag->rounds == 0 || cache->depot.num_full >= SLAB_DEPOT_MAX_FULL) {
+        slab_magazine_flush(mag);
+        slab_depot_put_empty(cache, mag);
+        return;
+    }
+
+    mag->next = cache->depot.full;
+    cache->depot.full = mag;
+    ++cache->depot.num_full;
+}
+
+static void
+slab_depot_put_empty(struct slab_cache* cache, struct slab_magazine* mag)
+{
+    if (cache->depot.num_empty >= SLAB_DEPOT_MAX_EMPTY) {
+        slab_cache_free(&slab_magazine_cache, mag);
+        return;
+    }
+
+    mag->next = cache->depot.empty;
+    cache->depot.empty = mag;
+    ++cache->depot.num_empty;
+}
+
+static void
+slab_list_init(struct slab_list* list)
+{
+    list_init(&list->slabs);
+    list->num_slabs = 0;
+}
+
+static void
+slab_list_push(struct slab_list* list, struct slab_header* slab)
+{
+    list_push(&list->slabs, &slab->link);
+    ++list->num_slabs;
+}
+
+static void
+slab_list_remove(struct slab_list* list, struct slab_header* slab)
+{
+    list_remove(&list->slabs, &slab->link);
+    --list->num_slabs;
 }
 
 static struct slab_header*
-slab_create(size_t size)
+slab_list_head(struct slab_list* list)
 {
-    size_t total_size = sizeof(struct slab_header) + (size * SLAB_MAX_OBJECTS);
-    size_t total_num_pages = CEIL_DIV(total_size, PAGE_SIZE);
-    struct slab_header* slab = alloc_pagez(total_num_pages);
-    slab->magic = SLAB_MAGIC;
-    slab->object_size = size;
-    slab->capacity = SLAB_MAX_OBJECTS;
-    slab->used = 0;
-    slab->next = NULL;
-    slab->prev = NULL;
+    if (list_empty(&list->slabs)) return NULL;
 
-    char* data = (char*)(slab + 1);
-    slab->free_list = data;
+    return container_of(list->slabs.head, struct slab_header, link);
+}
+
+static struct slab_header*
+slab_of(void* ptr)
+{
+    struct page* page = virt_to_page(PAGE_ALIGN_DOWN(ptr));
+    if (!page || !(page->flags & PAGE_FLAG_SLAB)) return NULL;
+
+    return page->owner;
+}
+
+/*
+    Allocations too big for any size class come from vmalloc, so they never
+    need a high order block. Before it is up, and in the bootloader, they get
+    their own exact-size block, whose length is recorded in the head page
+    descriptor. Both are page aligned.
+*/
+static void*
+slab_kmalloc_large(size_t size, unsigned int flags)
+{
+    if (vmalloc_initialized()) return vmalloc_flags(size, flags | ALLOC_ZERO);
 
-    for (size_t i = 0; i < SLAB_MAX_OBJECTS - 1; ++i) {
-        void** obj = (void**)(data + (i * size));
-        *obj = data + ((i + 1) * size);
+    return alloc_pages_flags(CEIL_DIV(size, PAGE_SIZE),
+                             flags | ALLOC_ZERO | ALLOC_EXACT);
+}
+
+static void
+slab_kfree_large(void* ptr)
+{
+    if (is_vmalloc_addr(ptr)) {
+        vfree(ptr);
+        return;
     }
 
-    void** last_obj = (void**)(data + ((SLAB_MAX_OBJECTS - 1) * size));
-    *last_obj = NULL;
+    struct page* page = virt_to_page(ptr);
+    if (!PAGE_ALIGNED(ptr) || !page || page->flags & PAGE_FLAGS_UNALLOCATED)
+        panic("slab_kfree: invalid pointer 0x%llX\n", (uint64_t)ptr);
 
-    return slab;
+    free_pages(ptr, page->flags & PAGE_FLAG_EXACT ? page->num_pages
+                                                  : (size_t)1 << page->order);
 }
 
 static size_t
 slab_get_cache_index(size_t size)
 {
-    size_t current_size = SLAB_MIN_SIZE;
-
     for (size_t i = 0; i < SLAB_SIZE_CLASSES; i++) {
-        if (size <= current_size) {
+        if (size <= slab_class_sizes[i]) {
             return i;
         }
-        current_size *= 2;
     }
 
     return SIZE_MAX;
 }
+
+#ifdef TEST
+
+#define SLAB_TEST_LIVE_OBJECTS  10240
+#define SLAB_TEST_MAX_LIVE_SIZE (8 * 1024 * 1024)
+#define SLAB_TEST_ITERATIONS    100000
+
+/*
+    Keeps many objects live in one size class, so most of its slabs are full,
+    then times free/alloc pairs spread over all of them.
+*/
+static void
+slab_test_class(struct slab_state* state, size_t cache_index)
+{
+    struct slab_cache* cache = &state->slab_caches[cache_index];
+    size_t num_objects =
+        MIN(SLAB_TEST_LIVE_OBJECTS, SLAB_TEST_MAX_LIVE_SIZE / cache->size);
+    size_t objects_num_pages =
+        CEIL_DIV(num_objects * sizeof(void*), PAGE_SIZE);
+    void** objects = alloc_pages(objects_num_pages);
+
+    size_t slab_size = cache->num_pages * PAGE_SIZE;
+    size_t waste = slab_size - cache->capacity * cache->size;
+    if (waste << SLAB_MAX_WASTE_SHIFT > slab_size)
+        panic("slab_test: %lld byte slabs waste %lld bytes\n",
+              (uint64_t)cache->size, (uint64_t)waste);
+
+    for (size_t i = 0; i < num_objects; ++i) {
+        objects[i] = slab_kmalloc(state, cache->size, ALLOC_KERNEL);
+        if ((uintptr_t)objects[i] & (cache->align - 1))
+            panic("slab_test: %lld byte object is misaligned\n",
+                  (uint64_t)cache->size);
+        *(size_t*)objects[i] = i;
+    }
+
+    if (cache->partial.num_slabs > 1)
+        panic("slab_test: only the newest slab should be partial\n");
+
+    uint64_t start = rdtsc();
+    for (size_t n = 0; n < SLAB_TEST_ITERATIONS; ++n) {
+        size_t i = (n * 7919) % num_objects;
+        slab_kfree(objects[i]);
+        objects[i] = slab_kmalloc(state, cache->size, ALLOC_KERNEL);
+        *(size_t*)objects[i] = i;
+    }
+    uint64_t cycles = rdtsc() - start;
+
+    kprintf("slab_test: %lld bytes, %lld pages and %lld objects per slab, "
+            "%lld live objects in %lld slabs, %lld cycles per free/alloc "
+            "pair, %lld magazine hits\n",
+            (uint64_t)cache->size, (uint64_t)cache->num_pages,
+            (uint64_t)cache->capacity, (uint64_t)num_objects,
+            (uint64_t)(cache->partial.num_slabs + cache->full.num_slabs),
+            cycles / SLAB_TEST_ITERATIONS, cache->cpu[0].alloc_hits);
+
+    for (size_t i = 0; i < num_objects; ++i) {
+        if (*(size_t*)objects[i] != i)
+            panic("slab_test: object %lld was overwritten\n", (uint64_t)i);
+        slab_kfree(objects[i]);
+    }
+
+    if (cache->depot.num_full > SLAB_DEPOT_MAX_FULL)
+        panic("slab_test: depot holds too many full magazines\n");
+
+    slab_drain(state);
+
+    if (cache->partial.num_slabs != 0 || cache->full.num_slabs != 0)
+        panic("slab_test: all slabs should be empty\n");
+    if (cache->empty.num_slabs > cache->max_empty)
+        panic("slab_test: too many empty slabs retained\n");
+
+    free_pages(objects, objects_num_pages);
+}
+
+/*
+    A bulk allocation spanning several slabs must come back whole, and a bulk
+    free of it must leave the cache empty again.
+*/
+static void
+slab_test_bulk(struct slab_state* state)
+{
+    struct slab_cache* cache = &state->slab_caches[0];
+    size_t count = 3 * cache->capacity + 1;
+    size_t ptrs_num_pages = CEIL_DIV(count * sizeof(void*), PAGE_SIZE);
+    void** ptrs = alloc_pages(ptrs_num_pages);
+
+    if (slab_kmalloc_bulk(state, cache->size, ALLOC_KERNEL, count, ptrs) !=
+        count)
+        panic("slab_test: bulk allocation failed\n");
+
+    if (cache->full.num_slabs != 3 || cache->partial.num_slabs != 1)
+        panic("slab_test: bulk allocation should fill 3 slabs\n");
+
+    for (size_t i = 0; i < count; ++i) {
+        if (*(size_t*)ptrs[i] != 0)
+            panic("slab_test: bulk object %lld is not zeroed\n", (uint64_t)i);
+        *(size_t*)ptrs[i] = i + 1;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        if (*(size_t*)ptrs[i] != i + 1)
+            panic("slab_test: bulk objects overlap\n");
+    }
+
+    slab_kfree_bulk(count, ptrs);
+
+    if (cache->partial.num_slabs != 0 || cache->full.num_slabs != 0)
+        panic("slab_test: bulk free should empty the cache\n");
+
+    free_pages(ptrs, ptrs_num_pages);
+}
+
+struct slab_test_object {
+    uint64_t magic;
+    uint32_t value;
+};
+
+static size_t slab_test_num_constructed;
+
+static void
+slab_test_ctor(void* obj)
+{
+    ((struct slab_test_object*)obj)->magic = SLAB_MAGIC;
+    ++slab_test_num_constructed;
+}
+
+static void
+slab_test_dtor(void* obj)
+{
+    if (((struct slab_test_object*)obj)->magic != SLAB_MAGIC)
+        panic("slab_test: object freed unconstructed\n");
+    --slab_test_num_constructed;
+}
+
+/*
+    Objects of a named cache are laid out at their exact size, keep their
+    constructed state across free and allocation, and are destroyed with
+    their slab.
+*/
+static void
+slab_test_kmem_cache(void)
+{
+    struct slab_cache* cache = kmem_cache_create(
+        "slab_test", sizeof(struct slab_test_object), 4, slab_test_ctor,
+        slab_test_dtor);
+    if (cache->size != 24)
+        panic("slab_test: stride should be 24, got %lld\n",
+              (uint64_t)cache->size);
+
+    struct slab_test_object* obj = kmem_cache_alloc(cache);
+    if (slab_test_num_constructed != cache->capacity)
+        panic("slab_test: constructor should run once per object\n");
+
+    obj->value = 42;
+    kmem_cache_free(cache, obj);
+    obj = kmem_cache_alloc(cache);
+    if (obj->magic != SLAB_MAGIC || obj->value != 42)
+        panic("slab_test: object lost its constructed state\n");
+    kmem_cache_free(cache, obj);
+
+    kmem_cache_destroy(cache);
+    if (slab_test_num_constructed != 0)
+        panic("slab_test: destructor should run once per object\n");
+}
+
+/*
+    Filling and emptying one slab over and over must reuse it, the reaper
+    must only release empty slabs left unused for a whole interval, and
+    shrinking must release every empty slab.
+*/
+static void
+slab_test_retention(struct slab_state* state)
+{
+    struct slab_cache* cache = &state->slab_caches[0];
+    size_t count = (cache->max_empty + 2) * cache->capacity;
+    size_t ptrs_num_pages = CEIL_DIV(count * sizeof(void*), PAGE_SIZE);
+    void** ptrs = alloc_pages(ptrs_num_pages);
+
+    slab_shrink(state, SIZE_MAX);
+    uint64_t created = cache->slabs_created;
+    uint64_t destroyed = cache->slabs_destroyed;
+
+    for (size_t i = 0; i < 100; ++i) {
+        slab_kmalloc_bulk(state, cache->size, ALLOC_KERNEL, cache->capacity,
+                          ptrs);
+        slab_kfree_bulk(cache->capacity, ptrs);
+    }
+
+    if (cache->slabs_created != created + 1 ||
+        cache->slabs_destroyed != destroyed)
+        panic("slab_test: refilling one slab should not create slabs\n");
+
+    if (slab_reap(state) != 0)
+        panic("slab_test: reap should keep a slab used since the last reap\n");
+    if (slab_reap(state) != cache->num_pages)
+        panic("slab_test: reap should release an idle empty slab\n");
+
+    slab_kmalloc_bulk(state, cache->size, ALLOC_KERNEL, count, ptrs);
+    slab_kfree_bulk(count, ptrs);
+
+    if (cache->empty.num_slabs != cache->max_empty)
+        panic("slab_test: empty slabs should be capped at %lld\n",
+              (uint64_t)cache->max_empty);
+
+    kprintf("slab_test: %lld slabs created, %lld destroyed, %lld kept\n",
+            cache->slabs_created - created,
+            cache->slabs_destroyed - destroyed,
+            (uint64_t)cache->empty.num_slabs);
+
+    if (slab_shrink(state, SIZE_MAX) < cache->max_empty * cache->num_pages ||
+        cache->empty.num_slabs != 0)
+        panic("slab_test: shrink should release every empty slab\n");
+
+    free_pages(ptrs, ptrs_num_pages);
+}
+
+void
+slab_test(void)
+{
+    static struct slab_state state;
+    slab_init(&state);
+
+    for (size_t i = 0; i < SLAB_SIZE_CLASSES; ++i) {
+        slab_test_class(&state, i);
+    }
+    slab_test_bulk(&state);
+    slab_test_kmem_cache();
+    slab_test_retention(&state);
+
+    kprintf("slab_test: all tests completed successfully!\n");
+}
+
+#endif
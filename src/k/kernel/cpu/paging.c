@@ -3,9 +3,15 @@
 #include <kernel/boot/header.h>
 #include <kernel/mm/mm.h>
 #include <kernel/libk/math.h>
+#include <kernel/libk/string.h>
+#include <kernel/load/elf.h>
 
 struct pt_entry* pml4_vaddr;
 
+// Forward declarations
+static void map_physmap(uintptr_t start, uintptr_t end);
+static void map_kernel_segment(const struct you_entry* entry);
+
 void*
 paddr_to_vaddr(void* paddr)
 {
@@ -18,14 +24,22 @@ vaddr_to_paddr(void* vaddr)
     return (void*)((uintptr_t)vaddr - PHYSMAP_BASE);
 }
 
+static size_t physmap_size;
+
 void
 paging_init(void)
 {
     kprintf("[START] Initialize paging\n");
 
-    pml4_vaddr = alloc_pagez(1);
+    pml4_vaddr = alloc_page_table();
+    alloc_kernel_pdpts();
+
+    // Map the kernel's memory to the physical address space. Adjacent
+    // descriptors are merged so large pages can span them.
+    uintptr_t run_start = 0;
+    uintptr_t run_end = 0;
+    uint64_t start_tsc = rdtsc();
 
-    // Map the kernel's memory to the physical address space.
     for (UINTN i = 0;
          i < boot_header->MemoryMapSize / boot_header->MemoryMapDescriptorSize;
          ++i) {
@@ -33,32 +47,231 @@ paging_init(void)
             (EFI_MEMORY_DESCRIPTOR*)((UINT8*)boot_header->MemoryMap +
                                      i * boot_header->MemoryMapDescriptorSize);
 
-        void* paddr = (void*)desc->PhysicalStart;
-        if (desc->Type == EfiConventionalMemory ||
-            desc->Type == EfiBootServicesCode ||
-            desc->Type == EfiBootServicesData ||
-            desc->Type == EfiRuntimeServicesCode ||
-            desc->Type == EfiRuntimeServicesData ||
-            desc->Type == EfiLoaderCode || desc->Type == EfiLoaderData) {
-            map_pages(paddr, PHYSMAP_BASE + paddr, 1, 0, 1, 1, 0,
-                      desc->NumberOfPages);
+        if (desc->Type != EfiConventionalMemory &&
+            desc->Type != EfiBootServicesCode &&
+            desc->Type != EfiBootServicesData &&
+            desc->Type != EfiRuntimeServicesCode &&
+            desc->Type != EfiRuntimeServicesData &&
+            desc->Type != EfiLoaderCode && desc->Type != EfiLoaderData)
+            continue;
+
+        uintptr_t start = desc->PhysicalStart;
+        uintptr_t end = start + desc->NumberOfPages * PAGE_SIZE;
+
+        if (start == run_end) {
+            run_end = end;
+            continue;
         }
+
+        map_physmap(run_start, run_end);
+        run_start = start;
+        run_end = end;
     }
 
+    map_physmap(run_start, run_end);
+
+    kprintf("paging: mapped %lld MiB of physmap in %lld cycles\n",
+            (uint64_t)(physmap_size / (1024 * 1024)), rdtsc() - start_tsc);
+
+    /*
+        The framebuffer must not be cached, but the console only writes to it,
+        so WC lets its stores leave in bursts rather than one at a time.
+    */
     size_t fb_num_pages = CEIL_DIV(boot_header->fb_size, PAGE_SIZE);
-    map_pages(boot_header->fb_paddr, boot_header->fb_vaddr, 1, 0, 1, 1, 0,
-              fb_num_pages);
+    map_pages(boot_header->fb_paddr, boot_header->fb_vaddr, 1, 0,
+              MEMORY_TYPE_WC, 1, fb_num_pages);
 
-    for (size_t i = 0; i < boot_header->you.num_entries; ++i) {
-        struct you_entry* entry = &boot_header->you.entries[i];
-        map_pages((void*)entry->paddr, (void*)entry->vaddr, 1, 0, 1, 1, 0,
-                  entry->num_pages);
-    }
+    for (size_t i = 0; i < boot_header->you.num_entries; ++i)
+        map_kernel_segment(&boot_header->you.entries[i]);
 
     // Guard page for the kernel stack
     unmap_pages((void*)boot_header->you.stack.vaddr, 1);
 
     asm volatile("mov %0, %%cr3" ::"r"(vaddr_to_paddr(pml4_vaddr)) : "memory");
+    paging_enable_features();
 
     kprintf("[DONE ] Initialize paging\n");
 }
+
+/*
+    Maps [start, end) write-back into the physmap with the largest pages that
+    fit, so the kernel's accesses to memory through the physmap are cached
+    and take few TLB entries.
+*/
+static void
+map_physmap(uintptr_t start, uintptr_t end)
+{
+    map_range((void*)start, paddr_to_vaddr((void*)start), end - start, 1, 0,
+              MEMORY_TYPE_WB, 0, true);
+    physmap_size += end - start;
+}
+
+/*
+    Maps one of the kernel's segments write-back, read-only unless it is
+    writable and non-executable unless it is code, as its ELF flags say.
+    Like every kernel half mapping its pages are global.
+*/
+static void
+map_kernel_segment(const struct you_entry* entry)
+{
+    map_range((void*)entry->paddr, (void*)entry->vaddr,
+              entry->num_pages * PAGE_SIZE, entry->flags & PF_W, 0,
+              MEMORY_TYPE_WB, !(entry->flags & PF_X), true);
+}
+
+#ifdef TEST
+
+#define PAGING_TEST_COPY_NUM_PAGES 1024
+#define PAGING_TEST_ITERATIONS     16
+
+// Nothing else maps here, between vmalloc space and the kernel.
+#define PAGING_TEST_VADDR    ((void*)VMALLOC_END)
+#define PAGING_TEST_MAP_SIZE (64 * 1024 * 1024)
+
+// Forward declarations
+static void paging_test_split(void);
+static void paging_test_range(void);
+static void paging_test_range_bench(void);
+static void paging_test_copy(void);
+
+void
+paging_test(void)
+{
+    kprintf("paging_test\n");
+
+    paging_test_split();
+    paging_test_range();
+    paging_test_range_bench();
+    paging_test_copy();
+}
+
+/*
+    Unmapping and remapping one page of the physmap must split the large page
+    around it without disturbing its neighbours.
+*/
+static void
+paging_test_split(void)
+{
+    char* page = alloc_pages(1);
+    void* paddr = vaddr_to_paddr(page);
+
+    if (lookup_paddr(page + 123) != paddr + 123)
+        panic("paging_test: physmap does not map 0x%llX\n", (uint64_t)page);
+
+    if (unmap_page(page) != paddr)
+        panic("paging_test: unmap_page returned the wrong address\n");
+    if (lookup_paddr(page))
+        panic("paging_test: unmapped page is still mapped\n");
+    if (lookup_paddr(page + PAGE_SIZE) != paddr + PAGE_SIZE)
+        panic("paging_test: splitting lost the next page\n");
+
+    map_page(paddr, page, 1, 0, MEMORY_TYPE_WB, 0);
+    if (lookup_paddr(page) != paddr)
+        panic("paging_test: remapped page is wrong\n");
+
+    free_pages(page, 1);
+}
+
+/*
+    A range that is not 2 MiB aligned at either end is mapped with 4 KiB
+    pages around 2 MiB ones, then half of it is unmapped, splitting a large
+    page, and the rest, which must free the tables it used.
+*/
+static void
+paging_test_range(void)
+{
+    void* vaddr = PAGING_TEST_VADDR + LARGE_PAGE_SIZE - 3 * PAGE_SIZE;
+    void* paddr = (void*)(LARGE_PAGE_SIZE - 3 * PAGE_SIZE);
+    size_t size = 2 * LARGE_PAGE_SIZE + 5 * PAGE_SIZE;
+    size_t half = size / 2 & PAGE_MASK;
+
+    map_range(paddr, vaddr, size, 1, 0, MEMORY_TYPE_WB, 1, true);
+    for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        if (lookup_paddr(vaddr + offset) != paddr + offset)
+            panic("paging_test: range maps 0x%llX wrong\n",
+                  (uint64_t)(vaddr + offset));
+    }
+
+    unmap_range(vaddr, half);
+    if (lookup_paddr(vaddr + half - PAGE_SIZE))
+        panic("paging_test: unmapped range is still mapped\n");
+    if (lookup_paddr(vaddr + half) != paddr + half)
+        panic("paging_test: unmap_range unmapped too much\n");
+
+    unmap_range(vaddr, size);
+    for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        if (lookup_paddr(vaddr + offset))
+            panic("paging_test: range is still mapped\n");
+    }
+
+    // The PDPT of the kernel half stays, the tables below it are freed.
+    union vaddr v = {.raw = (uintptr_t)vaddr};
+    struct pt_entry* pml4_entry = &pml4_vaddr[v.pml4_index];
+    struct pt_entry* pdpt = paddr_to_vaddr(
+        (void*)(uintptr_t)(pml4_entry->address << PAGE_SIZE_BITS));
+    if (!pml4_entry->present || pdpt[v.pdpt_index].present)
+        panic("paging_test: unmap_range did not free the empty tables\n");
+}
+
+/*
+    Times mapping PAGING_TEST_MAP_SIZE bytes, like the physmap, one page at a
+    time as paging_init used to, then by range with 4 KiB and with large
+    pages, each followed by unmap_range.
+*/
+static void
+paging_test_range_bench(void)
+{
+    size_t num_pages = PAGING_TEST_MAP_SIZE / PAGE_SIZE;
+    uint64_t cycles[3][2];
+
+    for (int i = 0; i < 3; ++i) {
+        uint64_t start = rdtsc();
+        if (i == 0) {
+            for (size_t j = 0; j < num_pages; ++j)
+                map_page((void*)(j * PAGE_SIZE),
+                         PAGING_TEST_VADDR + j * PAGE_SIZE, 1, 0,
+                         MEMORY_TYPE_WB, 1);
+        } else {
+            map_range(0, PAGING_TEST_VADDR, PAGING_TEST_MAP_SIZE, 1, 0,
+                      MEMORY_TYPE_WB, 1, i == 2);
+        }
+        uint64_t mid = rdtsc();
+        unmap_range(PAGING_TEST_VADDR, PAGING_TEST_MAP_SIZE);
+        uint64_t end = rdtsc();
+
+        cycles[i][0] = mid - start;
+        cycles[i][1] = end - mid;
+    }
+
+    kprintf("paging_test: mapping %lld MiB takes %lld cycles by page, %lld by "
+            "range and %lld by range with large pages, unmapping %lld, %lld "
+            "and %lld\n",
+            (uint64_t)(PAGING_TEST_MAP_SIZE / (1024 * 1024)), cycles[0][0],
+            cycles[1][0], cycles[2][0], cycles[0][1], cycles[1][1],
+            cycles[2][1]);
+}
+
+// Times memcpy through the physmap.
+static void
+paging_test_copy(void)
+{
+    size_t size = PAGING_TEST_COPY_NUM_PAGES * PAGE_SIZE;
+    char* src = alloc_pages(PAGING_TEST_COPY_NUM_PAGES);
+    char* dst = alloc_pages(PAGING_TEST_COPY_NUM_PAGES);
+    memset(src, 0xA5, size);
+
+    uint64_t start = rdtsc();
+    for (size_t i = 0; i < PAGING_TEST_ITERATIONS; ++i)
+        memcpy(dst, src, size);
+    uint64_t cycles = rdtsc() - start;
+
+    kprintf("paging_test: memcpy of %lld KiB through the physmap takes %lld "
+            "cycles, %lld bytes per 1000 cycles\n",
+            (uint64_t)(size / 1024), cycles / PAGING_TEST_ITERATIONS,
+            size * PAGING_TEST_ITERATIONS * 1000 / cycles);
+
+    free_pages(src, PAGING_TEST_COPY_NUM_PAGES);
+    free_pages(dst, PAGING_TEST_COPY_NUM_PAGES);
+}
+
+#endif
@@ -0,0 +1,136 @@
+#include <kernel/fs/procfs.h>
+#include <kernel/fs/uvfs.h>
+#include <kernel/libk/io.h>
+#include <kernel/libk/math.h>
+#include <kernel/libk/string.h>
+#include <kernel/cpu/paging.h>
+#include <kernel/mm/mm.h>
+
+/*
+    Pseudo files whose contents are generated on every stat and read. They are
+    generated whole, so a reader sees a consistent snapshot as long as it reads
+    the file in one call.
+*/
+
+#define PROCFS_MOUNT_PATH    "/proc"
+#define PROCFS_BUF_NUM_PAGES 4
+
+struct procfs_file {
+    const char* name;
+    void (*show)(struct kbuf* out);
+};
+
+static const struct procfs_file procfs_files[] = {
+    {"meminfo", mm_dump_stats},
+};
+
+// Forward declarations
+static const struct procfs_file* procfs_lookup(const struct path* path);
+static void procfs_show(const struct procfs_file* file, struct kbuf* out);
+
+void
+procfs_init(void)
+{
+    kprintf("[START] Initialize procfs\n");
+
+    struct fs* procfs = kzmalloc(sizeof(struct fs));
+    procfs->name = "procfs";
+    procfs->mount = NULL;
+    procfs->unmount = NULL;
+    procfs->stat = procfs_stat;
+    procfs->read = procfs_read;
+    procfs->write = procfs_write;
+    procfs->state = NULL;
+
+    if (mount(PROCFS_MOUNT_PATH, procfs) != FS_RESULT_OK)
+        panic("failed to mount procfs at %s\n", PROCFS_MOUNT_PATH);
+
+    kprintf("[DONE ] Initialize procfs\n");
+}
+
+enum fs_result
+procfs_stat(struct fs* procfs, const struct path* path, struct fs_stat* st)
+{
+    assert(procfs);
+    assert(path);
+    assert(st);
+
+    const struct procfs_file* file = procfs_lookup(path);
+    if (!file) return FS_RESULT_NOT_OK;
+
+    struct kbuf out = {0};
+    procfs_show(file, &out);
+    st->size = out.len;
+
+    kfree(out.data);
+    return FS_RESULT_OK;
+}
+
+enum fs_result
+procfs_read(struct fs* procfs, const struct path* path, void* buf,
+            size_t count, size_t offset)
+{
+    assert(procfs);
+    assert(path);
+    assert(buf);
+
+    const struct procfs_file* file = procfs_lookup(path);
+    if (!file) return FS_RESULT_NOT_OK;
+
+    struct kbuf out = {0};
+    procfs_show(file, &out);
+
+    enum fs_result ret = FS_RESULT_NOT_OK;
+    if (offset < out.len) {
+        memcpy(buf, out.data + offset, MIN(count, out.len - offset));
+        ret = FS_RESULT_OK;
+    }
+
+    kfree(out.data);
+    return ret;
+}
+
+enum fs_result
+procfs_write(struct fs* procfs, const struct path* path, const void* buf,
+             size_t count, size_t offset)
+{
+    assert(procfs);
+    assert(path);
+    assert(buf);
+    (void)count;
+    (void)offset;
+
+    return FS_RESULT_NOT_OK;
+}
+
+static const struct procfs_file*
+procfs_lookup(const struct path* path)
+{
+    // Only files directly under the mount point exist.
+    struct list_node* link = path->components.head;
+    if (!link || link->next) return NULL;
+
+    struct path_component* comp =
+        container_of(link, struct path_component, link);
+
+    for (size_t i = 0; i < sizeof(procfs_files) / sizeof(procfs_files[0]);
+         ++i) {
+        if (strcmp(procfs_files[i].name, comp->name) == 0)
+            return &procfs_files[i];
+    }
+
+    return NULL;
+}
+
+static void
+procfs_show(const struct procfs_file* file, struct kbuf* out)
+{
+    out->size = PROCFS_BUF_NUM_PAGES * PAGE_SIZE;
+    out->data = kmalloc(out->size);
+    out->len = 0;
+
+    file->show(out);
+
+    // Output that did not fit is dropped rather than reported as readable.
+    out->len = MIN(out->len, out->size - 1);
+}
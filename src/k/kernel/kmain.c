@@ -11,6 +11,7 @@
 #include <kernel/drivers/pci.h>
 #include <kernel/drivers/blk.h>
 #include <kernel/cpu/paging.h>
+#include <kernel/cpu/tlb.h>
 #include <kernel/mm/mm.h>
 #include <kernel/syscall/syscall.h>
 #include <kernel/sched/sched.h>
@@ -19,8 +20,15 @@
 #include <kernel/libk/ds/tree.h>
 #include <kernel/fs/uvfs.h>
 #include <kernel/fs/path.h>
+#include <kernel/fs/procfs.h>
+#include <kernel/mm/shrinker.h>
+#include <kernel/mm/slab.h>
+#include <kernel/mm/vmalloc.h>
+#include <kernel/mm/address_space.h>
+#include <kernel/mm/vm_area.h>
 
 struct boot_header* boot_header;
+static struct boot_header kernel_boot_header;
 
 [[noreturn]] void
 kmain(void)
@@ -28,12 +36,21 @@ kmain(void)
     // Pickup boot_header from rax register
     asm volatile("mov %%rax, %0" : "=r"(boot_header));
     interrupts_disable();
+    uint64_t start = rdtsc();
+
+    // The boot_header lives in the bootloader's image, copy it out so that
+    // loader memory can be reclaimed.
+    kernel_boot_header = *boot_header;
+    boot_header = &kernel_boot_header;
 
     kprintf("Starting kernel...\n");
 
     idt_init();
     mm_init();
     paging_init();
+    vmalloc_init();
+    address_space_init();
+    vm_area_init();
     gdt_init();
 
     pci_init();
@@ -42,11 +59,27 @@ kmain(void)
 
     uvfs_init();
     blk_init();
+    procfs_init();
+
+    mm_reclaim_boot_memory();
+
+    kprintf("Kernel initialized in %lld cycles\n", rdtsc() - start);
 
 #ifdef TEST
+    paging_test();
+    tlb_test();
+    console_test();
+    pfa_test();
+    shrinker_test();
+    slab_test();
+    vmalloc_test();
+    address_space_test();
+    vm_area_test();
     path_test();
     list_test();
     tree_test();
+
+    mm_dump_stats(NULL);
 #endif
 
     syscall_init();
@@ -3,14 +3,25 @@
 #include <kernel/drivers/blk.h>
 #include <kernel/libk/math.h>
 #include <kernel/mm/mm.h>
+#include <kernel/mm/address_space.h>
+#include <kernel/mm/vm_area.h>
 #include <kernel/libk/string.h>
 #include <kernel/fs/uvfs.h>
 
+#define USER_STACK_TOP 0x00007fffffff0000
+
+/*
+    Only describes the segments and the stack to the loaded address space,
+    their pages are read and zeroed by the page faults of the first touch.
+*/
 [[noreturn]] void
 load_init_process(const char* path)
 {
     kprintf("Loading %s process...\n", path);
 
+    uint64_t start = rdtsc();
+    struct address_space* as = current_address_space();
+
     struct fs_stat st;
     if (stat(path, &st) != FS_RESULT_OK) {
         panic("failed to stat %s\n", path);
@@ -74,25 +85,27 @@ load_init_process(const char* path)
 
         assert(program_header->memsz >= program_header->filesz);
 
-        size_t buf_num_pages = CEIL_DIV(program_header->memsz, PAGE_SIZE);
-        void* buf = alloc_pagez(buf_num_pages);
+        unsigned int flags = 0;
+        if (program_header->flags & PF_W) flags |= VM_WRITE;
+        if (program_header->flags & PF_X) flags |= VM_EXEC;
 
-        if (read(path, buf, program_header->filesz, program_header->offset) !=
-            FS_RESULT_OK) {
-            panic("failed to read PT_LOAD segment data\n");
-        }
-
-        void* paddr = vaddr_to_paddr(buf);
-        void* vaddr = (void*)program_header->vaddr;
-        map_pages_user_code(paddr, vaddr, buf_num_pages);
+        vm_area_map_file(as, program_header->vaddr, program_header->memsz,
+                         flags, path, program_header->offset,
+                         program_header->filesz);
     }
 
     uintptr_t entry = elf_header->entry;
     free_pages(elf_header, elf_header_num_pages);
     free_pages(program_headers, program_headers_num_pages);
 
-    void* rsp = (void*)0x00007fffffff0000;
-    alloc_user_stack(rsp);
+    // One page to start with, the rest is grown into by faults.
+    void* rsp = (void*)USER_STACK_TOP;
+    vm_area_map_anon(as, USER_STACK_TOP - PAGE_SIZE, PAGE_SIZE,
+                     VM_WRITE | VM_GROWSDOWN);
+
+    kprintf("Started %s in %lld cycles, %lld of %lld pages resident\n", path,
+            rdtsc() - start, (uint64_t)as->num_resident_pages,
+            (uint64_t)vm_area_num_pages(as));
 
     asm volatile("mov %[rsp], %%rsp\n"
                  "mov %%rsp, %%rbp\n"
@@ -0,0 +1,319 @@
+#include <kernel/mm/address_space.h>
+#include <kernel/cpu/paging.h>
+#include <kernel/cpu/tlb.h>
+#include <kernel/libk/io.h>
+#include <kernel/libk/string.h>
+#include <kernel/mm/mm.h>
+#include <kernel/mm/pfa.h>
+#include <kernel/mm/slab.h>
+#include <kernel/mm/vm_area.h>
+#include <kernel/mm/vmalloc.h>
+
+#define PCID_BITMAP_WORDS ((PCID_MAX + 1) / 64)
+
+// Forward declarations
+static uint16_t pcid_alloc(void);
+static void pcid_free(uint16_t pcid);
+
+struct address_space kernel_address_space;
+
+static struct slab_cache* address_space_cache;
+static struct address_space* current;
+static struct address_space* pcid_0_owner; // Whose entries PCID 0 tags
+static uint64_t pcid_bitmap[PCID_BITMAP_WORDS];
+
+void
+address_space_init(void)
+{
+    kprintf("[START] Initialize address spaces\n");
+
+    address_space_cache =
+        kmem_cache_create("address_space", sizeof(struct address_space),
+                          _Alignof(struct address_space), NULL, NULL);
+
+    kernel_address_space.pml4 = pml4_vaddr;
+    kernel_address_space.refcount = 1;
+    kernel_address_space.pcid = 0;
+    kernel_address_space.tlb_stale = false;
+    list_init(&kernel_address_space.vm_areas);
+    kernel_address_space.num_resident_pages = 0;
+
+    pcid_bitmap[0] = 1; // PCID 0 is the kernel's
+    current = &kernel_address_space;
+    pcid_0_owner = &kernel_address_space;
+
+    kprintf("[DONE ] Initialize address spaces\n");
+}
+
+struct address_space*
+address_space_create(void)
+{
+    struct address_space* as = kmem_cache_alloc(address_space_cache);
+
+    as->pml4 = alloc_page_table();
+    memcpy(&as->pml4[PML4_ENTRIES / 2],
+           &kernel_address_space.pml4[PML4_ENTRIES / 2],
+           PML4_ENTRIES / 2 * sizeof(struct pt_entry));
+
+    as->refcount = 1;
+    as->pcid = pcid_alloc();
+    as->tlb_stale = true;
+    list_init(&as->vm_areas);
+    as->num_resident_pages = 0;
+    return as;
+}
+
+/*
+    Duplicates as, vm_areas and all, sharing its pages copy-on-write, so
+    nothing is copied until either address space writes to a page. Costs a
+    page table per 2 MiB mapped and a reference per page.
+*/
+struct address_space*
+address_space_fork(struct address_space* as)
+{
+    struct address_space* child = address_space_create();
+
+    vm_area_copy_all(child, as);
+    child->num_resident_pages = copy_user_half_cow(child->pml4, as->pml4);
+
+    // The TLB may still let as write to pages that are now shared.
+    if (as == current)
+        tlb_flush();
+    else
+        as->tlb_stale = true;
+
+    return child;
+}
+
+void
+address_space_get(struct address_space* as)
+{
+    assert(as && as->refcount);
+
+    ++as->refcount;
+}
+
+void
+address_space_put(struct address_space* as)
+{
+    assert(as && as->refcount);
+
+    if (--as->refcount) return;
+    if (as == &kernel_address_space)
+        panic("dropped the last reference to the kernel address space\n");
+    if (as == current) panic("freeing the loaded address space\n");
+
+    vm_area_free_all(as);
+    free_user_half(as->pml4);
+    free_page_table(as->pml4);
+
+    if (pcid_0_owner == as) pcid_0_owner = NULL;
+    pcid_free(as->pcid);
+    kmem_cache_free(address_space_cache, as);
+}
+
+/*
+    A PCID freed and handed out again may still tag entries of the address
+    space that had it, and PCID 0 is shared by every address space that did
+    not get its own, so either flushes on the switch.
+*/
+void
+address_space_switch(struct address_space* as)
+{
+    bool flush = as->tlb_stale;
+    if (as->pcid == 0) {
+        flush |= pcid_0_owner != as;
+        pcid_0_owner = as;
+    }
+
+    as->tlb_stale = false;
+    current = as;
+    pml4_vaddr = as->pml4;
+    tlb_load_cr3(vaddr_to_paddr(as->pml4), as->pcid, flush);
+}
+
+struct address_space*
+current_address_space(void)
+{
+    return current;
+}
+
+// Returns 0, the shared PCID, when PCIDs are off or all in use.
+static uint16_t
+pcid_alloc(void)
+{
+    if (!pcid_enabled()) return 0;
+
+    for (size_t i = 0; i < PCID_BITMAP_WORDS; ++i) {
+        if (pcid_bitmap[i] == ~(uint64_t)0) continue;
+
+        size_t bit = __builtin_ctzll(~pcid_bitmap[i]);
+        pcid_bitmap[i] |= (uint64_t)1 << bit;
+        return i * 64 + bit;
+    }
+
+    return 0;
+}
+
+static void
+pcid_free(uint16_t pcid)
+{
+    if (pcid == 0) return;
+
+    pcid_bitmap[pcid / 64] &= ~((uint64_t)1 << (pcid % 64));
+}
+
+#ifdef TEST
+
+#define ADDRESS_SPACE_TEST_VADDR           USER_TEST_SLOT(1)
+#define ADDRESS_SPACE_TEST_ITERATIONS      1000
+#define ADDRESS_SPACE_TEST_FORK_ITERATIONS 100
+
+// Forward declarations
+static void address_space_test_fork(void);
+static void address_space_test_fork_bench(size_t num_pages);
+static struct address_space* address_space_test_populate(size_t num_pages);
+
+/*
+    Two address spaces map different frames at the same address and see
+    kernel memory allocated after they were created. Dropping them must drop
+    the references their mappings held. Then times creating and freeing an
+    empty address space, and forking one against its size.
+*/
+void
+address_space_test(void)
+{
+    kprintf("address_space_test\n");
+
+    struct address_space* as[2];
+    char* frames[2];
+
+    for (int i = 0; i < 2; ++i) {
+        as[i] = address_space_create();
+        frames[i] = alloc_pagez(1);
+        get_page(frames[i]); // Keep the frame past the address space
+
+        address_space_switch(as[i]);
+        map_page_user_data(vaddr_to_paddr(frames[i]),
+                           ADDRESS_SPACE_TEST_VADDR);
+        *ADDRESS_SPACE_TEST_VADDR = 'a' + i;
+    }
+
+    // Mapped through the second address space's PML4
+    char* shared = vmalloc(PAGE_SIZE);
+    *shared = 's';
+
+    for (int i = 0; i < 2; ++i) {
+        address_space_switch(as[i]);
+        if (*ADDRESS_SPACE_TEST_VADDR != 'a' + i)
+            panic("address_space_test: address spaces are not separate\n");
+        if (*shared != 's')
+            panic("address_space_test: kernel half is not shared\n");
+    }
+
+    address_space_switch(&kernel_address_space);
+    if (lookup_paddr(ADDRESS_SPACE_TEST_VADDR))
+        panic("address_space_test: kernel maps a user page\n");
+
+    for (int i = 0; i < 2; ++i) {
+        address_space_put(as[i]);
+        if (virt_to_page(frames[i])->refcount != 1)
+            panic("address_space_test: teardown kept the frame\n");
+        put_page(frames[i]);
+    }
+    vfree(shared);
+
+    uint64_t start = rdtsc();
+    for (size_t i = 0; i < ADDRESS_SPACE_TEST_ITERATIONS; ++i)
+        address_space_put(address_space_create());
+    uint64_t cycles = rdtsc() - start;
+
+    kprintf("address_space_test: create and free takes %lld cycles\n",
+            cycles / ADDRESS_SPACE_TEST_ITERATIONS);
+
+    address_space_test_fork();
+    for (size_t num_pages = 16; num_pages <= 4096; num_pages *= 16)
+        address_space_test_fork_bench(num_pages);
+}
+
+/*
+    A page written before a fork is shared, the first write after it copies
+    the page for the writer, and the last writer keeps the original frame.
+*/
+static void
+address_space_test_fork(void)
+{
+    struct address_space* parent = address_space_test_populate(1);
+    void* frame = lookup_paddr(ADDRESS_SPACE_TEST_VADDR);
+    struct address_space* child = address_space_fork(parent);
+
+    if (virt_to_page(paddr_to_vaddr(frame))->refcount != 2)
+        panic("address_space_test: fork did not share the page\n");
+
+    *ADDRESS_SPACE_TEST_VADDR = 'p';
+    if (lookup_paddr(ADDRESS_SPACE_TEST_VADDR) == frame)
+        panic("address_space_test: write did not copy the shared page\n");
+
+    address_space_switch(child);
+    if (*ADDRESS_SPACE_TEST_VADDR != 'a')
+        panic("address_space_test: child sees the parent's write\n");
+    *ADDRESS_SPACE_TEST_VADDR = 'c';
+    if (lookup_paddr(ADDRESS_SPACE_TEST_VADDR) != frame)
+        panic("address_space_test: unshared page was copied\n");
+
+    address_space_switch(parent);
+    if (*ADDRESS_SPACE_TEST_VADDR != 'p')
+        panic("address_space_test: parent sees the child's write\n");
+
+    address_space_switch(&kernel_address_space);
+    address_space_put(child);
+    address_space_put(parent);
+}
+
+/*
+    Times forking an address space with num_pages resident pages, and the
+    write faults that copy each of them afterwards.
+*/
+static void
+address_space_test_fork_bench(size_t num_pages)
+{
+    struct address_space* parent = address_space_test_populate(num_pages);
+
+    uint64_t start = rdtsc();
+    for (size_t i = 0; i < ADDRESS_SPACE_TEST_FORK_ITERATIONS; ++i)
+        address_space_put(address_space_fork(parent));
+    uint64_t fork_cycles = rdtsc() - start;
+
+    struct address_space* child = address_space_fork(parent);
+    start = rdtsc();
+    for (size_t i = 0; i < num_pages; ++i)
+        ADDRESS_SPACE_TEST_VADDR[i * PAGE_SIZE] = 'b';
+    uint64_t copy_cycles = rdtsc() - start;
+
+    kprintf("address_space_test: fork of %lld pages takes %lld cycles, "
+            "copying a page on write %lld\n",
+            (uint64_t)num_pages,
+            fork_cycles / ADDRESS_SPACE_TEST_FORK_ITERATIONS,
+            copy_cycles / num_pages);
+
+    address_space_switch(&kernel_address_space);
+    address_space_put(child);
+    address_space_put(parent);
+}
+
+// Loads an address space with num_pages written pages at the test address.
+static struct address_space*
+address_space_test_populate(size_t num_pages)
+{
+    struct address_space* as = address_space_create();
+    address_space_switch(as);
+
+    vm_area_map_anon(as, (uintptr_t)ADDRESS_SPACE_TEST_VADDR,
+                     num_pages * PAGE_SIZE, VM_WRITE);
+    for (size_t i = 0; i < num_pages; ++i)
+        ADDRESS_SPACE_TEST_VADDR[i * PAGE_SIZE] = 'a';
+
+    return as;
+}
+
+#endif
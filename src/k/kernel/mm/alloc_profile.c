@@ -0,0 +1,243 @@
+#ifdef ALLOC_PROFILE
+
+#include <kernel/mm/alloc_profile.h>
+#include <kernel/libk/io.h>
+#include <limits.h>
+
+struct alloc_record {
+    void* ptr; // NULL for an empty slot
+    struct alloc_site* site;
+    size_t size;
+    uint64_t tsc;
+    enum alloc_profile_kind kind;
+};
+
+struct alloc_profile {
+    struct alloc_site sites[ALLOC_PROFILE_SITES];
+    struct alloc_record records[ALLOC_PROFILE_OBJECTS];
+    size_t num_records;
+    uint64_t dropped_sites;   // Allocations whose site did not fit
+    uint64_t dropped_records; // Allocations not tracked until freed
+    uint64_t unmatched_frees; // Frees of untracked allocations
+};
+
+// Forward declarations
+static size_t hash(uintptr_t key, enum alloc_profile_kind kind);
+static uint64_t site_key(const struct alloc_site* site, bool by_allocs);
+static bool ranks_before(const struct alloc_site* a,
+                         const struct alloc_site* b, bool by_allocs);
+static struct alloc_site* get_site(void* caller,
+                                   enum alloc_profile_kind kind);
+static size_t find_record(void* ptr, enum alloc_profile_kind kind);
+static void remove_record(size_t i);
+
+static struct alloc_profile profile;
+
+/*
+    Both tables use linear probing. Records are removed by shifting later
+    entries of the same probe sequence back, so lookups never have to step
+    over deleted slots.
+*/
+void
+alloc_profile_alloc(enum alloc_profile_kind kind, void* ptr, size_t size,
+                    void* caller)
+{
+    if (!ptr) return;
+
+    bool enabled = interrupts_enabled();
+    interrupts_disable();
+
+    struct alloc_site* site = get_site(caller, kind);
+    if (!site) {
+        ++profile.dropped_sites;
+        goto out;
+    }
+
+    ++site->allocs;
+    site->total_bytes += size;
+
+    // Keep the table at most 3/4 full so probe sequences stay short.
+    if (profile.num_records >= ALLOC_PROFILE_OBJECTS / 4 * 3) {
+        ++profile.dropped_records;
+        goto out;
+    }
+
+    ++site->live_count;
+    site->live_bytes += size;
+
+    size_t i = hash((uintptr_t)ptr, kind) & (ALLOC_PROFILE_OBJECTS - 1);
+    while (profile.records[i].ptr)
+        i = (i + 1) & (ALLOC_PROFILE_OBJECTS - 1);
+
+    profile.records[i] = (struct alloc_record){
+        .ptr = ptr,
+        .site = site,
+        .size = size,
+        .tsc = rdtsc(),
+        .kind = kind,
+    };
+    ++profile.num_records;
+
+out:
+    interrupts_restore(enabled);
+}
+
+void
+alloc_profile_free(enum alloc_profile_kind kind, void* ptr)
+{
+    bool enabled = interrupts_enabled();
+    interrupts_disable();
+
+    size_t i = find_record(ptr, kind);
+    if (i == SIZE_MAX) {
+        ++profile.unmatched_frees;
+    } else {
+        struct alloc_record* record = &profile.records[i];
+        struct alloc_site* site = record->site;
+
+        ++site->frees;
+        --site->live_count;
+        site->live_bytes -= record->size;
+        site->lifetime_cycles += rdtsc() - record->tsc;
+
+        remove_record(i);
+    }
+
+    interrupts_restore(enabled);
+}
+
+/*
+    Reports the num_sites sites holding the most live bytes, then those
+    with the most allocations, which finds both leaks and churn.
+*/
+void
+alloc_profile_dump(size_t num_sites, struct kbuf* out)
+{
+    bool enabled = interrupts_enabled();
+    interrupts_disable();
+
+    static const char* kind_names[] = {
+        [ALLOC_PROFILE_KMALLOC] = "kmalloc",
+        [ALLOC_PROFILE_PAGES] = "pages",
+    };
+
+    for (int by_allocs = 0; by_allocs < 2; ++by_allocs) {
+        kbprintf(out, "alloc_profile: top %lld sites by %s\n",
+                 (uint64_t)num_sites, by_allocs ? "allocations" : "live bytes");
+
+        // Selection by rank, the table is small and this runs rarely.
+        struct alloc_site* prev = NULL;
+        for (size_t n = 0; n < num_sites; ++n) {
+            struct alloc_site* best = NULL;
+            for (size_t i = 0; i < ALLOC_PROFILE_SITES; ++i) {
+                struct alloc_site* site = &profile.sites[i];
+                if (!site->caller || site_key(site, by_allocs) == 0) continue;
+                if (prev && !ranks_before(prev, site, by_allocs)) continue;
+                if (!best || ranks_before(site, best, by_allocs)) best = site;
+            }
+            if (!best) break;
+
+            kbprintf(out,
+                     "alloc_profile: 0x%llX %s: %lld live (%lld bytes), "
+                     "%lld allocs (%lld bytes), %lld frees, average "
+                     "lifetime %lld cycles\n",
+                     (uint64_t)best->caller, kind_names[best->kind],
+                     best->live_count, best->live_bytes, best->allocs,
+                     best->total_bytes, best->frees,
+                     best->frees ? best->lifetime_cycles / best->frees : 0);
+            prev = best;
+        }
+    }
+
+    kbprintf(out,
+             "alloc_profile: %lld allocations tracked, %lld dropped, %lld "
+             "without a site, %lld untracked frees\n",
+             (uint64_t)profile.num_records, profile.dropped_records,
+             profile.dropped_sites, profile.unmatched_frees);
+
+    interrupts_restore(enabled);
+}
+
+static size_t
+hash(uintptr_t key, enum alloc_profile_kind kind)
+{
+    // Fibonacci hashing, the low bits of addresses are mostly zero.
+    return ((key ^ kind) * 0x9E3779B97F4A7C15) >> 32;
+}
+
+static uint64_t
+site_key(const struct alloc_site* site, bool by_allocs)
+{
+    return by_allocs ? site->allocs : site->live_bytes;
+}
+
+// Orders by decreasing key, ties by address so every site has one rank.
+static bool
+ranks_before(const struct alloc_site* a, const struct alloc_site* b,
+             bool by_allocs)
+{
+    uint64_t key_a = site_key(a, by_allocs);
+    uint64_t key_b = site_key(b, by_allocs);
+    return key_a > key_b || (key_a == key_b && a < b);
+}
+
+static struct alloc_site*
+get_site(void* caller, enum alloc_profile_kind kind)
+{
+    size_t i = hash((uintptr_t)caller, kind) & (ALLOC_PROFILE_SITES - 1);
+
+    for (size_t n = 0; n < ALLOC_PROFILE_SITES; ++n) {
+        struct alloc_site* site = &profile.sites[i];
+        if (!site->caller) {
+            site->caller = caller;
+            site->kind = kind;
+            return site;
+        }
+        if (site->caller == caller && site->kind == kind) return site;
+
+        i = (i + 1) & (ALLOC_PROFILE_SITES - 1);
+    }
+
+    return NULL;
+}
+
+static size_t
+find_record(void* ptr, enum alloc_profile_kind kind)
+{
+    size_t i = hash((uintptr_t)ptr, kind) & (ALLOC_PROFILE_OBJECTS - 1);
+
+    while (profile.records[i].ptr) {
+        struct alloc_record* record = &profile.records[i];
+        if (record->ptr == ptr && record->kind == kind) return i;
+
+        i = (i + 1) & (ALLOC_PROFILE_OBJECTS - 1);
+    }
+
+    return SIZE_MAX;
+}
+
+static void
+remove_record(size_t i)
+{
+    size_t j = i;
+
+    for (;;) {
+        j = (j + 1) & (ALLOC_PROFILE_OBJECTS - 1);
+
+        struct alloc_record* record = &profile.records[j];
+        if (!record->ptr) break;
+
+        // Move the record back unless its home slot lies in (i, j].
+        size_t home = hash((uintptr_t)record->ptr, record->kind) &
+                      (ALLOC_PROFILE_OBJECTS - 1);
+        if (i <= j ? i < home && home <= j : i < home || home <= j) continue;
+
+        profile.records[i] = *record;
+        i = j;
+    }
+
+    profile.records[i].ptr = NULL;
+    --profile.num_records;
+}
+
+#endif
@@ -5,80 +5,480 @@
 #include <kernel/libk/io.h>
 #include <kernel/cpu/paging.h>
 #include <kernel/libk/string.h>
+#include <kernel/mm/pcp.h>
+#include <kernel/mm/zero_pool.h>
+#include <kernel/tls.h>
+#include <kernel/drivers/pit.h>
+#include <kernel/libk/math.h>
+#include <kernel/mm/stats.h>
+#include <kernel/mm/shrinker.h>
+#include <kernel/mm/vmalloc.h>
+#include <kernel/mm/alloc_profile.h>
+
+#define SLAB_REAP_INTERVAL 100 // Timer ticks between slab reaps
 
 static struct pfa_state pfa_state;
 static struct slab_state slab_state;
+static struct zero_pool zero_pool;
+static size_t exact_pages_saved;
+
+static struct latency_hist alloc_pages_latency = {.name = "alloc_pages"};
+static struct latency_hist free_pages_latency = {.name = "free_pages"};
+static struct latency_hist kmalloc_latency = {.name = "kmalloc"};
+static struct latency_hist kfree_latency = {.name = "kfree"};
+
+struct phys_range {
+    uintptr_t start;
+    uintptr_t end;
+};
+
+// Forward declarations
+static bool is_conventional_memory(UINT32 type);
+static bool is_boot_memory(UINT32 type);
+static size_t add_memory(bool (*usable)(UINT32 type),
+                         const struct phys_range* reserved,
+                         size_t num_reserved);
+static size_t add_range(struct phys_range range,
+                        const struct phys_range* reserved,
+                        size_t num_reserved);
+static struct phys_range page_range(uintptr_t paddr, size_t num_bytes);
+static void zero_pool_worker(void);
+static void slab_reaper(void);
+static size_t slab_shrinker_scan(struct shrinker* shrinker, size_t num_pages);
+static void* try_alloc_pages(size_t num_pages, unsigned int flags);
+static size_t reclaim(size_t num_pages);
+static void release_page(struct page* page, void* ptr);
+
+static struct shrinker slab_shrinker = {
+    .name = "slab",
+    .scan = slab_shrinker_scan,
+};
 
 void
 mm_init(void)
 {
     kprintf("[START] Initialize Memory Manager\n");
 
-    void* start_paddr = NULL;
+    // For now, the kernel should not take from EfiBootServicesCode or
+    // EfiBootServicesData since the bootloader uses that memory. It is handed
+    // over later by mm_reclaim_boot_memory.
+    pfa_init(&pfa_state);
+    size_t num_pages = add_memory(is_conventional_memory, NULL, 0);
+
+    if (num_pages == 0) panic("no usable memory found");
+    kprintf("mm: %lld pages of conventional memory in %lld regions\n",
+            (uint64_t)num_pages, (uint64_t)pfa_state.num_regions);
+
+    pcp_init(&tls.pcp);
+    zero_pool_init(&zero_pool);
+    slab_init(&slab_state);
+    shrinker_register(&slab_shrinker);
+
+    // The timer only fires while the kernel waits with interrupts enabled,
+    // which is when the zero pool is refilled and idle slabs are reaped.
+    timer_add_callback(zero_pool_worker);
+    timer_add_callback(slab_reaper);
+
+    kprintf("[DONE ] Initialize Memory Manager\n");
+}
+
+/*
+    Hands the memory used by the firmware and the bootloader to the page frame
+    allocator. This must run after the kernel has switched to its own page
+    tables and reset every device the bootloader used, since their page tables
+    and queues live in that memory.
+*/
+void
+mm_reclaim_boot_memory(void)
+{
+    kprintf("[START] Reclaim boot memory\n");
+
+    struct phys_range reserved[YOU_ENTRIES_MAX + 2];
+    size_t num_reserved = 0;
+
+    // The kernel's own segments
+    for (size_t i = 0; i < boot_header->you.num_entries; ++i) {
+        struct you_entry* entry = &boot_header->you.entries[i];
+        reserved[num_reserved++] =
+            page_range(entry->paddr, entry->num_pages * PAGE_SIZE);
+    }
+
+    // The stack the kernel was started on
+    reserved[num_reserved++] =
+        page_range(boot_header->you.stack.paddr,
+                   boot_header->you.stack.num_pages * PAGE_SIZE);
+
+    // The memory map is still read by this pass
+    reserved[num_reserved++] =
+        page_range((uintptr_t)boot_header->MemoryMap,
+                   boot_header->MemoryMapSize +
+                       2 * boot_header->MemoryMapDescriptorSize);
+
+    size_t num_regions = pfa_state.num_regions;
+    size_t num_pages = add_memory(is_boot_memory, reserved, num_reserved);
+    kprintf("mm: reclaimed %lld pages of boot memory in %lld regions\n",
+            (uint64_t)num_pages,
+            (uint64_t)(pfa_state.num_regions - num_regions));
+
+    kprintf("[DONE ] Reclaim boot memory\n");
+}
+
+static bool
+is_conventional_memory(UINT32 type)
+{
+    return type == EfiConventionalMemory;
+}
+
+static bool
+is_boot_memory(UINT32 type)
+{
+    return type == EfiBootServicesCode || type == EfiBootServicesData ||
+           type == EfiLoaderCode || type == EfiLoaderData;
+}
+
+/*
+    Adds every usable memory map range to the page frame allocator, merging
+    physically adjacent descriptors into one region and leaving out reserved
+    ranges.
+*/
+static size_t
+add_memory(bool (*usable)(UINT32 type), const struct phys_range* reserved,
+           size_t num_reserved)
+{
+    EFI_MEMORY_DESCRIPTOR* memory_map = paddr_to_vaddr(boot_header->MemoryMap);
+    struct phys_range run = {0, 0};
     size_t num_pages = 0;
 
     for (UINTN i = 0;
          i < boot_header->MemoryMapSize / boot_header->MemoryMapDescriptorSize;
          ++i) {
         EFI_MEMORY_DESCRIPTOR* desc =
-            (EFI_MEMORY_DESCRIPTOR*)((UINT8*)boot_header->MemoryMap +
+            (EFI_MEMORY_DESCRIPTOR*)((UINT8*)memory_map +
                                      i * boot_header->MemoryMapDescriptorSize);
 
-        // For now, the kernel should not take from EfiBootServicesCode or
-        // EfiBootServicesData since the bootloader uses that memory.
-        if (desc->Type != EfiConventionalMemory) continue;
+        if (!usable(desc->Type)) continue;
         if (desc->PhysicalStart == 0) continue;
 
-        if (desc->NumberOfPages > num_pages) {
-            start_paddr = (void*)(uintptr_t)desc->PhysicalStart;
-            num_pages = desc->NumberOfPages;
+        uintptr_t start = desc->PhysicalStart;
+        uintptr_t end = start + desc->NumberOfPages * PAGE_SIZE;
+
+        if (start == run.end) {
+            run.end = end;
+            continue;
         }
+
+        num_pages += add_range(run, reserved, num_reserved);
+        run.start = start;
+        run.end = end;
     }
 
-    if (!start_paddr) panic("no usable memory found");
-    void* kernel_start_vaddr = paddr_to_vaddr(start_paddr);
-    pfa_init(&pfa_state, kernel_start_vaddr, num_pages);
-    slab_init(&slab_state);
+    num_pages += add_range(run, reserved, num_reserved);
+    return num_pages;
+}
 
-    kprintf("[DONE ] Initialize Memory Manager\n");
+static size_t
+add_range(struct phys_range range, const struct phys_range* reserved,
+          size_t num_reserved)
+{
+    size_t num_pages = 0;
+    uintptr_t current = range.start;
+
+    while (current < range.end) {
+        uintptr_t end = range.end;
+        bool is_reserved = false;
+
+        for (size_t i = 0; i < num_reserved; ++i) {
+            if (reserved[i].start <= current && current < reserved[i].end) {
+                current = reserved[i].end;
+                is_reserved = true;
+                break;
+            }
+
+            if (current < reserved[i].start && reserved[i].start < end)
+                end = reserved[i].start;
+        }
+
+        if (is_reserved) continue;
+
+        num_pages += pfa_add_region(&pfa_state,
+                                    paddr_to_vaddr((void*)current),
+                                    (end - current) / PAGE_SIZE);
+        current = end;
+    }
+
+    return num_pages;
 }
 
-void*
-alloc_pages(size_t num_pages)
+static void
+zero_pool_worker(void)
+{
+    zero_pool_refill(&zero_pool, &pfa_state, ZERO_POOL_BATCH);
+}
+
+static void
+slab_reaper(void)
+{
+    static size_t ticks;
+
+    if (++ticks % SLAB_REAP_INTERVAL == 0) slab_reap(&slab_state);
+}
+
+static size_t
+slab_shrinker_scan(struct shrinker* shrinker, size_t num_pages)
+{
+    (void)shrinker;
+
+    return slab_shrink(&slab_state, num_pages);
+}
+
+static struct phys_range
+page_range(uintptr_t paddr, size_t num_bytes)
 {
-    return pfa_alloc_pages(&pfa_state, num_pages);
+    struct phys_range range = {
+        .start = (uintptr_t)PAGE_ALIGN_DOWN(paddr),
+        .end = (uintptr_t)PAGE_ALIGN_UP(paddr + num_bytes),
+    };
+    return range;
 }
 
 void*
-alloc_pagez(size_t num_pages)
+alloc_pages_flags(size_t num_pages, unsigned int flags)
+{
+    if (num_pages == 0) panic("you cannot allocate 0 pages");
+
+    if (flags & ALLOC_ZERO && num_pages == 1) {
+        bool enabled = interrupts_enabled();
+        interrupts_disable();
+        void* ptr = zero_pool_alloc(&zero_pool, &pfa_state);
+        interrupts_restore(enabled);
+
+        if (ptr) {
+            alloc_profile_alloc(ALLOC_PROFILE_PAGES, ptr, PAGE_SIZE,
+                                __builtin_return_address(0));
+            return ptr;
+        }
+    }
+
+    void* ptr;
+    while (!(ptr = try_alloc_pages(num_pages, flags))) {
+        if (!(flags & ALLOC_MAY_RECLAIM) || reclaim(num_pages) == 0) break;
+    }
+
+    if (!ptr) {
+        if (flags & ALLOC_MAY_FAIL) return NULL;
+        pfa_out_of_memory(&pfa_state, num_pages);
+    }
+
+    if (flags & ALLOC_ZERO) {
+        uint64_t start = rdtsc();
+        memset(ptr, 0, num_pages * PAGE_SIZE);
+        if (num_pages == 1) zero_pool.stats.miss_cycles += rdtsc() - start;
+    }
+
+    alloc_profile_alloc(ALLOC_PROFILE_PAGES, ptr, num_pages * PAGE_SIZE,
+                        __builtin_return_address(0));
+    return ptr;
+}
+
+static void*
+try_alloc_pages(size_t num_pages, unsigned int flags)
 {
-    void* ptr = pfa_alloc_pages(&pfa_state, num_pages);
-    memset(ptr, 0, num_pages * PAGE_SIZE);
+    bool enabled = interrupts_enabled();
+    interrupts_disable();
+    uint64_t start = rdtsc();
+
+    void* ptr;
+    if (num_pages == 1) {
+        ptr = pcp_alloc_page(&tls.pcp, &pfa_state);
+    } else if (flags & ALLOC_EXACT) {
+        ptr = pfa_try_alloc_pages_exact(&pfa_state, num_pages);
+        if (ptr)
+            exact_pages_saved +=
+                ((size_t)1 << ceil_log2(num_pages)) - num_pages;
+    } else {
+        ptr = pfa_try_alloc_pages(&pfa_state, num_pages);
+    }
+
+    latency_hist_add(&alloc_pages_latency, rdtsc() - start);
+    interrupts_restore(enabled);
     return ptr;
 }
 
+/*
+    Gives cached memory back to the buddy pools: first the pages held by the
+    page caches, then whatever the shrinkers can free. Returns the number of
+    pages released, 0 means there is nothing left to reclaim.
+*/
+static size_t
+reclaim(size_t num_pages)
+{
+    bool enabled = interrupts_enabled();
+    interrupts_disable();
+    size_t num_reclaimed = pcp_drain(&tls.pcp, &pfa_state) +
+                           zero_pool_drain(&zero_pool, &pfa_state);
+    interrupts_restore(enabled);
+
+    if (num_reclaimed >= num_pages) return num_reclaimed;
+
+    // Pages freed by the shrinkers land on the per-CPU cache, the next round
+    // drains them.
+    return num_reclaimed + shrink_caches(num_pages - num_reclaimed);
+}
+
 void
 free_pages(void* ptr, size_t num_pages)
 {
-    pfa_free_pages(&pfa_state, ptr, num_pages);
+    if (!ptr) panic("ptr is NULL");
+    if (!PAGE_ALIGNED(ptr)) panic("ptr is not page aligned");
+
+    bool enabled = interrupts_enabled();
+    interrupts_disable();
+    uint64_t start = rdtsc();
+
+    struct page* page = pfa_virt_to_page(&pfa_state, ptr);
+    if (page) {
+        if (page->flags & PAGE_FLAG_EXACT ? page->num_pages != num_pages
+                                          : page->order != ceil_log2(num_pages))
+            panic("freeing an order %d block as %lld pages, ptr=0x%llX\n",
+                  page->order, (uint64_t)num_pages, ptr);
+
+        release_page(page, ptr);
+    }
+
+    latency_hist_add(&free_pages_latency, rdtsc() - start);
+    interrupts_restore(enabled);
+}
+
+struct page*
+virt_to_page(void* ptr)
+{
+    return pfa_virt_to_page(&pfa_state, ptr);
 }
 
 void*
-kmalloc(size_t size)
+page_to_virt(struct page* page)
+{
+    return pfa_page_to_virt(&pfa_state, page);
+}
+
+void
+get_page(void* ptr)
+{
+    bool enabled = interrupts_enabled();
+    interrupts_disable();
+
+    struct page* page = pfa_virt_to_page(&pfa_state, ptr);
+    if (!page) panic("page is not managed, ptr=0x%llX\n", ptr);
+    if (page->refcount == 0) panic("page is not allocated, ptr=0x%llX\n", ptr);
+
+    ++page->refcount;
+
+    interrupts_restore(enabled);
+}
+
+void
+put_page(void* ptr)
+{
+    bool enabled = interrupts_enabled();
+    interrupts_disable();
+
+    struct page* page = pfa_virt_to_page(&pfa_state, ptr);
+    if (!page) panic("page is not managed, ptr=0x%llX\n", ptr);
+
+    release_page(page, ptr);
+
+    interrupts_restore(enabled);
+}
+
+/*
+    Drops a reference to the block headed by page and frees it at its
+    recorded order once the last one is gone. Interrupts must be disabled.
+*/
+static void
+release_page(struct page* page, void* ptr)
+{
+    if (page->refcount == 0) panic("double free, ptr=0x%llX\n", ptr);
+    if (--page->refcount) return;
+
+    alloc_profile_free(ALLOC_PROFILE_PAGES, ptr);
+
+    if (page->flags & PAGE_FLAG_EXACT)
+        pfa_free_pages_exact(&pfa_state, ptr, page->num_pages);
+    else if (page->order == 0)
+        pcp_free_page(&tls.pcp, &pfa_state, page);
+    else
+        pfa_free_pages(&pfa_state, ptr, (size_t)1 << page->order);
+}
+
+void
+mm_dump_stats(struct kbuf* out)
 {
-    return slab_kmalloc(&slab_state, size);
+    bool enabled = interrupts_enabled();
+    interrupts_disable();
+
+    pfa_dump_stats(&pfa_state, out);
+    pcp_dump_stats(&tls.pcp, out);
+    zero_pool_dump_stats(&zero_pool, out);
+    kbprintf(out, "mm: %lld pages saved by exact-size allocations\n",
+             (uint64_t)exact_pages_saved);
+    slab_dump_stats(&slab_state, out);
+    vmalloc_dump_stats(out);
+    shrinker_dump_stats(out);
+
+    latency_hist_dump(&alloc_pages_latency, out);
+    latency_hist_dump(&free_pages_latency, out);
+    latency_hist_dump(&kmalloc_latency, out);
+    latency_hist_dump(&kfree_latency, out);
+
+    alloc_profile_dump(ALLOC_PROFILE_TOP, out);
+
+    interrupts_restore(enabled);
 }
 
 void*
-kzmalloc(size_t size)
+kmalloc_flags(size_t size, unsigned int flags)
 {
-    void* ptr = slab_kmalloc(&slab_state, size);
-    memset(ptr, 0, size);
+    uint64_t start = rdtsc();
+    void* ptr = slab_kmalloc(&slab_state, size, flags);
+    latency_hist_add(&kmalloc_latency, rdtsc() - start);
+
+    alloc_profile_alloc(ALLOC_PROFILE_KMALLOC, ptr, size,
+                        __builtin_return_address(0));
     return ptr;
 }
 
 void
 kfree(void* ptr)
 {
-    slab_kfree(&slab_state, ptr);
+    alloc_profile_free(ALLOC_PROFILE_KMALLOC, ptr);
+
+    uint64_t start = rdtsc();
+    slab_kfree(ptr);
+    latency_hist_add(&kfree_latency, rdtsc() - start);
+}
+
+size_t
+kmalloc_bulk_flags(size_t size, unsigned int flags, size_t count, void** ptrs)
+{
+    size_t num_allocated =
+        slab_kmalloc_bulk(&slab_state, size, flags, count, ptrs);
+
+#ifdef ALLOC_PROFILE
+    for (size_t i = 0; i < num_allocated; ++i)
+        alloc_profile_alloc(ALLOC_PROFILE_KMALLOC, ptrs[i], size,
+                            __builtin_return_address(0));
+#endif
+
+    return num_allocated;
+}
+
+void
+kfree_bulk(size_t count, void** ptrs)
+{
+#ifdef ALLOC_PROFILE
+    for (size_t i = 0; i < count; ++i)
+        alloc_profile_free(ALLOC_PROFILE_KMALLOC, ptrs[i]);
+#endif
+
+    slab_kfree_bulk(count, ptrs);
 }
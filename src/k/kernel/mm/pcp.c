@@ -0,0 +1,190 @@
+#include <kernel/mm/pcp.h>
+#include <kernel/libk/io.h>
+#include <kernel/cpu/paging.h>
+
+// Forward declarations
+static void pcp_refill(struct pcp_cache* pcp, struct pfa_state* state);
+static void pcp_drain_batch(struct pcp_cache* pcp, struct pfa_state* state,
+                            size_t count);
+static void pcp_push_hot(struct pcp_cache* pcp, struct page* page);
+static void pcp_push_cold(struct pcp_cache* pcp, struct page* page);
+static struct page* pcp_pop_hot(struct pcp_cache* pcp);
+static struct page* pcp_pop_cold(struct pcp_cache* pcp);
+
+void
+pcp_init(struct pcp_cache* pcp)
+{
+    pcp->hot = NULL;
+    pcp->cold = NULL;
+    pcp->count = 0;
+    pcp->high = PCP_HIGH;
+    pcp->batch = PCP_BATCH;
+    pcp->stats = (struct pcp_stats){0};
+}
+
+void*
+pcp_alloc_page(struct pcp_cache* pcp, struct pfa_state* state)
+{
+    if (pcp->hot) {
+        ++pcp->stats.alloc_hits;
+    } else {
+        ++pcp->stats.alloc_misses;
+        pcp_refill(pcp, state);
+    }
+
+    struct page* page = pcp_pop_hot(pcp);
+    if (!page) return NULL;
+
+    page_set_allocated(page, 0);
+    return pfa_page_to_virt(state, page);
+}
+
+void
+pcp_free_page(struct pcp_cache* pcp, struct pfa_state* state,
+              struct page* page)
+{
+    if (page->flags & PAGE_FLAGS_UNALLOCATED)
+        panic("double free, ptr=0x%llX\n", pfa_page_to_virt(state, page));
+
+    ++pcp->stats.frees;
+    pcp_push_hot(pcp, page);
+
+    if (pcp->count > pcp->high) pcp_drain_batch(pcp, state, pcp->batch);
+}
+
+size_t
+pcp_drain(struct pcp_cache* pcp, struct pfa_state* state)
+{
+    size_t num_pages = pcp->count;
+    if (num_pages) pcp_drain_batch(pcp, state, num_pages);
+
+    return num_pages;
+}
+
+void
+pcp_dump_stats(const struct pcp_cache* pcp, struct kbuf* out)
+{
+    const struct pcp_stats* stats = &pcp->stats;
+    uint64_t allocs = stats->alloc_hits + stats->alloc_misses;
+
+    kbprintf(out, "pcp: %lld pages cached (high=%lld, batch=%lld)\n",
+             (uint64_t)pcp->count, (uint64_t)pcp->high,
+             (uint64_t)pcp->batch);
+    kbprintf(out, "pcp: %lld allocs, %lld hits, %lld misses, hit rate %lld%%\n",
+             allocs, stats->alloc_hits, stats->alloc_misses,
+             allocs ? stats->alloc_hits * 100 / allocs : 0);
+    kbprintf(out, "pcp: %lld frees\n", stats->frees);
+    kbprintf(out, "pcp: %lld refills, %lld pages, average batch %lld\n",
+             stats->refills, stats->refill_pages,
+             stats->refills ? stats->refill_pages / stats->refills : 0);
+    kbprintf(out, "pcp: %lld drains, %lld pages, average batch %lld\n",
+             stats->drains, stats->drain_pages,
+             stats->drains ? stats->drain_pages / stats->drains : 0);
+}
+
+static void
+pcp_refill(struct pcp_cache* pcp, struct pfa_state* state)
+{
+    struct page* list = NULL;
+    size_t num_pages = pfa_alloc_pages_bulk(state, pcp->batch, &list);
+
+    while (list) {
+        struct page* next = list->next;
+        pcp_push_cold(pcp, list);
+        list = next;
+    }
+
+    ++pcp->stats.refills;
+    pcp->stats.refill_pages += num_pages;
+}
+
+static void
+pcp_drain_batch(struct pcp_cache* pcp, struct pfa_state* state, size_t count)
+{
+    struct page* list = NULL;
+    size_t num_pages = 0;
+
+    while (num_pages < count) {
+        struct page* page = pcp_pop_cold(pcp);
+        if (!page) break;
+
+        page->next = list;
+        list = page;
+        ++num_pages;
+    }
+
+    pfa_free_pages_bulk(state, list);
+
+    ++pcp->stats.drains;
+    pcp->stats.drain_pages += num_pages;
+}
+
+static void
+pcp_push_hot(struct pcp_cache* pcp, struct page* page)
+{
+    page->prev = NULL;
+    page->next = pcp->hot;
+    if (pcp->hot)
+        pcp->hot->prev = page;
+    else
+        pcp->cold = page;
+    pcp->hot = page;
+
+    page->refcount = 0;
+    page->flags = PAGE_FLAG_PCP;
+    ++pcp->count;
+}
+
+static void
+pcp_push_cold(struct pcp_cache* pcp, struct page* page)
+{
+    page->next = NULL;
+    page->prev = pcp->cold;
+    if (pcp->cold)
+        pcp->cold->next = page;
+    else
+        pcp->hot = page;
+    pcp->cold = page;
+
+    page->refcount = 0;
+    page->flags = PAGE_FLAG_PCP;
+    ++pcp->count;
+}
+
+static struct page*
+pcp_pop_hot(struct pcp_cache* pcp)
+{
+    struct page* page = pcp->hot;
+    if (!page) return NULL;
+
+    pcp->hot = page->next;
+    if (pcp->hot)
+        pcp->hot->prev = NULL;
+    else
+        pcp->cold = NULL;
+
+    page->next = NULL;
+    page->prev = NULL;
+    page->flags = 0;
+    --pcp->count;
+    return page;
+}
+
+static struct page*
+pcp_pop_cold(struct pcp_cache* pcp)
+{
+    struct page* page = pcp->cold;
+    if (!page) return NULL;
+
+    pcp->cold = page->prev;
+    if (pcp->cold)
+        pcp->cold->next = NULL;
+    else
+        pcp->hot = NULL;
+
+    page->next = NULL;
+    page->prev = NULL;
+    page->flags = 0;
+    --pcp->count;
+    return page;
+}
@@ -0,0 +1,137 @@
+#include <kernel/mm/shrinker.h>
+#include <kernel/mm/mm.h>
+#include <kernel/mm/pfa.h>
+#include <kernel/cpu/paging.h>
+#include <limits.h>
+
+static struct list shrinkers;
+
+void
+shrinker_register(struct shrinker* shrinker)
+{
+    assert(shrinker && shrinker->scan);
+
+    list_node_init(&shrinkers, &shrinker->link);
+    list_push(&shrinkers, &shrinker->link);
+    shrinker->calls = 0;
+    shrinker->pages_freed = 0;
+}
+
+void
+shrinker_unregister(struct shrinker* shrinker)
+{
+    assert(shrinker);
+
+    list_remove(&shrinkers, &shrinker->link);
+}
+
+size_t
+shrink_caches(size_t num_pages)
+{
+    size_t num_freed = 0;
+
+    list_foreach_safe(&shrinkers, link, tmp)
+    {
+        if (num_freed >= num_pages) break;
+
+        struct shrinker* shrinker =
+            container_of(link, struct shrinker, link);
+        size_t freed = shrinker->scan(shrinker, num_pages - num_freed);
+
+        ++shrinker->calls;
+        shrinker->pages_freed += freed;
+        num_freed += freed;
+    }
+
+    return num_freed;
+}
+
+void
+shrinker_dump_stats(struct kbuf* out)
+{
+    list_foreach(&shrinkers, link)
+    {
+        struct shrinker* shrinker =
+            container_of(link, struct shrinker, link);
+        kbprintf(out, "shrinker: %s: %lld calls, %lld pages freed\n",
+                 shrinker->name, shrinker->calls, shrinker->pages_freed);
+    }
+}
+
+#ifdef TEST
+
+#define SHRINKER_TEST_LARGE_NUM_PAGES (1 << (MAX_ORDER - 2))
+
+/*
+    A cache of whole pages, linked through their first word.
+*/
+static void* shrinker_test_cache;
+static size_t shrinker_test_cache_num_pages;
+
+static size_t
+shrinker_test_scan(struct shrinker* shrinker, size_t num_pages)
+{
+    (void)shrinker;
+
+    size_t num_freed = 0;
+    while (shrinker_test_cache && num_freed < num_pages) {
+        void* page = shrinker_test_cache;
+        shrinker_test_cache = *(void**)page;
+        free_pages(page, 1);
+        ++num_freed;
+    }
+
+    shrinker_test_cache_num_pages -= num_freed;
+    return num_freed;
+}
+
+/*
+    Fills memory with cache pages until an allocation that may not reclaim
+    fails, then checks that large allocations still succeed by shrinking the
+    cache.
+*/
+void
+shrinker_test(void)
+{
+    kprintf("shrinker_test\n");
+
+    struct shrinker shrinker = {
+        .name = "shrinker_test",
+        .scan = shrinker_test_scan,
+    };
+    shrinker_register(&shrinker);
+
+    void* page;
+    while ((page = alloc_pages_flags(1, ALLOC_MAY_FAIL))) {
+        *(void**)page = shrinker_test_cache;
+        shrinker_test_cache = page;
+        ++shrinker_test_cache_num_pages;
+    }
+
+    kprintf("shrinker_test: filled memory with %lld cache pages\n",
+            (uint64_t)shrinker_test_cache_num_pages);
+
+    if (alloc_pages_flags(SHRINKER_TEST_LARGE_NUM_PAGES, ALLOC_MAY_FAIL))
+        panic("shrinker_test: allocation should fail without reclaim\n");
+
+    for (size_t i = 0; i < 4; ++i) {
+        void* large = alloc_pages_flags(SHRINKER_TEST_LARGE_NUM_PAGES,
+                                        ALLOC_MAY_FAIL | ALLOC_MAY_RECLAIM);
+        if (!large)
+            panic("shrinker_test: allocation should succeed after reclaim\n");
+        free_pages(large, SHRINKER_TEST_LARGE_NUM_PAGES);
+    }
+
+    void* large = kmalloc_flags(SHRINKER_TEST_LARGE_NUM_PAGES * PAGE_SIZE,
+                                ALLOC_MAY_FAIL | ALLOC_MAY_RECLAIM);
+    if (!large) panic("shrinker_test: kmalloc should succeed after reclaim\n");
+    kfree(large);
+
+    kprintf("shrinker_test: %lld calls, %lld pages reclaimed\n",
+            shrinker.calls, shrinker.pages_freed);
+
+    shrinker_test_scan(&shrinker, SIZE_MAX);
+    shrinker_unregister(&shrinker);
+}
+
+#endif
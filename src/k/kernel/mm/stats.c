@@ -0,0 +1,38 @@
+#include <kernel/mm/stats.h>
+#include <kernel/libk/math.h>
+
+void
+latency_hist_add(struct latency_hist* hist, uint64_t cycles)
+{
+    size_t bucket = 0;
+    if (cycles >> LATENCY_BUCKET_SHIFT) {
+        bucket = 64 - __builtin_clzll(cycles) - LATENCY_BUCKET_SHIFT;
+        bucket = MIN(bucket, LATENCY_BUCKETS - 1);
+    }
+
+    ++hist->buckets[bucket];
+    ++hist->count;
+    hist->total_cycles += cycles;
+    hist->max_cycles = MAX(hist->max_cycles, cycles);
+}
+
+void
+latency_hist_dump(const struct latency_hist* hist, struct kbuf* out)
+{
+    kbprintf(out, "%s: %lld samples, average %lld cycles, max %lld cycles\n",
+             hist->name, hist->count,
+             hist->count ? hist->total_cycles / hist->count : 0,
+             hist->max_cycles);
+
+    for (size_t i = 0; i < LATENCY_BUCKETS; ++i) {
+        if (hist->buckets[i] == 0) continue;
+
+        uint64_t limit = (uint64_t)1 << (i + LATENCY_BUCKET_SHIFT);
+        if (i == LATENCY_BUCKETS - 1)
+            kbprintf(out, "%s:   >= %lld cycles: %lld\n", hist->name,
+                     limit / 2, hist->buckets[i]);
+        else
+            kbprintf(out, "%s:   < %lld cycles: %lld\n", hist->name, limit,
+                     hist->buckets[i]);
+    }
+}
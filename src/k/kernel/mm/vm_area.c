@@ -0,0 +1,293 @@
+#include <kernel/mm/vm_area.h>
+#include <kernel/mm/address_space.h>
+#include <kernel/mm/mm.h>
+#include <kernel/mm/slab.h>
+#include <kernel/cpu/exception.h>
+#include <kernel/cpu/paging.h>
+#include <kernel/fs/uvfs.h>
+#include <kernel/libk/io.h>
+#include <kernel/libk/math.h>
+#include <kernel/libk/string.h>
+
+// Forward declarations
+static struct vm_area* vm_area_insert(struct address_space* as,
+                                      uintptr_t start, uintptr_t end,
+                                      unsigned int flags);
+static struct vm_area* vm_area_grow_stack(struct address_space* as,
+                                          uintptr_t page);
+static void vm_area_read_file(const struct vm_area* area, uintptr_t page,
+                              void* frame);
+
+static struct slab_cache* vm_area_cache;
+
+void
+vm_area_init(void)
+{
+    kprintf("[START] Initialize demand paging\n");
+
+    vm_area_cache = kmem_cache_create("vm_area", sizeof(struct vm_area),
+                                      _Alignof(struct vm_area), NULL, NULL);
+    page_fault_set_handler(vm_handle_fault);
+
+    kprintf("[DONE ] Initialize demand paging\n");
+}
+
+struct vm_area*
+vm_area_map_anon(struct address_space* as, uintptr_t start, size_t size,
+                 unsigned int flags)
+{
+    if (!PAGE_ALIGNED(start) || !PAGE_ALIGNED(size))
+        panic("anonymous area is not page aligned, start=0x%llX\n", start);
+
+    return vm_area_insert(as, start, start + size, flags);
+}
+
+// start, where the file data goes, need not be page aligned.
+struct vm_area*
+vm_area_map_file(struct address_space* as, uintptr_t start, size_t size,
+                 unsigned int flags, const char* path, size_t file_offset,
+                 size_t file_size)
+{
+    if (file_size > size) panic("file data is larger than its area\n");
+
+    struct vm_area* area =
+        vm_area_insert(as, (uintptr_t)PAGE_ALIGN_DOWN(start),
+                       (uintptr_t)PAGE_ALIGN_UP(start + size), flags);
+
+    area->path = kmalloc(strlen(path) + 1);
+    strcpy(area->path, path);
+    area->file_start = start;
+    area->file_size = file_size;
+    area->file_offset = file_offset;
+    return area;
+}
+
+// The list is unordered, a process has a handful of areas.
+struct vm_area*
+vm_area_find(struct address_space* as, uintptr_t vaddr)
+{
+    list_foreach(&as->vm_areas, node)
+    {
+        struct vm_area* area = container_of(node, struct vm_area, link);
+        if (area->start <= vaddr && vaddr < area->end) return area;
+    }
+
+    return NULL;
+}
+
+// Only the areas, the pages are shared by copy_user_half_cow.
+void
+vm_area_copy_all(struct address_space* dst, struct address_space* src)
+{
+    list_foreach(&src->vm_areas, node)
+    {
+        struct vm_area* area = container_of(node, struct vm_area, link);
+        struct vm_area* copy =
+            vm_area_insert(dst, area->start, area->end, area->flags);
+
+        if (area->path) {
+            copy->path = kmalloc(strlen(area->path) + 1);
+            strcpy(copy->path, area->path);
+        }
+        copy->file_start = area->file_start;
+        copy->file_size = area->file_size;
+        copy->file_offset = area->file_offset;
+    }
+}
+
+// Only the areas, the pages are freed with the rest of the user half.
+void
+vm_area_free_all(struct address_space* as)
+{
+    list_foreach_safe(&as->vm_areas, node, tmp)
+    {
+        struct vm_area* area = container_of(node, struct vm_area, link);
+
+        list_remove(&as->vm_areas, &area->link);
+        if (area->path) kfree(area->path);
+        kmem_cache_free(vm_area_cache, area);
+    }
+}
+
+size_t
+vm_area_num_pages(struct address_space* as)
+{
+    size_t num_pages = 0;
+
+    list_foreach(&as->vm_areas, node)
+    {
+        struct vm_area* area = container_of(node, struct vm_area, link);
+        num_pages += (area->end - area->start) / PAGE_SIZE;
+    }
+
+    return num_pages;
+}
+
+/*
+    Faults on pages that are not present are resolved by populating them.
+    The only protection fault resolved is a write to a writable area's page
+    that address_space_fork shared read-only.
+*/
+bool
+vm_handle_fault(void* vaddr, uint64_t code)
+{
+    if ((uintptr_t)vaddr >= KERNEL_HALF_BASE) return false;
+
+    struct address_space* as = current_address_space();
+    uintptr_t page = (uintptr_t)PAGE_ALIGN_DOWN(vaddr);
+    struct vm_area* area = vm_area_find(as, page);
+
+    if (code & PAGE_FAULT_PRESENT) {
+        if (!area || !(code & PAGE_FAULT_WRITE) || !(area->flags & VM_WRITE))
+            return false;
+        return break_cow((void*)page);
+    }
+
+    if (!area) area = vm_area_grow_stack(as, page);
+    if (!area) return false;
+
+    if ((code & PAGE_FAULT_WRITE) && !(area->flags & VM_WRITE)) return false;
+    if ((code & PAGE_FAULT_FETCH) && !(area->flags & VM_EXEC)) return false;
+
+    void* frame = alloc_pagez(1);
+    if (area->path) vm_area_read_file(area, page, frame);
+
+    // The mapping owns the frame's reference, see address_space.h.
+    map_page(vaddr_to_paddr(frame), (void*)page, area->flags & VM_WRITE, 1,
+             MEMORY_TYPE_WB, !(area->flags & VM_EXEC));
+    ++as->num_resident_pages;
+    return true;
+}
+
+static struct vm_area*
+vm_area_insert(struct address_space* as, uintptr_t start, uintptr_t end,
+               unsigned int flags)
+{
+    if (start >= end || end > KERNEL_HALF_BASE)
+        panic("invalid area, start=0x%llX, end=0x%llX\n", start, end);
+
+    list_foreach(&as->vm_areas, node)
+    {
+        struct vm_area* area = container_of(node, struct vm_area, link);
+        if (area->start < end && start < area->end)
+            panic("area overlaps another, start=0x%llX, end=0x%llX\n", start,
+                  end);
+    }
+
+    struct vm_area* area = kmem_cache_alloc(vm_area_cache);
+    area->start = start;
+    area->end = end;
+    area->flags = flags;
+    area->path = NULL;
+    area->file_start = 0;
+    area->file_size = 0;
+    area->file_offset = 0;
+
+    list_node_init(&as->vm_areas, &area->link);
+    list_push(&as->vm_areas, &area->link);
+    return area;
+}
+
+/*
+    A fault below a stack extends the closest stack above it down to the
+    page, up to USER_STACK_MAX_SIZE and keeping an unmapped guard page
+    between it and any area below.
+*/
+static struct vm_area*
+vm_area_grow_stack(struct address_space* as, uintptr_t page)
+{
+    struct vm_area* stack = NULL;
+
+    list_foreach(&as->vm_areas, node)
+    {
+        struct vm_area* area = container_of(node, struct vm_area, link);
+        if ((area->flags & VM_GROWSDOWN) && area->start > page &&
+            (!stack || area->start < stack->start))
+            stack = area;
+    }
+
+    if (!stack || stack->end - page > USER_STACK_MAX_SIZE) return NULL;
+
+    list_foreach(&as->vm_areas, node)
+    {
+        struct vm_area* area = container_of(node, struct vm_area, link);
+        if (area->start < stack->start && area->end + PAGE_SIZE > page)
+            return NULL;
+    }
+
+    stack->start = page;
+    return stack;
+}
+
+// Fills the part of the page that comes from the file, the rest stays zero.
+static void
+vm_area_read_file(const struct vm_area* area, uintptr_t page, void* frame)
+{
+    uintptr_t start = MAX(page, area->file_start);
+    uintptr_t end = MIN(page + PAGE_SIZE, area->file_start + area->file_size);
+    if (start >= end) return;
+
+    if (read(area->path, frame + (start - page), end - start,
+             area->file_offset + (start - area->file_start)) != FS_RESULT_OK)
+        panic("failed to read %s for a page fault\n", area->path);
+}
+
+#ifdef TEST
+
+#define VM_AREA_TEST_VADDR USER_TEST_SLOT(0)
+#define VM_AREA_TEST_FILE  "/bin/init"
+
+/*
+    Touches a file-backed area, an anonymous one and a stack in a fresh
+    address space, checking each page is populated on first touch only.
+*/
+void
+vm_area_test(void)
+{
+    kprintf("vm_area_test\n");
+
+    struct address_space* as = address_space_create();
+    address_space_switch(as);
+
+    // Three pages, of which the first 100 bytes come from the file
+    char* file = VM_AREA_TEST_VADDR;
+    vm_area_map_file(as, (uintptr_t)file, 3 * PAGE_SIZE, 0,
+                     VM_AREA_TEST_FILE, 0, 100);
+    if (as->num_resident_pages != 0 || lookup_paddr(file))
+        panic("vm_area_test: file area was populated eagerly\n");
+
+    if (memcmp(file, "\x7f" "ELF", 4) != 0)
+        panic("vm_area_test: file page does not hold the file\n");
+    if (file[100] != 0 || file[2 * PAGE_SIZE] != 0)
+        panic("vm_area_test: page past the file data is not zeroed\n");
+    if (as->num_resident_pages != 2)
+        panic("vm_area_test: %lld pages resident, expected 2\n",
+              (uint64_t)as->num_resident_pages);
+    if (vm_handle_fault(file + PAGE_SIZE, PAGE_FAULT_WRITE))
+        panic("vm_area_test: write fault on a read-only area resolved\n");
+
+    char* anon = file + 4 * PAGE_SIZE;
+    vm_area_map_anon(as, (uintptr_t)anon, 2 * PAGE_SIZE, VM_WRITE);
+    anon[PAGE_SIZE] = 'a';
+    if (anon[PAGE_SIZE] != 'a' || as->num_resident_pages != 3)
+        panic("vm_area_test: anonymous page was not populated\n");
+
+    // A one page stack, touched three pages down
+    char* stack_top = file + 16 * PAGE_SIZE;
+    struct vm_area* stack =
+        vm_area_map_anon(as, (uintptr_t)(stack_top - PAGE_SIZE), PAGE_SIZE,
+                         VM_WRITE | VM_GROWSDOWN);
+    stack_top[-3 * PAGE_SIZE] = 's';
+    if (stack->start != (uintptr_t)(stack_top - 3 * PAGE_SIZE))
+        panic("vm_area_test: stack did not grow\n");
+    if (vm_handle_fault(anon + 2 * PAGE_SIZE, PAGE_FAULT_WRITE))
+        panic("vm_area_test: stack grew into the guard page\n");
+
+    kprintf("vm_area_test: %lld of %lld pages resident\n",
+            (uint64_t)as->num_resident_pages, (uint64_t)vm_area_num_pages(as));
+
+    address_space_switch(&kernel_address_space);
+    address_space_put(as);
+}
+
+#endif
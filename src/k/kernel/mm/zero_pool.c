@@ -0,0 +1,97 @@
+#include <kernel/mm/zero_pool.h>
+#include <kernel/libk/io.h>
+#include <kernel/libk/string.h>
+#include <kernel/cpu/paging.h>
+#include <kernel/libk/math.h>
+
+void
+zero_pool_init(struct zero_pool* pool)
+{
+    pool->head = NULL;
+    pool->count = 0;
+    pool->high = ZERO_POOL_HIGH;
+    pool->stats = (struct zero_pool_stats){0};
+}
+
+void*
+zero_pool_alloc(struct zero_pool* pool, struct pfa_state* state)
+{
+    struct page* page = pool->head;
+    if (!page) {
+        ++pool->stats.misses;
+        return NULL;
+    }
+
+    pool->head = page->next;
+    page->next = NULL;
+    page_set_allocated(page, 0);
+    --pool->count;
+
+    ++pool->stats.hits;
+    return pfa_page_to_virt(state, page);
+}
+
+void
+zero_pool_refill(struct zero_pool* pool, struct pfa_state* state,
+                 size_t budget)
+{
+    if (pool->count >= pool->high) return;
+
+    struct page* list = NULL;
+    size_t num_pages = pfa_alloc_pages_bulk(
+        state, MIN(budget, pool->high - pool->count), &list);
+    if (num_pages == 0) return;
+
+    uint64_t start = rdtsc();
+
+    while (list) {
+        struct page* page = list;
+        list = page->next;
+
+        memset(pfa_page_to_virt(state, page), 0, PAGE_SIZE);
+
+        page->next = pool->head;
+        page->refcount = 0;
+        page->flags = PAGE_FLAG_ZEROED;
+        pool->head = page;
+        ++pool->count;
+    }
+
+    pool->stats.zero_cycles += rdtsc() - start;
+    pool->stats.zeroed += num_pages;
+}
+
+size_t
+zero_pool_drain(struct zero_pool* pool, struct pfa_state* state)
+{
+    size_t num_pages = pool->count;
+    struct page* list = pool->head;
+
+    for (struct page* page = list; page; page = page->next)
+        page->flags = 0;
+
+    pool->head = NULL;
+    pool->count = 0;
+    pfa_free_pages_bulk(state, list);
+
+    return num_pages;
+}
+
+void
+zero_pool_dump_stats(const struct zero_pool* pool, struct kbuf* out)
+{
+    const struct zero_pool_stats* stats = &pool->stats;
+    uint64_t zero_cost = stats->zeroed ? stats->zero_cycles / stats->zeroed : 0;
+    uint64_t miss_cost =
+        stats->misses ? stats->miss_cycles / stats->misses : zero_cost;
+
+    kbprintf(out, "zero_pool: %lld pages zeroed (high=%lld)\n",
+             (uint64_t)pool->count, (uint64_t)pool->high);
+    kbprintf(out, "zero_pool: %lld hits, %lld misses\n", stats->hits,
+             stats->misses);
+    kbprintf(out, "zero_pool: worker zeroed %lld pages, %lld cycles per page\n",
+             stats->zeroed, zero_cost);
+    kbprintf(out,
+             "zero_pool: misses cost %lld cycles per page, %lld cycles saved\n",
+             miss_cost, stats->hits * miss_cost);
+}
@@ -6,26 +6,42 @@
 #include <limits.h>
 #include <kernel/libk/ds/list.h>
 #include <kernel/tls.h>
+#include <kernel/mm/slab.h>
+#include <kernel/mm/address_space.h>
+#include <kernel/mm/vm_area.h>
+
+#ifdef TEST
+// QEMU's isa-debug-exit device, it exits with status (value << 1) | 1.
+#define ISA_DEBUG_EXIT_PORT 0xf4
+#define ISA_DEBUG_EXIT_DONE 0x10
+#endif
 
 struct task {
     struct list_node link;
+    struct address_space* address_space;
 };
 
 // Forward declarations
 static void task_init(struct task* task);
 
 static struct list tasks;
+static struct slab_cache* task_cache;
 
 [[noreturn]] void
 sched_init(void)
 {
     list_init(&tasks);
+    task_cache = kmem_cache_create("task", sizeof(struct task),
+                                   _Alignof(struct task), NULL, NULL);
 
-    struct task* task = kzmalloc(sizeof(struct task));
+    struct task* task = kmem_cache_alloc(task_cache);
     task_init(task);
     list_push(&tasks, &task->link);
     tls.current_task = task;
 
+    // The process is loaded into the address space it will run in.
+    task->address_space = address_space_create();
+    address_space_switch(task->address_space);
     load_init_process("/bin/init");
 }
 
@@ -34,11 +50,22 @@ sched_exit(uint64_t code)
 {
     assert(tls.current_task);
 
+    struct address_space* as = tls.current_task->address_space;
+    kprintf("Task exited with %lld of %lld pages resident\n",
+            (uint64_t)as->num_resident_pages, (uint64_t)vm_area_num_pages(as));
+
     struct task* next_task = container_of(
         list_next_circular(&tasks, &tls.current_task->link), struct task, link);
 
-    if (next_task == tls.current_task)
+    if (next_task == tls.current_task) {
+#ifdef TEST
+        // init ran from its first page fault to its exit syscall, which
+        // make check looks for.
+        kprintf("sched_exit: init exited with code %lld\n", code);
+        outb(ISA_DEBUG_EXIT_PORT, ISA_DEBUG_EXIT_DONE);
+#endif
         panic("last task exited with code %lld", code);
+    }
 
     panic("unimplemented");
 }
@@ -48,4 +75,5 @@ task_init(struct task* task)
 {
     list_node_init(&tasks, &task->link);
     list_push(&tasks, &task->link);
+    task->address_space = NULL;
 }
@@ -1,6 +1,7 @@
 #include <kernel/tls.h>
 #include <kernel/libk/io.h>
 #include <kernel/mm/mm.h>
+#include <kernel/cpu/gdt.h>
 
 #define IA32_KERNEL_GS_BASE 0xC0000102
 
@@ -11,6 +12,9 @@ void
 tls_init(void)
 {
     tls.kernel_rsp = (uint64_t)alloc_kernel_stack();
+    // Faults and interrupts in ring 3 run on the stack syscalls enter on,
+    // neither can be in use while user code runs.
+    tss_set_rsp0((void*)tls.kernel_rsp);
     tls.user_rsp = 0;
     wrmsr(IA32_KERNEL_GS_BASE, (uint64_t)&tls);
 